@@ -0,0 +1,170 @@
+#ifndef FILE_IO_HPP
+#define FILE_IO_HPP
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+// Portable file access: stdio opening, atomic replacement, change stamps
+// and read-only memory mapping, for Windows and POSIX.
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// fopen() without the MSVC deprecation error (SDL checks are on).
+inline FILE* open_file(const char* path, const char* mode) {
+#if defined(_MSC_VER)
+    FILE* file = nullptr;
+    return fopen_s(&file, path, mode) == 0 ? file : nullptr;
+#else
+    return fopen(path, mode);
+#endif
+}
+
+// Case-insensitive test for a lower-case extension such as ".obj".
+inline bool has_extension(const char* path, const char* ext) {
+    size_t n = strlen(path), m = strlen(ext);
+    if (n < m) return false;
+    for (size_t i = 0; i < m; ++i)
+        if (tolower((unsigned char)path[n - m + i]) != ext[i]) return false;
+    return true;
+}
+
+// Renames `from` to `to`, replacing `to` if it exists.
+inline bool replace_file(const char* from, const char* to) {
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// Writes `size` bytes to `path` through a temporary file in the same
+// directory, so the file is either replaced whole or left untouched.
+inline bool write_file(const char* path, const void* data, size_t size) {
+    std::string temp = std::string(path) + ".tmp";
+    FILE* file = open_file(temp.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || !replace_file(temp.c_str(), path)) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Size and modification time; a file whose stamp changed must be re-read.
+typedef struct {
+    uint64_t size;
+    int64_t time;
+} FileStamp;
+
+inline bool file_stamp(const char* path, FileStamp& stamp) {
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) return false;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+#endif
+    stamp.size = (uint64_t)st.st_size;
+    stamp.time = (int64_t)st.st_mtime;
+    return true;
+}
+
+// Read-only view of a whole file through the page cache; pages are only
+// read when the parser first touches them, and nothing is copied.
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const char* path) {
+        close();
+#if defined(_WIN32)
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || (unsigned long long)size.QuadPart > (size_t)-1) {
+            close();
+            return false;
+        }
+        length = (size_t)size.QuadPart;
+        if (length == 0) return true;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) ptr = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close();
+            return false;
+        }
+        length = (size_t)st.st_size;
+        if (length == 0) return true;
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, length, MADV_WILLNEED);
+            ptr = (const char*)p;
+        }
+#endif
+        if (!ptr) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr) munmap((void*)ptr, length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        ptr = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const char* ptr = nullptr;
+    size_t length = 0;
+};
+
+#endif
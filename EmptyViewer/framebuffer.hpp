@@ -0,0 +1,230 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <new>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#endif
+
+// Every plane starts on a cache line, and so does every row (linear layout)
+// or every tile (tiled layout).
+#define FB_ALIGN 64
+#define FB_TILE 8
+
+// How color is stored.
+//   COLOR_PLANAR: separate R, G and B byte planes.
+//   COLOR_RGBA8:  one packed word per pixel, R in the low byte, alpha 255.
+enum ColorFormat {
+    COLOR_PLANAR,
+    COLOR_RGBA8
+};
+
+// Pixel order inside every plane.
+//   LAYOUT_LINEAR: row-major, rows padded to FB_ALIGN bytes of depth.
+//   LAYOUT_TILED:  FB_TILE x FB_TILE tiles, each stored contiguously
+//                  (row-major inside the tile), tiles in row-major order.
+//                  One 8x8 raster block then touches 4 cache lines of depth
+//                  instead of 8.
+enum PixelLayout {
+    LAYOUT_LINEAR,
+    LAYOUT_TILED
+};
+
+// Uninitialized, FB_ALIGN-aligned heap array.
+template <typename T>
+class AlignedArray {
+public:
+    AlignedArray() {}
+    explicit AlignedArray(size_t count) : count(count) {
+        if (!count) return;
+        size_t bytes = (count * sizeof(T) + FB_ALIGN - 1) & ~(size_t)(FB_ALIGN - 1);
+#if defined(_MSC_VER)
+        ptr = (T*)_aligned_malloc(bytes, FB_ALIGN);
+#else
+        void* p = nullptr;
+        if (posix_memalign(&p, FB_ALIGN, bytes) == 0) ptr = (T*)p;
+#endif
+        if (!ptr) throw std::bad_alloc();
+    }
+    ~AlignedArray() {
+#if defined(_MSC_VER)
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    AlignedArray(AlignedArray&& other) noexcept { swap(other); }
+    AlignedArray& operator=(AlignedArray&& other) noexcept { swap(other); return *this; }
+    AlignedArray(const AlignedArray&) = delete;
+    AlignedArray& operator=(const AlignedArray&) = delete;
+
+    T* data() { return ptr; }
+    const T* data() const { return ptr; }
+    size_t size() const { return count; }
+    T& operator[](size_t i) { return ptr[i]; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+
+    void swap(AlignedArray& other) {
+        std::swap(ptr, other.ptr);
+        std::swap(count, other.count);
+    }
+
+private:
+    T* ptr = nullptr;
+    size_t count = 0;
+};
+
+// Sets n 32-bit words to v with SSE2 stores. Streaming (non-temporal) stores
+// bypass the cache; use them for memory that will not be read again soon.
+inline void fill_words(uint32_t* p, size_t n, uint32_t v, bool streaming) {
+    uint32_t* end = p + n;
+    for (; p < end && ((uintptr_t)p & 15); ++p) *p = v;
+    __m128i v4 = _mm_set1_epi32((int)v);
+    if (streaming) {
+        for (; p + 4 <= end; p += 4) _mm_stream_si128((__m128i*)p, v4);
+    } else {
+        for (; p + 4 <= end; p += 4) _mm_store_si128((__m128i*)p, v4);
+    }
+    for (; p < end; ++p) *p = v;
+}
+
+inline void fill_bytes(unsigned char* p, size_t n, unsigned char v, bool streaming) {
+    unsigned char* end = p + n;
+    for (; p < end && ((uintptr_t)p & 15); ++p) *p = v;
+    __m128i v16 = _mm_set1_epi8((char)v);
+    if (streaming) {
+        for (; p + 16 <= end; p += 16) _mm_stream_si128((__m128i*)p, v16);
+    } else {
+        for (; p + 16 <= end; p += 16) _mm_store_si128((__m128i*)p, v16);
+    }
+    for (; p < end; ++p) *p = v;
+}
+
+// Render target of runtime size: color, depth and a 32-bit id plane (the
+// visibility buffer), each in its own aligned plane. Pixels are addressed in
+// image coordinates (row 0 on top) through index(), which is the same for
+// every plane.
+class FrameBuffer {
+public:
+    FrameBuffer(int width, int height, ColorFormat format = COLOR_PLANAR, PixelLayout layout = LAYOUT_LINEAR)
+        : w(width), h(height), colorFormat(format), pixelLayout(layout) {
+        int align = layout == LAYOUT_TILED ? FB_TILE : FB_ALIGN / (int)sizeof(float);
+        paddedW = (width + align - 1) / align * align;
+        paddedH = layout == LAYOUT_TILED ? (height + FB_TILE - 1) / FB_TILE * FB_TILE : height;
+        size_t count = (size_t)paddedW * paddedH;
+
+        if (format == COLOR_RGBA8) {
+            rgba = AlignedArray<uint32_t>(count);
+        } else {
+            for (int c = 0; c < 3; ++c) planes[c] = AlignedArray<unsigned char>(count);
+        }
+        depthPlane = AlignedArray<float>(count);
+        idPlane = AlignedArray<uint32_t>(count);
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    ColorFormat format() const { return colorFormat; }
+    PixelLayout layout() const { return pixelLayout; }
+    // Number of entries in each plane, padding included.
+    size_t plane_size() const { return depthPlane.size(); }
+
+    size_t index(int x, int y) const {
+        if (pixelLayout == LAYOUT_LINEAR) return (size_t)y * paddedW + x;
+        size_t tile = (size_t)(y / FB_TILE) * (paddedW / FB_TILE) + x / FB_TILE;
+        return tile * (FB_TILE * FB_TILE) + (y % FB_TILE) * FB_TILE + x % FB_TILE;
+    }
+
+    float* depth() { return depthPlane.data(); }
+    const float* depth() const { return depthPlane.data(); }
+    uint32_t* ids() { return idPlane.data(); }
+    const uint32_t* ids() const { return idPlane.data(); }
+
+    void set_color(size_t i, const unsigned char rgb[3]) {
+        if (colorFormat == COLOR_RGBA8) {
+            rgba[i] = rgb[0] | (uint32_t)rgb[1] << 8 | (uint32_t)rgb[2] << 16 | 0xFF000000u;
+        } else {
+            planes[0][i] = rgb[0];
+            planes[1][i] = rgb[1];
+            planes[2][i] = rgb[2];
+        }
+    }
+
+    void get_color(size_t i, unsigned char rgb[3]) const {
+        if (colorFormat == COLOR_RGBA8) {
+            uint32_t p = rgba[i];
+            rgb[0] = (unsigned char)p;
+            rgb[1] = (unsigned char)(p >> 8);
+            rgb[2] = (unsigned char)(p >> 16);
+        } else {
+            rgb[0] = planes[0][i];
+            rgb[1] = planes[1][i];
+            rgb[2] = planes[2][i];
+        }
+    }
+
+    // Black color, `depthValue` everywhere and `id` in the id plane, written
+    // with streaming stores over whole planes.
+    void clear(float depthValue, uint32_t id) {
+        fill_span(0, plane_size(), depthValue, id, true);
+        _mm_sfence();
+    }
+
+    // Same as clear(), restricted to [x0, x1) x [y0, y1).
+    void fill_rect(int x0, int y0, int x1, int y1, float depthValue, uint32_t id, bool streaming) {
+        for (int y = y0; y < y1; ++y) {
+            if (pixelLayout == LAYOUT_LINEAR) {
+                fill_span(index(x0, y), x1 - x0, depthValue, id, streaming);
+                continue;
+            }
+            // Row segments inside one FB_TILE-wide tile column are contiguous.
+            for (int x = x0; x < x1;) {
+                int next = std::min((x / FB_TILE + 1) * FB_TILE, x1);
+                fill_span(index(x, y), next - x, depthValue, id, streaming);
+                x = next;
+            }
+        }
+        if (streaming) _mm_sfence();
+    }
+
+    // Copies the color into `out` as tightly packed top-down RGB rows.
+    void read_rgb(unsigned char* out) const {
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x, out += 3)
+                get_color(index(x, y), out);
+    }
+
+private:
+    void fill_span(size_t start, size_t count, float depthValue, uint32_t id, bool streaming) {
+        uint32_t depthBits;
+        memcpy(&depthBits, &depthValue, sizeof(depthBits));
+        if (colorFormat == COLOR_RGBA8) {
+            fill_words(rgba.data() + start, count, 0xFF000000u, streaming);
+        } else {
+            for (int c = 0; c < 3; ++c) fill_bytes(planes[c].data() + start, count, 0, streaming);
+        }
+        fill_words((uint32_t*)depthPlane.data() + start, count, depthBits, streaming);
+        fill_words(idPlane.data() + start, count, id, streaming);
+    }
+
+    int w, h;
+    int paddedW, paddedH;
+    ColorFormat colorFormat;
+    PixelLayout pixelLayout;
+    AlignedArray<unsigned char> planes[3];
+    AlignedArray<uint32_t> rgba;
+    AlignedArray<float> depthPlane;
+    AlignedArray<uint32_t> idPlane;
+};
+
+#endif
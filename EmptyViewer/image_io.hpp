@@ -0,0 +1,941 @@
+#ifndef IMAGE_IO_HPP
+#define IMAGE_IO_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "file_io.hpp"
+#include "framebuffer.hpp"
+
+// Tightly packed, top-down 8-bit RGB image.
+struct Image {
+    int width = 0, height = 0;
+    std::vector<unsigned char> rgb;
+};
+
+inline Image read_image(const FrameBuffer& target) {
+    Image image;
+    image.width = target.width();
+    image.height = target.height();
+    image.rgb.resize((size_t)image.width * image.height * 3);
+    target.read_rgb(image.rgb.data());
+    return image;
+}
+
+enum ImageFormat {
+    IMAGE_PPM,
+    IMAGE_QOI,
+    IMAGE_PNG
+};
+
+// PNG deflate mode.
+//   PNG_STORED: uncompressed deflate blocks.
+//   PNG_FAST:   Sub row filter, single-probe LZ77 and the fixed Huffman
+//               code; rendered frames shrink by about 100x for roughly 1.5x
+//               the encoding time of stored blocks.
+enum PngCompression {
+    PNG_STORED,
+    PNG_FAST
+};
+
+// Format from the file extension; false for an unknown one.
+inline bool image_format_for_path(const char* path, ImageFormat& format) {
+    if (has_extension(path, ".ppm")) format = IMAGE_PPM;
+    else if (has_extension(path, ".qoi")) format = IMAGE_QOI;
+    else if (has_extension(path, ".png")) format = IMAGE_PNG;
+    else return false;
+    return true;
+}
+
+inline void put_be32(std::vector<unsigned char>& out, uint32_t v) {
+    unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+    out.insert(out.end(), b, b + 4);
+}
+
+inline void encode_ppm(const Image& image, std::vector<unsigned char>& out) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", image.width, image.height);
+    out.insert(out.end(), header, header + n);
+    out.insert(out.end(), image.rgb.begin(), image.rgb.end());
+}
+
+// QOI ("Quite OK Image"), 3 channels, following the 1.0 specification.
+inline void encode_qoi(const Image& image, std::vector<unsigned char>& out) {
+    size_t pixels = (size_t)image.width * image.height;
+    out.reserve(out.size() + 14 + pixels * 4 + 8);
+    out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+    put_be32(out, (uint32_t)image.width);
+    put_be32(out, (uint32_t)image.height);
+    out.push_back(3);   // channels
+    out.push_back(0);   // sRGB
+
+    // Pixels are packed as r | g << 8 | b << 16 | a << 24 with a = 255.
+    uint32_t seen[64] = { 0 };
+    uint32_t prev = 0xFF000000u;
+    int run = 0;
+    const unsigned char* p = image.rgb.data();
+    for (size_t i = 0; i < pixels; ++i, p += 3) {
+        uint32_t px = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | 0xFF000000u;
+        if (px == prev) {
+            if (++run == 62) {
+                out.push_back((unsigned char)(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            out.push_back((unsigned char)(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        int hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+        if (seen[hash] == px) {
+            out.push_back((unsigned char)hash);
+        } else {
+            seen[hash] = px;
+            // Differences wrap around, as the specification requires.
+            int dr = (signed char)(p[0] - (unsigned char)prev);
+            int dg = (signed char)(p[1] - (unsigned char)(prev >> 8));
+            int db = (signed char)(p[2] - (unsigned char)(prev >> 16));
+            int drdg = dr - dg, dbdg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back((unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+            } else if (dg >= -32 && dg <= 31 && drdg >= -8 && drdg <= 7 && dbdg >= -8 && dbdg <= 7) {
+                out.push_back((unsigned char)(0x80 | (dg + 32)));
+                out.push_back((unsigned char)((drdg + 8) << 4 | (dbdg + 8)));
+            } else {
+                unsigned char rgb[4] = { 0xFE, p[0], p[1], p[2] };
+                out.insert(out.end(), rgb, rgb + 4);
+            }
+        }
+        prev = px;
+    }
+    if (run) out.push_back((unsigned char)(0xC0 | (run - 1)));
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+}
+
+// CRC-32 as used by PNG, eight bytes per step (slicing-by-8).
+inline uint32_t crc32_update(uint32_t crc, const unsigned char* p, size_t n) {
+    struct Table {
+        uint32_t v[8][256];
+        Table() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                v[0][i] = c;
+            }
+            for (int t = 1; t < 8; ++t)
+                for (int i = 0; i < 256; ++i) v[t][i] = (v[t - 1][i] >> 8) ^ v[0][v[t - 1][i] & 0xFF];
+        }
+    };
+    static const Table table;
+    const uint32_t (*v)[256] = table.v;
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = crc ^ (p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = v[7][lo & 0xFF] ^ v[6][(lo >> 8) & 0xFF] ^ v[5][(lo >> 16) & 0xFF] ^ v[4][lo >> 24] ^
+            v[3][p[4]] ^ v[2][p[5]] ^ v[1][p[6]] ^ v[0][p[7]];
+    }
+    for (; n; --n) crc = v[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t adler32(const unsigned char* p, size_t n) {
+    uint32_t a = 1, b = 0;
+    while (n) {
+        // Largest run before b can overflow 32 bits.
+        size_t k = n < 5552 ? n : 5552;
+        n -= k;
+        for (; k; --k) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+// LSB-first bit stream, as deflate stores it.
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+    void put(uint32_t value, int count) {
+        bits |= (uint64_t)value << fill;
+        fill += count;
+        while (fill >= 8) {
+            out.push_back((unsigned char)bits);
+            bits >>= 8;
+            fill -= 8;
+        }
+    }
+
+    void align() {
+        if (fill) put(0, 8 - fill);
+    }
+
+private:
+    std::vector<unsigned char>& out;
+    uint64_t bits = 0;
+    int fill = 0;
+};
+
+// Code tables for fixed-Huffman deflate (RFC 1951, 3.2.5 and 3.2.6). Codes
+// are stored bit-reversed so they can be written LSB first.
+struct DeflateTables {
+    uint16_t litCode[288];
+    uint8_t litLength[288];
+    uint16_t distCode[30];
+    uint8_t lengthSymbol[259];      // match length -> length code 0..28
+    uint8_t distSmall[256];         // distance - 1 -> distance code
+    uint8_t distLarge[256];         // (distance - 1) >> 7 -> distance code
+
+    static const uint16_t* length_base() {
+        static const uint16_t base[29] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+        };
+        return base;
+    }
+    static const uint8_t* length_extra() {
+        static const uint8_t extra[29] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+        return extra;
+    }
+    static const uint16_t* dist_base() {
+        static const uint16_t base[30] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+        };
+        return base;
+    }
+    static const uint8_t* dist_extra() {
+        static const uint8_t extra[30] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+        };
+        return extra;
+    }
+
+    static uint16_t reverse(uint32_t code, int length) {
+        uint32_t r = 0;
+        for (int i = 0; i < length; ++i, code >>= 1) r = r << 1 | (code & 1);
+        return (uint16_t)r;
+    }
+
+    DeflateTables() {
+        for (int s = 0; s < 288; ++s) {
+            uint32_t code;
+            int length;
+            if (s < 144) { code = 0x30 + s; length = 8; }
+            else if (s < 256) { code = 0x190 + s - 144; length = 9; }
+            else if (s < 280) { code = s - 256; length = 7; }
+            else { code = 0xC0 + s - 280; length = 8; }
+            litCode[s] = reverse(code, length);
+            litLength[s] = (uint8_t)length;
+        }
+        for (int d = 0; d < 30; ++d) distCode[d] = reverse(d, 5);
+        for (int c = 0, len = 3; len <= 258; ++len) {
+            while (c < 28 && length_base()[c + 1] <= len) ++c;
+            lengthSymbol[len] = (uint8_t)c;
+        }
+        for (int c = 0, d = 1; d <= 256; ++d) {
+            while (c < 29 && dist_base()[c + 1] <= d) ++c;
+            distSmall[d - 1] = (uint8_t)c;
+        }
+        for (int c = 0, i = 0; i < 256; ++i) {
+            int d = (i << 7) + 1;
+            while (c < 29 && dist_base()[c + 1] <= d) ++c;
+            distLarge[i] = (uint8_t)c;
+        }
+    }
+};
+
+// Appends a zlib stream holding `data` to `out`.
+inline void zlib_compress(const unsigned char* data, size_t size, PngCompression mode, std::vector<unsigned char>& out) {
+    out.push_back(0x78);
+    out.push_back(0x01);
+    BitWriter bits(out);
+
+    if (mode == PNG_STORED) {
+        size_t pos = 0;
+        do {
+            size_t n = std::min(size - pos, (size_t)65535);
+            bits.put(pos + n == size, 1);
+            bits.put(0, 2);
+            bits.align();
+            unsigned char len[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)~n, (unsigned char)(~n >> 8) };
+            out.insert(out.end(), len, len + 4);
+            out.insert(out.end(), data + pos, data + pos + n);
+            pos += n;
+        } while (pos < size);
+    } else {
+        static const DeflateTables t;
+        const int hashBits = 15, window = 32768;
+        std::vector<int32_t> head((size_t)1 << hashBits, -1);
+        bits.put(1, 1);    // final block
+        bits.put(1, 2);    // fixed Huffman
+        auto literal = [&](unsigned char c) { bits.put(t.litCode[c], t.litLength[c]); };
+        auto hash = [&](size_t i) {
+            uint32_t v;
+            memcpy(&v, data + i, 4);
+            return (v * 2654435761u) >> (32 - hashBits);
+        };
+
+        size_t i = 0;
+        while (i + 4 <= size) {
+            uint32_t h = hash(i);
+            int32_t candidate = head[h];
+            head[h] = (int32_t)i;
+            if (candidate < 0 || i - candidate > (size_t)window || memcmp(data + candidate, data + i, 4) != 0) {
+                literal(data[i++]);
+                continue;
+            }
+            size_t limit = std::min(size - i, (size_t)258), len = 4;
+            while (len < limit && data[candidate + len] == data[i + len]) ++len;
+            size_t dist = i - candidate;
+
+            int lc = t.lengthSymbol[len];
+            bits.put(t.litCode[257 + lc], t.litLength[257 + lc]);
+            bits.put((uint32_t)(len - DeflateTables::length_base()[lc]), DeflateTables::length_extra()[lc]);
+            int dc = dist <= 256 ? t.distSmall[dist - 1] : t.distLarge[(dist - 1) >> 7];
+            bits.put(t.distCode[dc], 5);
+            bits.put((uint32_t)(dist - DeflateTables::dist_base()[dc]), DeflateTables::dist_extra()[dc]);
+
+            // Index the positions inside the match so later repeats find it.
+            size_t end = i + len;
+            for (++i; i < end && i + 4 <= size; ++i) head[hash(i)] = (int32_t)i;
+            i = end;
+        }
+        for (; i < size; ++i) literal(data[i]);
+        bits.put(t.litCode[256], t.litLength[256]);
+    }
+    bits.align();
+    put_be32(out, adler32(data, size));
+}
+
+inline void put_png_chunk(std::vector<unsigned char>& out, const char type[4], const unsigned char* data, size_t size) {
+    put_be32(out, (uint32_t)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_be32(out, crc32_update(0, &out[start], size + 4));
+}
+
+// 8-bit RGB PNG with a single IDAT chunk.
+inline void encode_png(const Image& image, PngCompression mode, std::vector<unsigned char>& out) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+
+    std::vector<unsigned char> ihdr;
+    put_be32(ihdr, (uint32_t)image.width);
+    put_be32(ihdr, (uint32_t)image.height);
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });   // 8-bit RGB, not interlaced
+    put_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+    // Each row gets a filter byte: 0 (none) when stored, 1 (Sub: difference
+    // to the pixel on the left) otherwise, which turns smooth shading and
+    // flat background into small repeating values.
+    size_t stride = (size_t)image.width * 3;
+    std::vector<unsigned char> filtered((stride + 1) * image.height);
+    for (int y = 0; y < image.height; ++y) {
+        const unsigned char* src = &image.rgb[y * stride];
+        unsigned char* dst = &filtered[y * (stride + 1)];
+        if (mode == PNG_STORED) {
+            dst[0] = 0;
+            memcpy(dst + 1, src, stride);
+        } else {
+            dst[0] = 1;
+            for (size_t i = 0; i < stride; ++i) dst[1 + i] = (unsigned char)(src[i] - (i >= 3 ? src[i - 3] : 0));
+        }
+    }
+    // IDAT is compressed in place; its length is filled in afterwards.
+    size_t start = out.size();
+    put_be32(out, 0);
+    out.insert(out.end(), { 'I', 'D', 'A', 'T' });
+    zlib_compress(filtered.data(), filtered.size(), mode, out);
+    size_t size = out.size() - start - 8;
+    for (int k = 0; k < 4; ++k) out[start + k] = (unsigned char)(size >> (24 - 8 * k));
+    put_be32(out, crc32_update(0, &out[start + 4], size + 4));
+    put_png_chunk(out, "IEND", nullptr, 0);
+}
+
+inline void encode_image(const Image& image, ImageFormat format, PngCompression png, std::vector<unsigned char>& out) {
+    switch (format) {
+    case IMAGE_QOI: encode_qoi(image, out); break;
+    case IMAGE_PNG: encode_png(image, png, out); break;
+    default: encode_ppm(image, out); break;
+    }
+}
+
+// Encodes `image` in the format named by the extension of `path` (PPM when
+// unknown) and writes it; false if the file could not be written.
+inline bool save_image(const char* path, const Image& image, PngCompression png) {
+    ImageFormat format = IMAGE_PPM;
+    image_format_for_path(path, format);
+    std::vector<unsigned char> bytes;
+    encode_image(image, format, png, bytes);
+    return write_file(path, bytes.data(), bytes.size());
+}
+
+// Skips whitespace and '#' comments in a PPM header, then reads a decimal
+// field; false when there is none.
+inline bool read_ppm_field(const unsigned char*& p, const unsigned char* end, int& value) {
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+        if (p < end && *p == '#') {
+            while (p < end && *p != '\n') ++p;
+            continue;
+        }
+        break;
+    }
+    if (p == end || *p < '0' || *p > '9') return false;
+    long long v = 0;
+    while (p < end && *p >= '0' && *p <= '9' && v <= 1 << 24) v = v * 10 + (*p++ - '0');
+    value = (int)v;
+    return v <= 1 << 24;
+}
+
+// Binary PPM (P6) or PGM (P5) with 8-bit samples; gray is expanded to RGB.
+inline bool decode_ppm(const unsigned char* data, size_t size, Image& image, const char*& error) {
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+    if (size < 2 || p[0] != 'P' || (p[1] != '6' && p[1] != '5')) {
+        error = "not a binary PPM or PGM file";
+        return false;
+    }
+    int channels = p[1] == '6' ? 3 : 1;
+    p += 2;
+    int maxValue;
+    if (!read_ppm_field(p, end, image.width) || !read_ppm_field(p, end, image.height) ||
+        !read_ppm_field(p, end, maxValue) || p == end) {
+        error = "malformed header";
+        return false;
+    }
+    if (maxValue != 255) {
+        error = "only 8-bit samples are supported";
+        return false;
+    }
+    if ((uint64_t)image.width * image.height > (1ull << 28)) {
+        error = "image too large";
+        return false;
+    }
+    ++p;    // the single whitespace byte before the samples
+    size_t pixels = (size_t)image.width * image.height;
+    if (!pixels || (uint64_t)(end - p) < (uint64_t)pixels * channels) {
+        error = "truncated pixel data";
+        return false;
+    }
+    image.rgb.resize(pixels * 3);
+    if (channels == 3) {
+        memcpy(image.rgb.data(), p, pixels * 3);
+    } else {
+        for (size_t i = 0; i < pixels; ++i)
+            image.rgb[i * 3] = image.rgb[i * 3 + 1] = image.rgb[i * 3 + 2] = p[i];
+    }
+    return true;
+}
+
+// LSB-first bit stream over a deflate stream, refilled a byte at a time
+// into a 64-bit buffer. Past the end it reads zero bytes; overrun() tells
+// whether any of them were consumed.
+class BitReader {
+public:
+    BitReader(const unsigned char* p, const unsigned char* end) : p(p), end(end) {}
+
+    void refill() {
+        for (; fill <= 56; fill += 8) {
+            if (p < end) bits |= (uint64_t)*p++ << fill;
+            else ++padding;
+        }
+    }
+
+    uint32_t peek(int count) {
+        if (fill < count) refill();
+        return (uint32_t)(bits & ((1ull << count) - 1));
+    }
+
+    void consume(int count) {
+        bits >>= count;
+        fill -= count;
+    }
+
+    uint32_t get(int count) {
+        uint32_t v = peek(count);
+        consume(count);
+        return v;
+    }
+
+    bool overrun() const { return truncated || fill < padding * 8; }
+
+    // Drops the bits up to the next byte boundary and returns the position
+    // of the first whole byte not yet consumed.
+    const unsigned char* align() {
+        consume(fill & 7);
+        truncated = overrun();
+        const unsigned char* at = truncated ? end : p - (fill / 8 - padding);
+        bits = 0;
+        fill = 0;
+        padding = 0;
+        p = at;
+        return at;
+    }
+
+    void skip_to(const unsigned char* at) { p = at; }
+
+private:
+    const unsigned char* p;
+    const unsigned char* end;
+    uint64_t bits = 0;
+    int fill = 0;
+    int padding = 0;        // zero bytes buffered past the end
+    bool truncated = false;
+};
+
+// Canonical Huffman decoder. Codes of up to HUFFMAN_FAST_BITS bits resolve
+// with one table lookup (entries are symbol << 4 | length); longer ones
+// fall back to walking the code lengths.
+#define HUFFMAN_FAST_BITS 10
+
+struct HuffmanDecoder {
+    uint16_t fast[1 << HUFFMAN_FAST_BITS];
+    uint16_t counts[16];
+    uint16_t symbols[288];
+
+    // False when the lengths over-subscribe the code space; incomplete
+    // codes are allowed, as deflate permits them for a single distance.
+    bool build(const uint8_t* lengths, int n) {
+        memset(counts, 0, sizeof(counts));
+        for (int s = 0; s < n; ++s) ++counts[lengths[s]];
+        counts[0] = 0;
+        int left = 1;
+        for (int len = 1; len < 16; ++len) {
+            left = (left << 1) - counts[len];
+            if (left < 0) return false;
+        }
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len) offsets[len + 1] = offsets[len] + counts[len];
+        for (int s = 0; s < n; ++s)
+            if (lengths[s]) symbols[offsets[lengths[s]]++] = (uint16_t)s;
+
+        memset(fast, 0, sizeof(fast));
+        int code = 0, index = 0;
+        for (int len = 1; len <= HUFFMAN_FAST_BITS; ++len) {
+            for (int i = 0; i < counts[len]; ++i, ++code, ++index) {
+                uint32_t reversed = DeflateTables::reverse(code, len);
+                for (uint32_t k = reversed; k < (1u << HUFFMAN_FAST_BITS); k += 1u << len)
+                    fast[k] = (uint16_t)(symbols[index] << 4 | len);
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+
+    // Next symbol, or -1 for a code that is not in the table.
+    int decode(BitReader& in) const {
+        uint32_t bits = in.peek(15);
+        uint16_t e = fast[bits & ((1u << HUFFMAN_FAST_BITS) - 1)];
+        if (e) {
+            in.consume(e & 15);
+            return e >> 4;
+        }
+        // Codes are stored MSB first within the LSB-first stream.
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; ++len) {
+            code |= (bits >> (len - 1)) & 1;
+            int count = counts[len];
+            if (code - first < count) {
+                in.consume(len);
+                return symbols[index + code - first];
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+};
+
+// Appends the data of the zlib stream [data, data + size) to `out`; fails
+// when the stream holds more than `limit` bytes.
+inline bool zlib_decompress(const unsigned char* data, size_t size, size_t limit, std::vector<unsigned char>& out,
+    const char*& error) {
+    if (size < 6 || (data[0] & 0x0F) != 8 || (data[0] << 8 | data[1]) % 31 != 0 || (data[1] & 0x20)) {
+        error = "unsupported zlib stream";
+        return false;
+    }
+    size_t start = out.size();
+    BitReader in(data + 2, data + size);
+    static const uint8_t lengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    HuffmanDecoder lit, dist;
+    for (bool last = false; !last;) {
+        last = in.get(1) != 0;
+        int type = (int)in.get(2);
+        if (type == 0) {
+            const unsigned char* p = in.align();
+            if (data + size - p < 4 || (p[0] | p[1] << 8) != (~(p[2] | p[3] << 8) & 0xFFFF)) {
+                error = "corrupt stored block";
+                return false;
+            }
+            size_t n = p[0] | p[1] << 8;
+            p += 4;
+            if ((size_t)(data + size - p) < n) {
+                error = "truncated stored block";
+                return false;
+            }
+            if (n > limit - (out.size() - start)) {
+                error = "more data than expected";
+                return false;
+            }
+            out.insert(out.end(), p, p + n);
+            in.skip_to(p + n);
+            continue;
+        }
+
+        uint8_t lengths[288 + 32];
+        if (type == 1) {
+            for (int s = 0; s < 288; ++s) lengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+            for (int s = 0; s < 30; ++s) lengths[288 + s] = 5;
+            lit.build(lengths, 288);
+            dist.build(lengths + 288, 30);
+        } else if (type == 2) {
+            int nlit = (int)in.get(5) + 257, ndist = (int)in.get(5) + 1, ncode = (int)in.get(4) + 4;
+            uint8_t codeLengths[19] = { 0 };
+            for (int i = 0; i < ncode; ++i) codeLengths[lengthOrder[i]] = (uint8_t)in.get(3);
+            HuffmanDecoder code;
+            if (nlit > 286 || ndist > 30 || !code.build(codeLengths, 19)) {
+                error = "corrupt dynamic block";
+                return false;
+            }
+            for (int i = 0; i < nlit + ndist;) {
+                int sym = code.decode(in);
+                int repeat = 1, value = sym;
+                if (sym == 16) {
+                    if (i == 0) sym = -1;
+                    else { value = lengths[i - 1]; repeat = 3 + (int)in.get(2); }
+                } else if (sym == 17) {
+                    value = 0; repeat = 3 + (int)in.get(3);
+                } else if (sym == 18) {
+                    value = 0; repeat = 11 + (int)in.get(7);
+                }
+                if (sym < 0 || i + repeat > nlit + ndist) {
+                    error = "corrupt dynamic block";
+                    return false;
+                }
+                while (repeat--) lengths[i++] = (uint8_t)value;
+            }
+            if (!lit.build(lengths, nlit) || !dist.build(lengths + nlit, ndist)) {
+                error = "corrupt dynamic block";
+                return false;
+            }
+        } else {
+            error = "invalid block type";
+            return false;
+        }
+
+        for (;;) {
+            int sym = lit.decode(in);
+            // Past the end the zero padding can decode as a literal forever.
+            if (sym == 256 || in.overrun()) break;
+            if (sym >= 0 && sym < 256) {
+                if (out.size() - start == limit) {
+                    error = "more data than expected";
+                    return false;
+                }
+                out.push_back((unsigned char)sym);
+                continue;
+            }
+            sym -= 257;
+            if (sym < 0 || sym >= 29) {
+                error = "invalid length code";
+                return false;
+            }
+            size_t len = DeflateTables::length_base()[sym] + in.get(DeflateTables::length_extra()[sym]);
+            int dc = dist.decode(in);
+            if (dc < 0 || dc >= 30) {
+                error = "invalid distance code";
+                return false;
+            }
+            size_t d = DeflateTables::dist_base()[dc] + in.get(DeflateTables::dist_extra()[dc]);
+            if (d > out.size() - start) {
+                error = "distance before the start of the stream";
+                return false;
+            }
+            if (len > limit - (out.size() - start)) {
+                error = "more data than expected";
+                return false;
+            }
+            // Byte by byte: the source may overlap what is being written.
+            size_t from = out.size() - d;
+            for (size_t k = 0; k < len; ++k) out.push_back(out[from + k]);
+        }
+        if (in.overrun()) {
+            error = "truncated deflate stream";
+            return false;
+        }
+    }
+    const unsigned char* p = in.align();
+    if (in.overrun() || data + size - p < 4 ||
+        adler32(&out[start], out.size() - start) != ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])) {
+        error = "zlib checksum mismatch";
+        return false;
+    }
+    return true;
+}
+
+inline uint32_t get_be32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Non-interlaced PNG of any standard color type and bit depth. Samples are
+// reduced to 8 bits, gray is expanded to RGB and alpha is dropped.
+inline bool decode_png(const unsigned char* data, size_t size, Image& image, const char*& error) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size < 8 || memcmp(data, signature, 8) != 0) {
+        error = "not a PNG file";
+        return false;
+    }
+    int width = 0, height = 0, depth = 0, colorType = -1;
+    std::vector<unsigned char> idat, palette;
+    bool sawEnd = false;
+    for (size_t pos = 8; !sawEnd;) {
+        if (size - pos < 12 || get_be32(data + pos) > size - pos - 12) {
+            error = "truncated chunk";
+            return false;
+        }
+        uint32_t length = get_be32(data + pos);
+        const unsigned char* type = data + pos + 4;
+        const unsigned char* body = type + 4;
+        if (crc32_update(0, type, length + 4) != get_be32(body + length)) {
+            error = "chunk checksum mismatch";
+            return false;
+        }
+        if (memcmp(type, "IHDR", 4) == 0) {
+            if (length != 13 || body[10] != 0 || body[11] != 0) {
+                error = "malformed header";
+                return false;
+            }
+            if (body[12] != 0) {
+                error = "interlaced PNG is not supported";
+                return false;
+            }
+            width = (int)std::min(get_be32(body), 1u << 24);
+            height = (int)std::min(get_be32(body + 4), 1u << 24);
+            depth = body[8];
+            colorType = body[9];
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            palette.assign(body, body + length);
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat.insert(idat.end(), body, body + length);
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            sawEnd = true;
+        }
+        pos += 12 + (size_t)length;
+    }
+
+    // Channels per color type 0 (gray), 2 (RGB), 3 (palette), 4 (gray and
+    // alpha) and 6 (RGBA), and the bit depths each allows.
+    static const int channelTable[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    int channels = colorType >= 0 && colorType <= 6 ? channelTable[colorType] : 0;
+    bool depthOk = depth == 8 || (depth == 16 && colorType != 3) ||
+        ((depth == 1 || depth == 2 || depth == 4) && (colorType == 0 || colorType == 3));
+    if (!width || !height || !channels || !depthOk) {
+        error = "unsupported color type or bit depth";
+        return false;
+    }
+    if (colorType == 3 && (palette.empty() || palette.size() % 3)) {
+        error = "missing palette";
+        return false;
+    }
+    if ((uint64_t)width * height > (1ull << 28)) {
+        error = "image too large";
+        return false;
+    }
+
+    size_t bits = (size_t)width * channels * depth;
+    size_t stride = (bits + 7) / 8;
+    size_t bpp = std::max<size_t>(1, (size_t)channels * depth / 8);
+    std::vector<unsigned char> raw;
+    raw.reserve((stride + 1) * height);
+    if (!zlib_decompress(idat.data(), idat.size(), (stride + 1) * height, raw, error)) return false;
+    if (raw.size() < (stride + 1) * height) {
+        error = "truncated pixel data";
+        return false;
+    }
+
+    // Undo the row filters in place; row y - 1 is already unfiltered.
+    for (int y = 0; y < height; ++y) {
+        unsigned char* row = &raw[y * (stride + 1)];
+        int filter = row[0];
+        unsigned char* cur = row + 1;
+        const unsigned char* prev = y ? cur - (stride + 1) : nullptr;
+        for (size_t i = 0; i < stride; ++i) {
+            int a = i >= bpp ? cur[i - bpp] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= bpp ? prev[i - bpp] : 0;
+            int v;
+            switch (filter) {
+            case 0: v = 0; break;
+            case 1: v = a; break;
+            case 2: v = b; break;
+            case 3: v = (a + b) >> 1; break;
+            case 4: {
+                int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                v = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default:
+                error = "invalid row filter";
+                return false;
+            }
+            cur[i] = (unsigned char)(cur[i] + v);
+        }
+    }
+
+    image.width = width;
+    image.height = height;
+    image.rgb.resize((size_t)width * height * 3);
+    int maxValue = (1 << depth) - 1;
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = &raw[y * (stride + 1) + 1];
+        unsigned char* out = &image.rgb[(size_t)y * width * 3];
+        for (int x = 0; x < width; ++x, out += 3) {
+            if (depth < 8) {
+                int shift = 8 - depth - (x * depth) % 8;
+                int v = (row[x * depth / 8] >> shift) & maxValue;
+                if (colorType == 3) {
+                    if ((size_t)v * 3 >= palette.size()) v = 0;
+                    memcpy(out, &palette[(size_t)v * 3], 3);
+                } else {
+                    out[0] = out[1] = out[2] = (unsigned char)(v * 255 / maxValue);
+                }
+                continue;
+            }
+            // The high byte of 16-bit samples.
+            const unsigned char* s = row + (size_t)x * channels * (depth / 8);
+            int step = depth / 8;
+            if (colorType == 3) {
+                size_t v = s[0];
+                if (v * 3 >= palette.size()) v = 0;
+                memcpy(out, &palette[v * 3], 3);
+            } else if (channels <= 2) {
+                out[0] = out[1] = out[2] = s[0];
+            } else {
+                out[0] = s[0];
+                out[1] = s[step];
+                out[2] = s[2 * step];
+            }
+        }
+    }
+    return true;
+}
+
+// Loads a .ppm, .pgm or .png image. Prints the error and returns false on
+// failure.
+inline bool load_image(const char* path, Image& image) {
+    MappedFile file;
+    if (!file.open(path)) {
+        fprintf(stderr, "Error: Could not open image %s.\n", path);
+        return false;
+    }
+    const char* error = nullptr;
+    bool ok;
+    if (has_extension(path, ".ppm") || has_extension(path, ".pgm"))
+        ok = decode_ppm((const unsigned char*)file.data(), file.size(), image, error);
+    else if (has_extension(path, ".png"))
+        ok = decode_png((const unsigned char*)file.data(), file.size(), image, error);
+    else {
+        ok = false;
+        error = "unknown image format, expected .ppm, .pgm or .png";
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: %s: %s.\n", path, error);
+        return false;
+    }
+    return true;
+}
+
+// Saves images on a background thread, so the render thread only pays for
+// copying the pixels out. submit() blocks while `capacity` images are
+// already waiting, which bounds memory when encoding falls behind.
+class ImageWriter {
+public:
+    explicit ImageWriter(PngCompression png = PNG_FAST, size_t capacity = 4)
+        : png(png), capacity(capacity ? capacity : 1), thread(&ImageWriter::writer_loop, this) {}
+
+    ~ImageWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    void submit(const std::string& path, Image&& image) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return queue.size() < capacity; });
+        queue.push_back(std::make_pair(path, std::move(image)));
+        wake.notify_one();
+    }
+
+    // Waits until everything submitted so far is on disk; false if any
+    // write has failed since the writer was created.
+    bool flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return queue.empty() && !busy; });
+        return failures == 0;
+    }
+
+private:
+    void writer_loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return quit || !queue.empty(); });
+            if (queue.empty()) return;
+            std::pair<std::string, Image> job = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+            done.notify_all();
+
+            lock.unlock();
+            bool ok = save_image(job.first.c_str(), job.second, png);
+            if (!ok) fprintf(stderr, "Error: Could not write %s.\n", job.first.c_str());
+            lock.lock();
+
+            if (!ok) ++failures;
+            busy = false;
+            done.notify_all();
+        }
+    }
+
+    PngCompression png;
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable wake;   // job queued or quitting
+    std::condition_variable done;   // job taken or finished
+    std::deque<std::pair<std::string, Image>> queue;
+    bool busy = false;
+    bool quit = false;
+    int failures = 0;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef LOD_HPP
+#define LOD_HPP
+
+#include <math.h>
+#include <mutex>
+
+#include "mesh.hpp"
+
+// Sphere tessellation levels: level k has 8 << k segments around and half
+// as many rings, from 8x4 (32 triangles) to 1024x512 (about a million).
+#define SPHERE_LOD_LEVELS 8
+
+inline int sphere_lod_segments(int level) { return 8 << level; }
+
+// Radius in pixels of the screen-space disc covered by a sphere of
+// `radius` at `distance` from the eye, for a projection that maps a unit
+// slope to `focalPx` pixels. Infinite when the eye is inside the sphere.
+inline float projected_sphere_radius(float radius, float distance, float focalPx) {
+    if (distance <= radius) return INFINITY;
+    return focalPx * radius / sqrtf(distance * distance - radius * radius);
+}
+
+// Coarsest level whose silhouette stays within `maxErrorPx` of the true
+// circle. A regular s-gon of circumradius r deviates from its circle by
+// r (1 - cos(pi / s)) ~ r pi^2 / (2 s^2), so s = pi sqrt(r / (2 maxError)).
+inline int sphere_lod_level(float radiusPx, float maxErrorPx) {
+    float segments = (float)M_PI * sqrtf(radiusPx / (2.0f * maxErrorPx));
+    int level = 0;
+    while (level < SPHERE_LOD_LEVELS - 1 && (float)sphere_lod_segments(level) < segments) ++level;
+    return level;
+}
+
+// Level for a sphere at `center` seen from `eye`.
+inline int select_sphere_lod(const float center[3], float radius, const float eye[3], float focalPx, float maxErrorPx) {
+    float dx = center[0] - eye[0], dy = center[1] - eye[1], dz = center[2] - eye[2];
+    float r = projected_sphere_radius(radius, sqrtf(dx * dx + dy * dy + dz * dz), focalPx);
+    return sphere_lod_level(r, maxErrorPx);
+}
+
+// One sphere of the scene with its tessellations, generated on first use
+// and kept for later frames. mesh() may be called from several threads;
+// returned references stay valid for the lifetime of the object.
+class SphereLod {
+public:
+    SphereLod(float radius, float cx, float cy, float cz)
+        : radius(radius), built() {
+        center[0] = cx;
+        center[1] = cy;
+        center[2] = cz;
+    }
+
+    SphereLod(const SphereLod&) = delete;
+    SphereLod& operator=(const SphereLod&) = delete;
+
+    const Mesh& mesh(int level) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!built[level]) {
+            int segments = sphere_lod_segments(level);
+            levels[level] = make_sphere_mesh(segments, segments / 2, radius, center[0], center[1], center[2]);
+            built[level] = true;
+        }
+        return levels[level];
+    }
+
+private:
+    float radius;
+    float center[3];
+    std::mutex mutex;
+    bool built[SPHERE_LOD_LEVELS];
+    Mesh levels[SPHERE_LOD_LEVELS];
+};
+
+#endif
@@ -1,231 +1,3211 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "lod.hpp"
+#include "mesh.hpp"
+#include "mesh_cache.hpp"
+#include "mesh_loader.hpp"
+#include "raster_simd.hpp"
+#include "texture.hpp"
+#include "thread_pool.hpp"
+#include "transform.hpp"
+
+// Default render target size; --size=WxH overrides it.
 #define SCREEN_WIDTH 512
 #define SCREEN_HEIGHT 512
-#define MAX_VERTICES 10000
 
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
+// Screen is split into TILE_SIZE x TILE_SIZE tiles; each tile is rasterized
+// by exactly one thread, so render target writes need no locking.
+#define TILE_SIZE 64
+
+// Screen positions are snapped to 1/256 pixel before edge setup. Vertices
+// must stay within +-GUARD_BAND pixels so that edge values inside one tile
+// fit in 32 bits.
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define GUARD_BAND 16384
+
+// Hierarchical Z: min/max depth per HIZ_BLOCK x HIZ_BLOCK block of the depth
+// buffer, plus the max over each screen tile. Indexed in raster space (before
+// the flip in pixel_index()).
+#define HIZ_BLOCK 8
+
+// Lights are culled per LIGHT_TILE x LIGHT_TILE square (see
+// cull_light_tiles()); a multiple of HIZ_BLOCK that divides TILE_SIZE.
+#define LIGHT_TILE 16
+
+// Pipeline counters (PrimitiveStats, RasterStats), per-stage timers and the
+// overdraw heatmap. Build with PIPELINE_COUNTERS=0 to compile every counter
+// update and timer out of the pipeline.
+#ifndef PIPELINE_COUNTERS
+#define PIPELINE_COUNTERS 1
+#endif
+
+#if PIPELINE_COUNTERS
+#define STAT_ADD(counter, n) ((counter) += (n))
+#else
+#define STAT_ADD(counter, n) ((void)sizeof((counter) += (n)))
 #endif
 
+// Post-transform vertex: screen position plus the world-space attributes
+// the pixel stage interpolates.
 typedef struct {
     float x, y, z;
     float wx, wy, wz;
     float nx, ny, nz;
+    float u, v;
+    float rhw;          // 1 / clip w, for perspective-correct texture coordinates
 } Vertex;
 
-unsigned char framebuffer[SCREEN_HEIGHT][SCREEN_WIDTH][3];
-float depthBuffer[SCREEN_HEIGHT][SCREEN_WIDTH];
-Vertex gVertexBuffer[MAX_VERTICES];
-int gNumVertices = 0;
+// Homogeneous clip-space position (OpenGL convention, -w <= z <= w).
+typedef struct {
+    float x, y, z, w;
+} ClipVertex;
+
+// Post-transform vertex indices and the material index of one triangle.
+typedef struct {
+    int i0, i1, i2;
+    int material;
+} Triangle;
+
+// Phong coefficients of a surface; lights are shared (see Light). The
+// textured shader scales ambient and diffuse by `texture`, when set.
+typedef struct {
+    float ambient[3];
+    float diffuse[3];
+    float specular[3];
+    int shininess;
+    const Texture* texture;     // not owned
+} Material;
+
+// One draw of a mesh, transformed by `model` (object to world, any
+// invertible affine transform) and shaded with materials[material] of the
+// frame's material array.
+typedef struct {
+    const Mesh* mesh;
+    Mat4 model;
+    int material;
+} Instance;
+
+// An instance that survived culling, with everything the vertex stage and
+// primitive assembly need. Its vertices occupy [firstVertex, firstVertex +
+// mesh->vertex_count()) of the post-transform streams.
+typedef struct {
+    const Mesh* mesh;
+    VertexTransform transform;      // model-view-projection of the instance
+    Mat4 model;
+    float normal[3][3];             // object to world for normals
+    int material;
+    bool mirrored;                  // model flips handedness
+    size_t firstVertex;
+} InstanceDraw;
+
+typedef enum {
+    CULL_NONE,
+    CULL_BACK,
+    CULL_FRONT
+} CullMode;
+
+// Counters of the serial primitive assembly and setup stages.
+typedef struct {
+    long long instances;
+    long long instancesCulled;      // bounding sphere outside the frustum
+    long long verticesTransformed;
+    long long triangles;
+    long long frustumCulled;
+    long long clipped;
+    long long trianglesSetUp;       // after clipping, entering setup
+    long long backfaceCulled;
+    long long degenerateCulled;
+    long long emptyCulled;
+    long long trianglesBinned;
+} PrimitiveStats;
+
+// Wall time of each render_scene() stage, in milliseconds.
+typedef struct {
+    double vertex;      // projection setup, instance culling and vertex transform
+    double assembly;    // primitive assembly and clipping
+    double binning;     // triangle setup and binning
+    double raster;      // tile rasterization, including forward shading
+    double shading;     // visibility-buffer shading pass
+} StageTimes;
+
+// Fixed-point triangle setup. Edge i is E_i(x, y) = a[i] * x + b[i] * y + c[i]
+// at integer pixel (x, y); the triangle is oriented so that covered pixels
+// have all E_i >= 0, and c[i] already carries the top-left fill rule bias.
+typedef struct {
+    int tri;
+    int64_t a[3], b[3], c[3];
+    float area;
+    float minz, maxz;
+    int minx, miny, maxx, maxy;
+} TriangleSetup;
+
+// When the depth test runs relative to shading.
+//   DEPTH_LATE:    shade every covered pixel, then depth test (reference).
+//   DEPTH_EARLY:   interpolate depth and test first; shade only survivors.
+//   DEPTH_PREPASS: lay down depth for the whole tile first, then shade only
+//                  pixels whose depth equals the stored one.
+typedef enum {
+    DEPTH_LATE,
+    DEPTH_EARLY,
+    DEPTH_PREPASS
+} DepthMode;
+
+// Where shading happens.
+//   SHADING_FORWARD:    inside the raster pass, per covered pixel.
+//   SHADING_VISIBILITY: the raster pass only stores the nearest triangle per
+//                       pixel in visBuffer; a separate pass then shades each
+//                       covered pixel once, in framebuffer memory order.
+typedef enum {
+    SHADING_FORWARD,
+    SHADING_VISIBILITY
+} ShadingMode;
+
+// What a single rasterization pass does with each covered pixel.
+typedef enum {
+    PASS_SHADE_LATE,
+    PASS_SHADE_EARLY,
+    PASS_DEPTH_ONLY,
+    PASS_SHADE_EQUAL,
+    PASS_VISIBILITY
+} PixelPass;
+
+typedef struct {
+    long long pixelsTested;         // covered pixels reaching the depth test
+    long long depthPassed;
+    long long depthFailed;
+    long long pixelsShaded;         // shader invocations
+    long long quadsShaded;          // 2x2 quads run through the pixel shader
+    long long helperLanes;          // quad lanes shaded only for derivatives
+    long long rateTiles[3];         // rendered tiles shaded at 1x1, 2x2, 4x4
+    long long lightQuads;           // quads shaded times their light tile's lights
+    long long maxTileLights;        // most lights of one light tile
+    long long tileTriangles;
+    long long tileTrianglesCulled;
+    long long blocksTested;
+    long long blocksCulled;
+    long long tilesClearedOnUse;
+    long long tilesClearedEmpty;
+} RasterStats;
+
+// Contents of a screen tile relative to the last clear_buffers().
+//   TILE_CLEAN:   memory holds the clear values.
+//   TILE_PENDING: cleared, but memory is stale until render_tile() visits
+//                 the tile.
+//   TILE_DIRTY:   rendered to since its memory was last cleared.
+typedef enum {
+    TILE_CLEAN,
+    TILE_PENDING,
+    TILE_DIRTY
+} TileClearState;
+
+// Triangle setup index of the nearest triangle, VIS_EMPTY where none.
+#define VIS_EMPTY 0xFFFFFFFFu
+
+// Pixel shader of a render; each is a PixelShader type below.
+//   SHADER_REFERENCE: Phong with powf and an exact gamma encode.
+//   SHADER_FAST:      Phong within one LSB of the reference, much cheaper.
+//   SHADER_NORMAL:    world-space normal as color; reads no position.
+//   SHADER_UNLIT:     the material's ambient plus diffuse color; reads no
+//                     attributes.
+//   SHADER_TEXTURED:  fast Phong with the material's texture as albedo.
+typedef enum {
+    SHADER_REFERENCE,
+    SHADER_FAST,
+    SHADER_NORMAL,
+    SHADER_UNLIT,
+    SHADER_TEXTURED
+} ShaderKind;
+
+// How often the shader runs per pixel, chosen per tile. Coverage and depth
+// stay per pixel at every rate; at 2x2 and 4x4 one shaded color is
+// broadcast to the covered pixels of each coarse pixel.
+//   RATE_1X1:      every pixel (exact).
+//   RATE_2X2:      once per 2x2 pixels.
+//   RATE_4X4:      once per 4x4 pixels.
+//   RATE_ADAPTIVE: per tile, the coarsest rate at which the normal and
+//                  highlight gradients of the triangles binned to it keep
+//                  the color change across a coarse pixel small.
+//   RATE_IMAGE:    per tile, from RenderOptions::rateImage stretched over
+//                  the frame: below 85 is 1x1, below 170 2x2, else 4x4. A
+//                  tile takes the finest rate of the samples it covers.
+typedef enum {
+    RATE_1X1,
+    RATE_2X2,
+    RATE_4X4,
+    RATE_ADAPTIVE,
+    RATE_IMAGE
+} ShadingRate;
+
+typedef struct {
+    RasterPath rasterPath;
+    DepthMode depthMode;
+    ShadingMode shadingMode;
+    ShaderKind shader;
+    CullMode cullMode;
+    bool fastClear;
+    ShadingRate shadingRate;
+    const Image* rateImage;     // RATE_IMAGE only; not owned
+    TextureFilter textureFilter;
+    bool lightCulling;          // per-tile light lists; off shades every light everywhere
+} RenderOptions;
+
+// Camera in world space, looking from `position` towards `target`.
+typedef struct {
+    float position[3];
+    float target[3];
+    float up[3];
+} Camera;
+
+static const Camera kDefaultCamera = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f } };
+
+// Point light in world space, shared by every material. Its color scales
+// the diffuse and specular terms, and it fades as (1 - d^2 / range^2)^2
+// with distance d, reaching nothing beyond `range`; an infinite range is
+// unattenuated and lights everything.
+typedef struct {
+    float position[3];
+    float color[3];
+    float range;
+} Light;
+
+// A run of lights, shaded in order.
+typedef struct {
+    const Light* lights;
+    int count;
+} LightList;
+
+static const Light kDefaultLight = { { -4.0f, 4.0f, -3.0f }, { 1.0f, 1.0f, 1.0f }, INFINITY };
+
+// Everything one render owns: its target, options, camera, the per-frame
+// pipeline buffers and statistics. Contexts share nothing but the read-only
+// mesh, so renders at different cameras or resolutions can run concurrently.
+struct RenderContext {
+    FrameBuffer target;
+    RenderOptions options;
+    Camera camera;
+
+    int tilesX, tilesY;
+    int lightTilesX, lightTilesY;
+    int hizW, hizH;
+    std::vector<float> hizMin;
+    std::vector<float> hizMax;
+    std::vector<float> hizTileMax;
+    std::vector<unsigned char> tileClear;    // TileClearState per tile
+    std::vector<unsigned char> tileRates;    // shading rate shift per tile
+
+    // View-projection matrix, viewport and guard band of the current frame.
+    VertexTransform transform;
+
+    // The frame's visible instances, its material array and its lights.
+    std::vector<InstanceDraw> draws;
+    const Material* materials;
+    LightList lights;
+
+    // Post-transform vertices indexed like the mesh: clip-space positions as
+    // SoA streams, their clip outcodes, and the screen position plus shading
+    // attributes each triangle setup reads. Vertices created by clipping are
+    // appended after the mesh vertices.
+    std::vector<float> clipX, clipY, clipZ, clipW;
+    std::vector<float> screenX, screenY, screenZ;
+    std::vector<unsigned char> outcodes;
+    std::vector<Vertex> vertexBuffer;
+
+    std::vector<Triangle> triangles;
+    std::vector<TriangleSetup> triangleSetups;
+    std::vector<std::vector<int> > tileBins;
+    // Lights in frame order that can reach a surface of each screen tile,
+    // and of each light tile (see cull_light_tiles()).
+    std::vector<std::vector<Light> > tileLights;
+    std::vector<std::vector<Light> > lightTiles;
+
+    PrimitiveStats primStats;
+    std::vector<RasterStats> workerStats;
+    StageTimes stageTimes;
+    // Shader invocations per pixel in raster space, kept only while
+    // non-empty (see render_scene()).
+    std::vector<uint32_t> overdraw;
+
+    RenderContext(int width, int height, const RenderOptions& options,
+        ColorFormat format = COLOR_PLANAR, PixelLayout layout = LAYOUT_LINEAR)
+        : target(width, height, format, layout), options(options), materials(nullptr), primStats(), stageTimes() {
+        camera = kDefaultCamera;
+        lights.lights = nullptr;
+        lights.count = 0;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        lightTilesX = (width + LIGHT_TILE - 1) / LIGHT_TILE;
+        lightTilesY = (height + LIGHT_TILE - 1) / LIGHT_TILE;
+        hizW = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        hizH = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        hizMin.resize((size_t)hizW * hizH);
+        hizMax.resize((size_t)hizW * hizH);
+        hizTileMax.resize((size_t)tilesX * tilesY);
+        tileBins.resize((size_t)tilesX * tilesY);
+        tileLights.resize((size_t)tilesX * tilesY);
+        lightTiles.resize((size_t)lightTilesX * lightTilesY);
+        tileRates.resize((size_t)tilesX * tilesY);
+        // Fresh planes are uninitialized.
+        tileClear.assign((size_t)tilesX * tilesY, TILE_PENDING);
+    }
+};
+
+static const RenderOptions kDefaultOptions = {
+    RASTER_SCALAR, DEPTH_EARLY, SHADING_FORWARD, SHADER_FAST, CULL_BACK, true, RATE_1X1, nullptr, FILTER_TRILINEAR, true
+};
+
+// Fast clear: only marks tiles. render_tile() clears a pending tile right
+// before rasterizing into it, or with streaming stores when no geometry
+// touches it; tiles still clean from an earlier frame are not written at
+// all. With fastClear off every plane is cleared here in one streaming pass.
+void clear_buffers(RenderContext& ctx) {
+    if (ctx.options.fastClear) {
+        for (size_t i = 0; i < ctx.tileClear.size(); ++i)
+            if (ctx.tileClear[i] == TILE_DIRTY) ctx.tileClear[i] = TILE_PENDING;
+        return;
+    }
+    ctx.target.clear(1.0f, VIS_EMPTY);
+    std::fill(ctx.hizMin.begin(), ctx.hizMin.end(), 1.0f);
+    std::fill(ctx.hizMax.begin(), ctx.hizMax.end(), 1.0f);
+    std::fill(ctx.hizTileMax.begin(), ctx.hizTileMax.end(), 1.0f);
+    std::fill(ctx.tileClear.begin(), ctx.tileClear.end(), TILE_CLEAN);
+}
+
+// Clears the pixels and HiZ entries of one screen tile. The raster-space
+// tile maps to a mirrored image-space rectangle.
+void clear_tile(RenderContext& ctx, int tile, bool streaming) {
+    int w = ctx.target.width(), h = ctx.target.height();
+    int tx = tile % ctx.tilesX, ty = tile / ctx.tilesX;
+    int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+    int x1 = std::min(x0 + TILE_SIZE, w), y1 = std::min(y0 + TILE_SIZE, h);
+    ctx.target.fill_rect(w - x1, h - y1, w - x0, h - y0, 1.0f, VIS_EMPTY, streaming);
+
+    int bx1 = (x1 + HIZ_BLOCK - 1) / HIZ_BLOCK, by1 = (y1 + HIZ_BLOCK - 1) / HIZ_BLOCK;
+    for (int by = y0 / HIZ_BLOCK; by < by1; ++by) {
+        for (int bx = x0 / HIZ_BLOCK; bx < bx1; ++bx) {
+            ctx.hizMin[(size_t)by * ctx.hizW + bx] = 1.0f;
+            ctx.hizMax[(size_t)by * ctx.hizW + bx] = 1.0f;
+        }
+    }
+    ctx.hizTileMax[tile] = 1.0f;
+}
+
+// Target plane index of raster pixel (x, y): raster y points up and the
+// viewport mirrors x, so both are flipped into image order.
+static inline size_t pixel_index(const RenderContext& ctx, int x, int y) {
+    return ctx.target.index(ctx.target.width() - 1 - x, ctx.target.height() - 1 - y);
+}
+
+static inline LightList light_list(const std::vector<Light>& lights) {
+    LightList list = { lights.data(), (int)lights.size() };
+    return list;
+}
+
+// The lights raster pixel (x, y) is shaded with this frame.
+static inline LightList pixel_lights(const RenderContext& ctx, int x, int y) {
+    return light_list(ctx.lightTiles[(size_t)(y / LIGHT_TILE) * ctx.lightTilesX + x / LIGHT_TILE]);
+}
+
+// Returns true when the pixel passed the depth test and was written.
+bool put_pixel(RenderContext& ctx, int x, int y, float z, const unsigned char color[3]) {
+    if (x < 0 || x >= ctx.target.width() || y < 0 || y >= ctx.target.height()) return false;
+    size_t i = pixel_index(ctx, x, y);
+    float* depth = ctx.target.depth();
+    if (z < depth[i]) {
+        ctx.target.set_color(i, color);
+        depth[i] = z;
+        return true;
+    }
+    return false;
+}
 
-void clear_buffers() {
-    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
-        for (int x = 0; x < SCREEN_WIDTH; ++x) {
-            framebuffer[y][x][0] = 0;
-            framebuffer[y][x][1] = 0;
-            framebuffer[y][x][2] = 0;
-            depthBuffer[y][x] = 1.0f;
+// Recomputes the min/max depth of the HiZ block at raster block (bx, by).
+void update_hiz_block(RenderContext& ctx, int bx, int by) {
+    int x0 = bx * HIZ_BLOCK, y0 = by * HIZ_BLOCK;
+    int x1 = std::min(x0 + HIZ_BLOCK, ctx.target.width());
+    int y1 = std::min(y0 + HIZ_BLOCK, ctx.target.height());
+    const float* depth = ctx.target.depth();
+    float lo = depth[pixel_index(ctx, x0, y0)], hi = lo;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            float d = depth[pixel_index(ctx, x, y)];
+            lo = fminf(lo, d);
+            hi = fmaxf(hi, d);
         }
     }
+    ctx.hizMin[(size_t)by * ctx.hizW + bx] = lo;
+    ctx.hizMax[(size_t)by * ctx.hizW + bx] = hi;
 }
 
-void put_pixel(int x, int y, float z, unsigned char r, unsigned char g, unsigned char b) {
-    y = SCREEN_HEIGHT - 1 - y;
-    x = SCREEN_WIDTH - 1 - x;
+void update_hiz_tile(RenderContext& ctx, int tx, int ty) {
+    int bx0 = tx * (TILE_SIZE / HIZ_BLOCK), by0 = ty * (TILE_SIZE / HIZ_BLOCK);
+    float hi = 0.0f;
+    for (int by = by0; by < by0 + TILE_SIZE / HIZ_BLOCK && by < ctx.hizH; ++by)
+        for (int bx = bx0; bx < bx0 + TILE_SIZE / HIZ_BLOCK && bx < ctx.hizW; ++bx)
+            hi = fmaxf(hi, ctx.hizMax[(size_t)by * ctx.hizW + bx]);
+    ctx.hizTileMax[(size_t)ty * ctx.tilesX + tx] = hi;
+}
+
+// Ambient light intensity shared by every material, and the default
+// material: ambient and diffuse green, specular white.
+static const float kAmbientIntensity = 0.2f;
+static const Material kDefaultMaterial = {
+    { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.5f, 0.0f }, { 1.0f, 1.0f, 1.0f }, 16, nullptr
+};
 
-    if (x < 0 || x >= SCREEN_WIDTH || y < 0 || y >= SCREEN_HEIGHT) return;
-    if (z < depthBuffer[y][x]) {
-        framebuffer[y][x][0] = r;
-        framebuffer[y][x][1] = g;
-        framebuffer[y][x][2] = b;
-        depthBuffer[y][x] = z;
+// x^n for a non-negative integer n by repeated squaring.
+static inline float pow_int(float x, int n) {
+    float r = 1.0f;
+    while (n) {
+        if (n & 1) r *= x;
+        x *= x;
+        n >>= 1;
     }
+    return r;
 }
 
-void compute_phong_color(float px, float py, float pz,
-    float nx, float ny, float nz,
-    unsigned char out_color[3]) {
+// Distance attenuation of a light (see Light) at squared distance d2, given
+// 1 / range^2: exactly 1 at infinite range, 0 out of range or for NaN.
+static inline float light_attenuation(float d2, float invRange2) {
+    float a = fmaxf(0.0f, 1.0f - d2 * invRange2);
+    return a * a;
+}
+
+// Diffuse and specular light reaching a surface point, per channel and
+// summed over `lights`: color * attenuation * N.L, and the same with
+// (N.H)^shininess, from the normalized interpolated normal, light, view and
+// half vectors. `exactPow` takes the power with powf, otherwise by repeated
+// squaring. A single white light of infinite range gives exactly N.L and
+// (N.H)^shininess in every channel.
+static inline void phong_lighting(float px, float py, float pz,
+    float nx, float ny, float nz, const float eye[3], const LightList& lights, int shininess, bool exactPow,
+    float diffuse[3], float specular[3]) {
+    for (int i = 0; i < 3; ++i) diffuse[i] = specular[i] = 0.0f;
+
     float len = sqrtf(nx * nx + ny * ny + nz * nz);
     nx /= len; ny /= len; nz /= len;
 
-    float lx = -4 - px, ly = 4 - py, lz = -3 - pz;
-    float lv_len = sqrtf(lx * lx + ly * ly + lz * lz);
-    lx /= lv_len; ly /= lv_len; lz /= lv_len;
-
-    float vx = -px, vy = -py, vz = -pz;
+    float vx = eye[0] - px, vy = eye[1] - py, vz = eye[2] - pz;
     float v_len = sqrtf(vx * vx + vy * vy + vz * vz);
     vx /= v_len; vy /= v_len; vz /= v_len;
 
-    float hx = lx + vx, hy = ly + vy, hz = lz + vz;
-    float h_len = sqrtf(hx * hx + hy * hy + hz * hz);
-    hx /= h_len; hy /= h_len; hz /= h_len;
+    for (int k = 0; k < lights.count; ++k) {
+        const Light& light = lights.lights[k];
+        float lx = light.position[0] - px, ly = light.position[1] - py, lz = light.position[2] - pz;
+        float d2 = lx * lx + ly * ly + lz * lz;
+        float a = light_attenuation(d2, 1.0f / (light.range * light.range));
+        if (!(a > 0.0f)) continue;
+        float lv_len = sqrtf(d2);
+        lx /= lv_len; ly /= lv_len; lz /= lv_len;
 
-    float NdotL = fmaxf(0.0f, nx * lx + ny * ly + nz * lz);
-    float NdotH = fmaxf(0.0f, nx * hx + ny * hy + nz * hz);
+        float hx = lx + vx, hy = ly + vy, hz = lz + vz;
+        float h_len = sqrtf(hx * hx + hy * hy + hz * hz);
+        hx /= h_len; hy /= h_len; hz /= h_len;
 
-    float ka[3] = { 0.0f, 1.0f, 0.0f };   // ambient green
-    float kd[3] = { 0.0f, 0.5f, 0.0f };   // diffuse green
-    float ks[3] = { 1.0f, 1.0f, 1.0f };   // specular white
-    float p = 16.0f;
-    float Ia = 0.2f;
+        float NdotL = fmaxf(0.0f, nx * lx + ny * ly + nz * lz);
+        float NdotH = fmaxf(0.0f, nx * hx + ny * hy + nz * hz);
+        float power = exactPow ? powf(NdotH, (float)shininess) : pow_int(NdotH, shininess);
+        for (int i = 0; i < 3; ++i) {
+            float intensity = light.color[i] * a;
+            diffuse[i] += intensity * NdotL;
+            specular[i] += intensity * power;
+        }
+    }
+}
+
+// Reference shader: powf for the specular lobe and the 1/2.2 gamma encode,
+// evaluated per channel.
+void compute_phong_color(float px, float py, float pz,
+    float nx, float ny, float nz, const float eye[3], const LightList& lights, const Material& m,
+    unsigned char out_color[3]) {
+    float diffuse[3], specular[3];
+    phong_lighting(px, py, pz, nx, ny, nz, eye, lights, m.shininess, true, diffuse, specular);
+
+    float Ia = kAmbientIntensity;
 
     float color[3];
     for (int i = 0; i < 3; ++i) {
-        float ambient = ka[i] * Ia;
-        float diffuse = kd[i] * NdotL;
-        float specular = ks[i] * powf(NdotH, p);
-        color[i] = ambient + diffuse + specular;
+        color[i] = m.ambient[i] * Ia + m.diffuse[i] * diffuse[i] + m.specular[i] * specular[i];
         color[i] = powf(fminf(color[i], 1.0f), 1.0f / 2.2f);
         out_color[i] = (unsigned char)(255.0f * color[i]);
     }
 }
 
-void rasterize_triangle(Vertex v0, Vertex v1, Vertex v2) {
-    float sx0 = v0.x, sy0 = v0.y, sz0 = v0.z;
-    float sx1 = v1.x, sy1 = v1.y, sz1 = v1.z;
-    float sx2 = v2.x, sy2 = v2.y, sz2 = v2.z;
+// Linear [0, 1) to 8-bit gamma-encoded color. The index is the float's
+// exponent and top 7 mantissa bits over [2^-32, 1), so entries are spaced
+// ~0.8% apart in relative terms: the 1/2.2 curve is steep near black, where
+// a uniformly indexed table would be off by several LSBs.
+#define GAMMA_TABLE_SIZE 4096
+#define GAMMA_TABLE_MIN_BITS (95u << 23)    // 2^-32
+
+struct GammaTable {
+    unsigned char entries[GAMMA_TABLE_SIZE];
+
+    GammaTable() {
+        for (uint32_t i = 0; i < GAMMA_TABLE_SIZE; ++i) {
+            // Sample the middle of the bucket.
+            uint32_t bits = GAMMA_TABLE_MIN_BITS + (i << 16) + (1u << 15);
+            float c;
+            memcpy(&c, &bits, sizeof(c));
+            entries[i] = (unsigned char)(255.0f * powf(c, 1.0f / 2.2f));
+        }
+    }
+};
+
+static inline const GammaTable& gamma_table() {
+    static const GammaTable table;
+    return table;
+}
+
+static inline unsigned char encode_gamma(float c) {
+    if (!(c >= 1.0f / 4294967296.0f)) return 0;    // also NaN
+    if (c >= 1.0f) return 255;
+    uint32_t bits;
+    memcpy(&bits, &c, sizeof(bits));
+    return gamma_table().entries[(bits - GAMMA_TABLE_MIN_BITS) >> 16];
+}
+
+// Fast shader: the specular power uses repeated squaring and the gamma
+// encode is a table lookup. Within one LSB of compute_phong_color().
+void compute_phong_color_fast(float px, float py, float pz,
+    float nx, float ny, float nz, const float eye[3], const LightList& lights, const Material& m,
+    unsigned char out_color[3]) {
+    float diffuse[3], specular[3];
+    phong_lighting(px, py, pz, nx, ny, nz, eye, lights, m.shininess, false, diffuse, specular);
+
+    for (int i = 0; i < 3; ++i) {
+        float c = m.ambient[i] * kAmbientIntensity + m.diffuse[i] * diffuse[i] + m.specular[i] * specular[i];
+        out_color[i] = encode_gamma(c);
+    }
+}
+
+// Screen-space barycentrics of raster pixel (x, y) and the interpolated
+// depth, clamped to the vertex range so HiZ rejection against minz stays
+// exact even where snapping leaves a barycentric slightly negative.
+static inline float interpolate_depth(const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    const TriangleSetup& s, int x, int y, float& alpha, float& beta, float& gamma) {
+    float area = s.area;
+    float sx0 = v0.x, sy0 = v0.y;
+    float sx1 = v1.x, sy1 = v1.y;
+    float sx2 = v2.x, sy2 = v2.y;
+
+    alpha = ((sx1 - x) * (sy2 - y) - (sx2 - x) * (sy1 - y)) / area;
+    beta = ((sx2 - x) * (sy0 - y) - (sx0 - x) * (sy2 - y)) / area;
+    gamma = 1.0f - alpha - beta;
+
+    return fminf(fmaxf(alpha * v0.z + beta * v1.z + gamma * v2.z, s.minz), s.maxz);
+}
+
+// Shading runs on 2x2 pixel quads at even raster (x, y); lane
+// (dy * 2 + dx) is pixel (x + dx, y + dy). Lanes outside the triangle, off
+// screen or failing the depth test are helper lanes: they are interpolated
+// and shaded like the others so derivatives exist everywhere in the quad,
+// and their colors are discarded.
+#define QUAD_LANES 4
+
+static inline int quad_lane_count(unsigned lanes) {
+    static const unsigned char counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    return counts[lanes & 0xF];
+}
+
+// interpolate_depth() at the four lane positions (x, y) + (dx, dy) * step
+// of a quad, one SSE lane each. Same operations in the same order, so at
+// integer positions every lane matches the scalar result bit for bit.
+static inline __m128 interpolate_quad_depth(const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    const TriangleSetup& s, float x, float y, float step, __m128& alpha, __m128& beta, __m128& gamma) {
+    __m128 px = _mm_add_ps(_mm_set1_ps(x), _mm_setr_ps(0.0f, step, 0.0f, step));
+    __m128 py = _mm_add_ps(_mm_set1_ps(y), _mm_setr_ps(0.0f, 0.0f, step, step));
+    __m128 dx0 = _mm_sub_ps(_mm_set1_ps(v0.x), px), dy0 = _mm_sub_ps(_mm_set1_ps(v0.y), py);
+    __m128 dx1 = _mm_sub_ps(_mm_set1_ps(v1.x), px), dy1 = _mm_sub_ps(_mm_set1_ps(v1.y), py);
+    __m128 dx2 = _mm_sub_ps(_mm_set1_ps(v2.x), px), dy2 = _mm_sub_ps(_mm_set1_ps(v2.y), py);
+    __m128 area = _mm_set1_ps(s.area);
+
+    alpha = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(dx1, dy2), _mm_mul_ps(dx2, dy1)), area);
+    beta = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(dx2, dy0), _mm_mul_ps(dx0, dy2)), area);
+    gamma = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), alpha), beta);
+
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha, _mm_set1_ps(v0.z)), _mm_mul_ps(beta, _mm_set1_ps(v1.z))),
+        _mm_mul_ps(gamma, _mm_set1_ps(v2.z)));
+    // max(z, minz) picks minz for a NaN z, as fmaxf() does.
+    return _mm_min_ps(_mm_max_ps(z, _mm_set1_ps(s.minz)), _mm_set1_ps(s.maxz));
+}
+
+// Vertex attributes beyond the screen position; a pixel shader declares the
+// ones it reads, and only those are written by the vertex shader and
+// interpolated per pixel.
+#define ATTR_POSITION 1u    // world-space position
+#define ATTR_NORMAL 2u      // world-space normal, not normalized
+#define ATTR_TEXCOORD 4u    // texture coordinates, perspective-correct
+
+// Interpolated attributes of one pixel; members outside the shader's
+// attribute set are left unset.
+typedef struct {
+    float px, py, pz;
+    float nx, ny, nz;
+    float u, v;
+} PixelInput;
+
+// The same attributes for the four lanes of a quad, one array per attribute.
+typedef struct {
+    float px[QUAD_LANES], py[QUAD_LANES], pz[QUAD_LANES];
+    float nx[QUAD_LANES], ny[QUAD_LANES], nz[QUAD_LANES];
+    float u[QUAD_LANES], v[QUAD_LANES];
+} QuadInput;
+
+// Coarse screen-space derivatives of a quad attribute per raster pixel,
+// shared by all four lanes.
+static inline float quad_ddx(const float v[QUAD_LANES]) { return v[1] - v[0]; }
+static inline float quad_ddy(const float v[QUAD_LANES]) { return v[2] - v[0]; }
+
+static inline void interpolate_quad_attribute(__m128 alpha, __m128 beta, __m128 gamma,
+    float a0, float a1, float a2, float out[QUAD_LANES]) {
+    __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(alpha, _mm_set1_ps(a0)), _mm_mul_ps(beta, _mm_set1_ps(a1))),
+        _mm_mul_ps(gamma, _mm_set1_ps(a2)));
+    _mm_storeu_ps(out, v);
+}
+
+template <unsigned Attributes>
+static inline void interpolate_quad_attributes(const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    __m128 alpha, __m128 beta, __m128 gamma, QuadInput& in) {
+    if (Attributes & ATTR_POSITION) {
+        interpolate_quad_attribute(alpha, beta, gamma, v0.wx, v1.wx, v2.wx, in.px);
+        interpolate_quad_attribute(alpha, beta, gamma, v0.wy, v1.wy, v2.wy, in.py);
+        interpolate_quad_attribute(alpha, beta, gamma, v0.wz, v1.wz, v2.wz, in.pz);
+    }
+    if (Attributes & ATTR_NORMAL) {
+        interpolate_quad_attribute(alpha, beta, gamma, v0.nx, v1.nx, v2.nx, in.nx);
+        interpolate_quad_attribute(alpha, beta, gamma, v0.ny, v1.ny, v2.ny, in.ny);
+        interpolate_quad_attribute(alpha, beta, gamma, v0.nz, v1.nz, v2.nz, in.nz);
+    }
+    if (Attributes & ATTR_TEXCOORD) {
+        // Screen-space barycentrics weight u / w, v / w and 1 / w, which
+        // are linear on screen; their ratios are linear on the surface.
+        __m128 a = _mm_mul_ps(alpha, _mm_set1_ps(v0.rhw));
+        __m128 b = _mm_mul_ps(beta, _mm_set1_ps(v1.rhw));
+        __m128 c = _mm_mul_ps(gamma, _mm_set1_ps(v2.rhw));
+        __m128 w = _mm_add_ps(_mm_add_ps(a, b), c);
+        a = _mm_div_ps(a, w);
+        b = _mm_div_ps(b, w);
+        c = _mm_div_ps(c, w);
+        interpolate_quad_attribute(a, b, c, v0.u, v1.u, v2.u, in.u);
+        interpolate_quad_attribute(a, b, c, v0.v, v1.v, v2.v, in.v);
+    }
+}
+
+static inline __m128 pow_int_quad(__m128 x, int n) {
+    __m128 r = _mm_set1_ps(1.0f);
+    while (n) {
+        if (n & 1) r = _mm_mul_ps(r, x);
+        x = _mm_mul_ps(x, x);
+        n >>= 1;
+    }
+    return r;
+}
+
+// phong_lighting() with repeated squaring for the four lanes of a quad;
+// lane results match it exactly. A light no lane is in range of is skipped
+// as a whole.
+static inline void phong_lighting_quad(const QuadInput& in, const float eye[3], const LightList& lights,
+    int shininess, __m128 diffuse[3], __m128 specular[3]) {
+    __m128 zero = _mm_setzero_ps();
+    for (int i = 0; i < 3; ++i) diffuse[i] = specular[i] = zero;
+
+    __m128 px = _mm_loadu_ps(in.px), py = _mm_loadu_ps(in.py), pz = _mm_loadu_ps(in.pz);
+    __m128 nx = _mm_loadu_ps(in.nx), ny = _mm_loadu_ps(in.ny), nz = _mm_loadu_ps(in.nz);
+
+    __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+    nx = _mm_div_ps(nx, len); ny = _mm_div_ps(ny, len); nz = _mm_div_ps(nz, len);
+
+    __m128 vx = _mm_sub_ps(_mm_set1_ps(eye[0]), px);
+    __m128 vy = _mm_sub_ps(_mm_set1_ps(eye[1]), py);
+    __m128 vz = _mm_sub_ps(_mm_set1_ps(eye[2]), pz);
+    __m128 v_len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+    vx = _mm_div_ps(vx, v_len); vy = _mm_div_ps(vy, v_len); vz = _mm_div_ps(vz, v_len);
+
+    for (int k = 0; k < lights.count; ++k) {
+        const Light& light = lights.lights[k];
+        __m128 lx = _mm_sub_ps(_mm_set1_ps(light.position[0]), px);
+        __m128 ly = _mm_sub_ps(_mm_set1_ps(light.position[1]), py);
+        __m128 lz = _mm_sub_ps(_mm_set1_ps(light.position[2]), pz);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+        // max(x, 0) gives 0 for a NaN x, as fmaxf(0, x) does.
+        __m128 a = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f),
+            _mm_mul_ps(d2, _mm_set1_ps(1.0f / (light.range * light.range)))), zero);
+        if (!_mm_movemask_ps(_mm_cmpgt_ps(a, zero))) continue;
+        a = _mm_mul_ps(a, a);
+
+        __m128 lv_len = _mm_sqrt_ps(d2);
+        lx = _mm_div_ps(lx, lv_len); ly = _mm_div_ps(ly, lv_len); lz = _mm_div_ps(lz, lv_len);
+
+        __m128 hx = _mm_add_ps(lx, vx), hy = _mm_add_ps(ly, vy), hz = _mm_add_ps(lz, vz);
+        __m128 h_len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(hx, hx), _mm_mul_ps(hy, hy)), _mm_mul_ps(hz, hz)));
+        hx = _mm_div_ps(hx, h_len); hy = _mm_div_ps(hy, h_len); hz = _mm_div_ps(hz, h_len);
 
-    int minx = (int)fmaxf(0.0f, floorf(fminf(fminf(sx0, sx1), sx2)));
-    int maxx = (int)fminf(SCREEN_WIDTH - 1, ceilf(fmaxf(fmaxf(sx0, sx1), sx2)));
-    int miny = (int)fmaxf(0.0f, floorf(fminf(fminf(sy0, sy1), sy2)));
-    int maxy = (int)fminf(SCREEN_HEIGHT - 1, ceilf(fmaxf(fmaxf(sy0, sy1), sy2)));
+        __m128 NdotL = _mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, lx), _mm_mul_ps(ny, ly)), _mm_mul_ps(nz, lz)), zero);
+        __m128 NdotH = _mm_max_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, hx), _mm_mul_ps(ny, hy)), _mm_mul_ps(nz, hz)), zero);
+        __m128 power = pow_int_quad(NdotH, shininess);
+        for (int i = 0; i < 3; ++i) {
+            __m128 intensity = _mm_mul_ps(_mm_set1_ps(light.color[i]), a);
+            diffuse[i] = _mm_add_ps(diffuse[i], _mm_mul_ps(intensity, NdotL));
+            specular[i] = _mm_add_ps(specular[i], _mm_mul_ps(intensity, power));
+        }
+    }
+}
 
-    float area = (sx1 - sx0) * (sy2 - sy0) - (sx2 - sx0) * (sy1 - sy0);
-    if (fabsf(area) < 1e-5) return;
+// encode_gamma() of four lanes, written `stride` bytes apart: the range
+// tests and table index are computed in SSE, only the loads are per lane.
+static inline void encode_gamma_quad(__m128 c, unsigned char* out, int stride) {
+    const unsigned char* entries = gamma_table().entries;
+    // Out-of-range lanes read entry 0 and are fixed up from the masks.
+    __m128 low = _mm_cmpge_ps(c, _mm_set1_ps(1.0f / 4294967296.0f));    // false for NaN
+    __m128 high = _mm_cmpge_ps(c, _mm_set1_ps(1.0f));
+    __m128i index = _mm_srli_epi32(_mm_sub_epi32(_mm_castps_si128(c), _mm_set1_epi32((int)GAMMA_TABLE_MIN_BITS)), 16);
+    index = _mm_and_si128(index, _mm_castps_si128(_mm_andnot_ps(high, low)));
+    int lowMask = _mm_movemask_ps(low), highMask = _mm_movemask_ps(high);
+    int32_t lanes[QUAD_LANES];
+    _mm_storeu_si128((__m128i*)lanes, index);
+    for (int lane = 0; lane < QUAD_LANES; ++lane) {
+        unsigned char v = entries[lanes[lane]];
+        if (!(lowMask & (1 << lane))) v = 0;
+        if (highMask & (1 << lane)) v = 255;
+        out[lane * stride] = v;
+    }
+}
 
-    for (int y = miny; y <= maxy; ++y) {
-        for (int x = minx; x <= maxx; ++x) {
-            float w0 = (sx1 - sx0) * (y - sy0) - (sy1 - sy0) * (x - sx0);
-            float w1 = (sx2 - sx1) * (y - sy1) - (sy2 - sy1) * (x - sx1);
-            float w2 = (sx0 - sx2) * (y - sy2) - (sy0 - sy2) * (x - sx2);
+// compute_phong_color_fast() for the four lanes of a quad, with the same
+// per-lane results; only the gamma table lookups stay scalar.
+void compute_phong_color_fast_quad(const QuadInput& in, const float eye[3], const LightList& lights,
+    const Material& m, unsigned char out_color[QUAD_LANES][3]) {
+    __m128 diffuse[3], specular[3];
+    phong_lighting_quad(in, eye, lights, m.shininess, diffuse, specular);
 
-            if ((w0 >= 0 && w1 >= 0 && w2 >= 0) || (w0 <= 0 && w1 <= 0 && w2 <= 0)) {
-                float alpha = ((sx1 - x) * (sy2 - y) - (sx2 - x) * (sy1 - y)) / area;
-                float beta = ((sx2 - x) * (sy0 - y) - (sx0 - x) * (sy2 - y)) / area;
-                float gamma = 1.0f - alpha - beta;
+    for (int i = 0; i < 3; ++i) {
+        __m128 c = _mm_add_ps(_mm_add_ps(_mm_set1_ps(m.ambient[i] * kAmbientIntensity),
+            _mm_mul_ps(_mm_set1_ps(m.diffuse[i]), diffuse[i])), _mm_mul_ps(_mm_set1_ps(m.specular[i]), specular[i]));
+        encode_gamma_quad(c, &out_color[0][i], 3);
+    }
+}
 
-                float z = alpha * sz0 + beta * sz1 + gamma * sz2;
-                float px = alpha * v0.wx + beta * v1.wx + gamma * v2.wx;
-                float py = alpha * v0.wy + beta * v1.wy + gamma * v2.wy;
-                float pz = alpha * v0.wz + beta * v1.wz + gamma * v2.wz;
+// compute_phong_color_fast_quad() with ambient and diffuse scaled by a
+// per-lane linear albedo; an albedo of 1 gives the same colors.
+void compute_phong_color_textured_quad(const QuadInput& in, const float eye[3], const LightList& lights,
+    const Material& m, const __m128 albedo[3], unsigned char out_color[QUAD_LANES][3]) {
+    __m128 diffuse[3], specular[3];
+    phong_lighting_quad(in, eye, lights, m.shininess, diffuse, specular);
 
-                float nx = alpha * v0.nx + beta * v1.nx + gamma * v2.nx;
-                float ny = alpha * v0.ny + beta * v1.ny + gamma * v2.ny;
-                float nz = alpha * v0.nz + beta * v1.nz + gamma * v2.nz;
+    for (int i = 0; i < 3; ++i) {
+        __m128 lit = _mm_add_ps(_mm_set1_ps(m.ambient[i] * kAmbientIntensity), _mm_mul_ps(_mm_set1_ps(m.diffuse[i]), diffuse[i]));
+        __m128 c = _mm_add_ps(_mm_mul_ps(lit, albedo[i]), _mm_mul_ps(_mm_set1_ps(m.specular[i]), specular[i]));
+        encode_gamma_quad(c, &out_color[0][i], 3);
+    }
+}
 
-                unsigned char color[3];
-                compute_phong_color(px, py, pz, nx, ny, nz, color);
-                put_pixel(x, y, z, color[0], color[1], color[2]);
+// Pixel shaders: a type with the attribute set it reads, whether it reads
+// lights, and a shade_quad() that colors the four lanes of a quad with its
+// triangle's material and the lights of its light tile. The rasterizer is
+// instantiated per shader, so shade_quad() inlines into the quad loop;
+// adding a shader takes a type here, a ShaderKind and a case in
+// render_instances(). Shaders without a quad kernel derive from
+// PerLaneShader and provide a per-pixel shade().
+template <class Shader>
+struct PerLaneShader {
+    static void shade_quad(const RenderContext& ctx, const QuadInput& in, const Material& m,
+        const LightList& lights, unsigned char color[QUAD_LANES][3]) {
+        for (int lane = 0; lane < QUAD_LANES; ++lane) {
+            PixelInput p;
+            if (Shader::attributes & ATTR_POSITION) {
+                p.px = in.px[lane]; p.py = in.py[lane]; p.pz = in.pz[lane];
+            }
+            if (Shader::attributes & ATTR_NORMAL) {
+                p.nx = in.nx[lane]; p.ny = in.ny[lane]; p.nz = in.nz[lane];
             }
+            if (Shader::attributes & ATTR_TEXCOORD) {
+                p.u = in.u[lane]; p.v = in.v[lane];
+            }
+            Shader::shade(ctx, p, m, lights, color[lane]);
+        }
+    }
+};
+
+struct PhongReferenceShader : PerLaneShader<PhongReferenceShader> {
+    static const unsigned attributes = ATTR_POSITION | ATTR_NORMAL;
+    static const bool lit = true;
+    static void shade(const RenderContext& ctx, const PixelInput& in, const Material& m, const LightList& lights,
+        unsigned char color[3]) {
+        compute_phong_color(in.px, in.py, in.pz, in.nx, in.ny, in.nz, ctx.camera.position, lights, m, color);
+    }
+};
+
+struct PhongFastShader {
+    static const unsigned attributes = ATTR_POSITION | ATTR_NORMAL;
+    static const bool lit = true;
+    static void shade_quad(const RenderContext& ctx, const QuadInput& in, const Material& m,
+        const LightList& lights, unsigned char color[QUAD_LANES][3]) {
+        compute_phong_color_fast_quad(in, ctx.camera.position, lights, m, color);
+    }
+};
+
+// Fast Phong over the material's texture, filtered with a level of detail
+// from the quad's texture coordinate derivatives; white without one.
+struct TexturedShader {
+    static const unsigned attributes = ATTR_POSITION | ATTR_NORMAL | ATTR_TEXCOORD;
+    static const bool lit = true;
+    static void shade_quad(const RenderContext& ctx, const QuadInput& in, const Material& m,
+        const LightList& lights, unsigned char color[QUAD_LANES][3]) {
+        __m128 albedo[3] = { _mm_set1_ps(1.0f), _mm_set1_ps(1.0f), _mm_set1_ps(1.0f) };
+        if (m.texture) {
+            float lod = m.texture->lod(quad_ddx(in.u), quad_ddx(in.v), quad_ddy(in.u), quad_ddy(in.v));
+            m.texture->sample4(in.u, in.v, lod, ctx.options.textureFilter, albedo);
+        }
+        compute_phong_color_textured_quad(in, ctx.camera.position, lights, m, albedo, color);
+    }
+};
+
+// Unit normal mapped from [-1, 1] to [0, 255] per axis.
+struct NormalShader : PerLaneShader<NormalShader> {
+    static const unsigned attributes = ATTR_NORMAL;
+    static const bool lit = false;
+    static void shade(const RenderContext&, const PixelInput& in, const Material&, const LightList&,
+        unsigned char color[3]) {
+        float scale = 127.5f / sqrtf(in.nx * in.nx + in.ny * in.ny + in.nz * in.nz);
+        color[0] = (unsigned char)(in.nx * scale + 127.5f);
+        color[1] = (unsigned char)(in.ny * scale + 127.5f);
+        color[2] = (unsigned char)(in.nz * scale + 127.5f);
+    }
+};
+
+// The Phong color of a surface facing a white light, without highlights.
+struct UnlitShader {
+    static const unsigned attributes = 0;
+    static const bool lit = false;
+    static void shade_quad(const RenderContext&, const QuadInput&, const Material& m, const LightList&,
+        unsigned char color[QUAD_LANES][3]) {
+        for (int i = 0; i < 3; ++i) color[0][i] = encode_gamma(m.ambient[i] * kAmbientIntensity + m.diffuse[i]);
+        for (int lane = 1; lane < QUAD_LANES; ++lane) memcpy(color[lane], color[0], 3);
+    }
+};
+
+// Depth-only and visibility passes never shade.
+struct NoShader {
+    static const unsigned attributes = 0;
+    static const bool lit = false;
+    static void shade_quad(const RenderContext&, const QuadInput&, const Material&, const LightList&,
+        unsigned char (*)[3]) {}
+};
+
+static inline bool depth_test(bool passed, RasterStats& stats) {
+    STAT_ADD(passed ? stats.depthPassed : stats.depthFailed, 1);
+    return passed;
+}
+
+// Counts one shader invocation at raster pixel (x, y).
+static inline void count_shading(RenderContext& ctx, int x, int y, RasterStats& stats) {
+    STAT_ADD(stats.pixelsShaded, 1);
+#if PIPELINE_COUNTERS
+    if (!ctx.overdraw.empty()) ++ctx.overdraw[(size_t)y * ctx.target.width() + x];
+#else
+    (void)ctx; (void)x; (void)y;
+#endif
+}
+
+// Depth-only and visibility passes: interpolates depth at pixel (x, y),
+// depth tests it and writes it, recording triangle `id` in the id plane in
+// the visibility pass. Returns true when the depth buffer was written.
+template <PixelPass pass>
+static inline bool write_pixel_depth(RenderContext& ctx, const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    const TriangleSetup& s, int id, int x, int y, RasterStats& stats) {
+    float alpha, beta, gamma;
+    float z = interpolate_depth(v0, v1, v2, s, x, y, alpha, beta, gamma);
+    size_t i = pixel_index(ctx, x, y);
+    float* depth = ctx.target.depth();
+    STAT_ADD(stats.pixelsTested, 1);
+    if (!depth_test(z < depth[i], stats)) return false;
+    depth[i] = z;
+    if (pass == PASS_VISIBILITY) ctx.target.ids()[i] = (uint32_t)id;
+    return true;
+}
+
+// Coarse quads: at rate shift r each lane of a quad stands for a
+// (1 << r) x (1 << r) coarse pixel, so a quad spans 2 << r pixels square
+// and shading runs once per coarse pixel. Masks use the 8x8 block layout,
+// bit (row * 8 + col); lane masks are relative to the quad's origin bit.
+#define RATE_SHIFT_MAX 2
+
+static const uint64_t kCoarseQuadOrigins[RATE_SHIFT_MAX + 1] = {
+    0x0055005500550055ull, 0x0000001100000011ull, 0x0000000000000001ull
+};
+static const uint64_t kCoarseQuadMasks[RATE_SHIFT_MAX + 1] = {
+    0x0000000000000303ull, 0x000000000F0F0F0Full, 0xFFFFFFFFFFFFFFFFull
+};
+static const uint64_t kCoarseLaneMasks[RATE_SHIFT_MAX + 1][QUAD_LANES] = {
+    { 0x1ull, 0x2ull, 0x100ull, 0x200ull },
+    { 0x0303ull, 0x0C0Cull, 0x03030000ull, 0x0C0C0000ull },
+    { 0x0F0F0F0Full, 0xF0F0F0F0ull, 0x0F0F0F0F00000000ull, 0xF0F0F0F000000000ull }
+};
+
+// Lane of a coarse quad at origin bit `origin` holding block bit `bit`.
+static inline int coarse_lane(int origin, int bit, int shift) {
+    return (((bit % HIZ_BLOCK - origin % HIZ_BLOCK) >> shift) & 1) |
+        ((((bit / HIZ_BLOCK - origin / HIZ_BLOCK) >> shift) & 1) << 1);
+}
+
+// Coarse lanes of the quad at `origin` that hold a pixel of `pixels`.
+static inline unsigned coarse_lanes(uint64_t pixels, int origin, int shift) {
+    unsigned lanes = 0;
+    for (int lane = 0; lane < QUAD_LANES; ++lane)
+        if (pixels & (kCoarseLaneMasks[shift][lane] << origin)) lanes |= 1u << lane;
+    return lanes;
+}
+
+// Barycentrics at the centers of the coarse pixels of the quad whose first
+// pixel is raster (x, y). Coarse centers outside the triangle are pulled
+// onto it, as centroid sampling does: extrapolated normals past a
+// silhouette would color its edge pixels. Full-rate lanes are unchanged.
+static inline void interpolate_coarse_quad(const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    const TriangleSetup& s, int x, int y, int shift, __m128& alpha, __m128& beta, __m128& gamma) {
+    float center = 0.5f * (float)((1 << shift) - 1);
+    interpolate_quad_depth(v0, v1, v2, s, (float)x + center, (float)y + center, (float)(1 << shift), alpha, beta, gamma);
+    if (!shift) return;
+    __m128 zero = _mm_setzero_ps();
+    alpha = _mm_max_ps(alpha, zero);
+    beta = _mm_max_ps(beta, zero);
+    gamma = _mm_max_ps(gamma, zero);
+    __m128 sum = _mm_add_ps(_mm_add_ps(alpha, beta), gamma);
+    alpha = _mm_div_ps(alpha, sum);
+    beta = _mm_div_ps(beta, sum);
+    gamma = _mm_div_ps(gamma, sum);
+}
+
+// Shading passes on the coarse quad at block bit `origin` of the 8x8 block
+// at raster (bx, by), whose pixels in `covered` lie inside the triangle:
+// depth tests those pixels as the pass requires, shades the quad with
+// `lights` when any survives and writes each surviving pixel with its
+// coarse pixel's color. Returns true when the depth buffer was written.
+template <PixelPass pass, class PixelShader>
+static inline bool shade_coarse_quad(RenderContext& ctx, const Vertex& v0, const Vertex& v1, const Vertex& v2,
+    const Material& material, const LightList& lights, const TriangleSetup& s, int bx, int by, int origin, int shift,
+    uint64_t covered, RasterStats& stats) {
+    // Per-pixel depth, one 2x2 quad at a time.
+    __m128 alpha, beta, gamma;
+    float z[HIZ_BLOCK * HIZ_BLOCK];
+    uint64_t quads = (covered | covered >> 1 | covered >> HIZ_BLOCK | covered >> (HIZ_BLOCK + 1)) & kCoarseQuadOrigins[0];
+    while (quads) {
+        int bit = lowest_set_bit(quads);
+        quads &= quads - 1;
+        float zq[QUAD_LANES];
+        _mm_storeu_ps(zq, interpolate_quad_depth(v0, v1, v2, s, (float)(bx + bit % HIZ_BLOCK), (float)(by + bit / HIZ_BLOCK),
+            1.0f, alpha, beta, gamma));
+        z[bit] = zq[0];
+        z[bit + 1] = zq[1];
+        z[bit + HIZ_BLOCK] = zq[2];
+        z[bit + HIZ_BLOCK + 1] = zq[3];
+    }
+
+    const float* depth = ctx.target.depth();
+    uint64_t live = 0;
+    for (uint64_t m = covered; m; m &= m - 1) {
+        int bit = lowest_set_bit(m);
+        STAT_ADD(stats.pixelsTested, 1);
+        float stored = depth[pixel_index(ctx, bx + bit % HIZ_BLOCK, by + bit / HIZ_BLOCK)];
+        if (pass == PASS_SHADE_EQUAL) {
+            if (!depth_test(z[bit] == stored, stats)) continue;
+        } else if (pass == PASS_SHADE_EARLY) {
+            // A pass is counted by the write after shading.
+            if (!(z[bit] < stored)) { depth_test(false, stats); continue; }
         }
+        live |= 1ull << bit;
+    }
+    if (!live) return false;
+
+    unsigned lanes = coarse_lanes(live, origin, shift);
+    interpolate_coarse_quad(v0, v1, v2, s, bx + origin % HIZ_BLOCK, by + origin / HIZ_BLOCK, shift, alpha, beta, gamma);
+    QuadInput in;
+    unsigned char color[QUAD_LANES][3];
+    interpolate_quad_attributes<PixelShader::attributes>(v0, v1, v2, alpha, beta, gamma, in);
+    PixelShader::shade_quad(ctx, in, material, lights, color);
+    STAT_ADD(stats.quadsShaded, 1);
+    STAT_ADD(stats.lightQuads, lights.count);
+    STAT_ADD(stats.helperLanes, QUAD_LANES - quad_lane_count(lanes));
+
+    bool written = false;
+    for (uint64_t m = live; m; m &= m - 1) {
+        int bit = lowest_set_bit(m);
+        int px = bx + bit % HIZ_BLOCK, py = by + bit / HIZ_BLOCK;
+        const unsigned char* c = color[coarse_lane(origin, bit, shift)];
+        count_shading(ctx, px, py, stats);
+        if (pass == PASS_SHADE_EQUAL)
+            ctx.target.set_color(pixel_index(ctx, px, py), c);
+        else
+            written |= depth_test(put_pixel(ctx, px, py, z[bit], c), stats);
+    }
+    return written;
+}
+
+// Snaps a screen coordinate to SUBPIXEL_BITS fixed point.
+static inline int64_t to_fixed(float v) {
+    return (int64_t)floorf(v * SUBPIXEL_ONE + 0.5f);
+}
+
+// Computes integer edge equations, the top-left bias and the pixel bounding
+// box. Returns false, counting the reason in ctx.primStats, for degenerate
+// and culled faces and for triangles that cover no pixel on screen.
+bool setup_triangle(RenderContext& ctx, int tri, TriangleSetup& s) {
+    const Triangle& t = ctx.triangles[tri];
+    const Vertex& v0 = ctx.vertexBuffer[t.i0];
+    const Vertex& v1 = ctx.vertexBuffer[t.i1];
+    const Vertex& v2 = ctx.vertexBuffer[t.i2];
+
+    // Negated tests also catch NaNs; clipping keeps vertices inside the
+    // guard band, so failing them means the triangle is degenerate.
+    float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+    const float limit = (float)GUARD_BAND;
+    const Vertex* v[3] = { &v0, &v1, &v2 };
+    int64_t X[3], Y[3];
+    bool degenerate = !(fabsf(area) >= 1e-5f);
+    for (int i = 0; i < 3 && !degenerate; ++i) {
+        if (!(fabsf(v[i]->x) < limit && fabsf(v[i]->y) < limit)) degenerate = true;
+        X[i] = to_fixed(v[i]->x);
+        Y[i] = to_fixed(v[i]->y);
+    }
+
+    int64_t area2 = degenerate ? 0 : (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+    if (area2 == 0) {
+        STAT_ADD(ctx.primStats.degenerateCulled, 1);
+        return false;
     }
+
+    // Front faces have a positive raster-space area: counter-clockwise as
+    // seen from the eye, mirrored once by the viewport's flipped x axis and
+    // once more by raster y pointing up.
+    CullMode cull = ctx.options.cullMode;
+    if ((cull == CULL_BACK && area2 < 0) || (cull == CULL_FRONT && area2 > 0)) {
+        STAT_ADD(ctx.primStats.backfaceCulled, 1);
+        return false;
+    }
+
+    // Edge i runs between the two vertices other than i, so E_i is the
+    // (unnormalized) barycentric weight of vertex i.
+    for (int i = 0; i < 3; ++i) {
+        int j = (i + 1) % 3, k = (i + 2) % 3;
+        int64_t a = Y[j] - Y[k];
+        int64_t b = X[k] - X[j];
+        if (area2 < 0) { a = -a; b = -b; }
+
+        // Pixels exactly on an edge belong to the triangle only if it is a
+        // left edge or a horizontal top edge; the neighbour sharing the edge
+        // sees it with the opposite orientation, so no pixel is shaded twice.
+        bool topLeft = a > 0 || (a == 0 && b < 0);
+        int64_t c = -(a * X[j] + b * Y[j]) - (topLeft ? 0 : 1);
+
+        // Samples sit on integer pixels, so E = SUBPIXEL_ONE * (a*x + b*y) + c
+        // and E >= 0 iff a*x + b*y + floor(c / SUBPIXEL_ONE) >= 0.
+        s.a[i] = a;
+        s.b[i] = b;
+        s.c[i] = c >> SUBPIXEL_BITS;
+    }
+
+    int64_t minX = X[0], maxX = X[0], minY = Y[0], maxY = Y[0];
+    for (int i = 1; i < 3; ++i) {
+        if (X[i] < minX) minX = X[i];
+        if (X[i] > maxX) maxX = X[i];
+        if (Y[i] < minY) minY = Y[i];
+        if (Y[i] > maxY) maxY = Y[i];
+    }
+    s.minx = (int)((minX + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+    s.miny = (int)((minY + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS);
+    s.maxx = (int)(maxX >> SUBPIXEL_BITS);
+    s.maxy = (int)(maxY >> SUBPIXEL_BITS);
+    if (s.minx < 0) s.minx = 0;
+    if (s.miny < 0) s.miny = 0;
+    if (s.maxx > ctx.target.width() - 1) s.maxx = ctx.target.width() - 1;
+    if (s.maxy > ctx.target.height() - 1) s.maxy = ctx.target.height() - 1;
+    if (s.minx > s.maxx || s.miny > s.maxy) {
+        STAT_ADD(ctx.primStats.emptyCulled, 1);
+        return false;
+    }
+
+    s.tri = tri;
+    s.area = area;
+    s.minz = fminf(fminf(v0.z, v1.z), v2.z);
+    s.maxz = fmaxf(fmaxf(v0.z, v1.z), v2.z);
+    return true;
+}
+
+// Bits of an n x n block mask (bit row * n + col) whose pixel lies inside
+// [minx, maxx] x [miny, maxy].
+static inline uint64_t block_rect_mask(int n, int bx, int by, int minx, int miny, int maxx, int maxy) {
+    uint64_t rowBits = 0;
+    for (int col = 0; col < n; ++col)
+        if (bx + col >= minx && bx + col <= maxx) rowBits |= (uint64_t)1 << col;
+
+    uint64_t mask = 0;
+    for (int row = 0; row < n; ++row)
+        if (by + row >= miny && by + row <= maxy) mask |= rowBits << (row * n);
+    return mask;
 }
 
-void create_scene() {
-    int width = 32;
-    int height = 16;
-    float radius = 1.0f;
+// Rasterizes the part of the triangle that lies inside the tile rectangle
+// [tminx, tmaxx] x [tminy, tmaxy] (inclusive, screen space), one 8x8 block
+// at a time; shading passes then walk the block's covered coarse quads at
+// the tile's shading rate `shift`. Blocks whose stored depth is entirely in
+// front of the triangle are skipped before any coverage or shading work. In
+// PASS_SHADE_EQUAL the depth buffer is final, so only blocks strictly in
+// front are skipped.
+template <PixelPass pass, class PixelShader>
+void rasterize_triangle(RenderContext& ctx, const TriangleSetup& s, int id, int tminx, int tminy, int tmaxx, int tmaxy,
+    int shift, RasterStats& stats) {
+    int minx = s.minx > tminx ? s.minx : tminx;
+    int miny = s.miny > tminy ? s.miny : tminy;
+    int maxx = s.maxx < tmaxx ? s.maxx : tmaxx;
+    int maxy = s.maxy < tmaxy ? s.maxy : tmaxy;
+    if (minx > maxx || miny > maxy) return;
+
+    // Equal-depth shading must still visit triangles lying exactly on the max.
+    float cullz = pass == PASS_SHADE_EQUAL ? nextafterf(s.minz, -1.0f) : s.minz;
+
+    STAT_ADD(stats.tileTriangles, 1);
+    int tx = tminx / TILE_SIZE, ty = tminy / TILE_SIZE;
+    if (cullz >= ctx.hizTileMax[(size_t)ty * ctx.tilesX + tx]) {
+        STAT_ADD(stats.tileTrianglesCulled, 1);
+        return;
+    }
+
+    int x0 = minx & ~(HIZ_BLOCK - 1), y0 = miny & ~(HIZ_BLOCK - 1);
+    int x1 = maxx | (HIZ_BLOCK - 1), y1 = maxy | (HIZ_BLOCK - 1);
+
+    // Classify each edge over the block-aligned rectangle in 64 bits. An edge
+    // that is non-negative at all four corners accepts every pixel and is
+    // dropped; an edge that is negative everywhere rejects the triangle for
+    // this tile. The remaining edges cross the rectangle, so their values fit
+    // in 32 bits.
+    EdgeSteps steps;
+    int32_t origin[3];
+    for (int i = 0; i < 3; ++i) {
+        int64_t e00 = s.a[i] * x0 + s.b[i] * y0 + s.c[i];
+        int64_t e10 = e00 + s.a[i] * (x1 - x0);
+        int64_t e01 = e00 + s.b[i] * (y1 - y0);
+        int64_t e11 = e10 + s.b[i] * (y1 - y0);
+        int64_t corners[3] = { e10, e01, e11 };
+        int64_t lo = e00, hi = e00;
+        for (int k = 0; k < 3; ++k) {
+            if (corners[k] < lo) lo = corners[k];
+            if (corners[k] > hi) hi = corners[k];
+        }
+        if (hi < 0) return;
+
+        bool accept = lo >= 0;
+        origin[i] = accept ? 0 : (int32_t)e00;
+        steps.row[i] = accept ? 0 : (int32_t)s.b[i];
+        for (int k = 0; k < 8; ++k) steps.col[i][k] = accept ? 0 : (int32_t)s.a[i] * k;
+    }
 
-    for (int j = 1; j < height - 1; ++j) {
-        for (int i = 0; i < width; ++i) {
-            float theta = (float)i / (float)(width - 1) * 2.0f * M_PI;
-            float phi = (float)j / (float)(height - 1) * M_PI;
-            float x = sinf(phi) * cosf(theta);
-            float y = cosf(phi);
-            float z = sinf(phi) * sinf(theta);
-            Vertex v;
-            v.wx = x * radius;
-            v.wy = y * radius;
-            v.wz = z * radius - 3.0f;
-            v.nx = x;
-            v.ny = y;
-            v.nz = z;
-            gVertexBuffer[gNumVertices++] = v;
+    const Triangle& t = ctx.triangles[s.tri];
+    const Vertex& v0 = ctx.vertexBuffer[t.i0];
+    const Vertex& v1 = ctx.vertexBuffer[t.i1];
+    const Vertex& v2 = ctx.vertexBuffer[t.i2];
+    const Material& material = ctx.materials[t.material];
+    BlockCoverageFunc coverage = block_coverage_func(ctx.options.rasterPath);
+    bool tileChanged = false;
+
+    int32_t blockRow[3] = { origin[0], origin[1], origin[2] };
+    for (int by = y0; by <= maxy; by += HIZ_BLOCK) {
+        int32_t e[3] = { blockRow[0], blockRow[1], blockRow[2] };
+        for (int bx = x0; bx <= maxx; bx += HIZ_BLOCK) {
+            int hx = bx / HIZ_BLOCK, hy = by / HIZ_BLOCK;
+            STAT_ADD(stats.blocksTested, 1);
+            if (cullz >= ctx.hizMax[(size_t)hy * ctx.hizW + hx]) {
+                STAT_ADD(stats.blocksCulled, 1);
+            } else {
+                uint64_t mask = coverage(steps, e);
+                if (bx < minx || by < miny || bx + HIZ_BLOCK - 1 > maxx || by + HIZ_BLOCK - 1 > maxy)
+                    mask &= block_rect_mask(HIZ_BLOCK, bx, by, minx, miny, maxx, maxy);
+
+                bool written = false;
+                if (pass == PASS_DEPTH_ONLY || pass == PASS_VISIBILITY) {
+                    while (mask) {
+                        int bit = lowest_set_bit(mask);
+                        mask &= mask - 1;
+                        written |= write_pixel_depth<pass>(ctx, v0, v1, v2, s, id,
+                            bx + (bit % HIZ_BLOCK), by + (bit / HIZ_BLOCK), stats);
+                    }
+                } else {
+                    const LightList lights = pixel_lights(ctx, bx, by);
+                    for (uint64_t quads = kCoarseQuadOrigins[shift]; quads; quads &= quads - 1) {
+                        int origin = lowest_set_bit(quads);
+                        uint64_t covered = mask & (kCoarseQuadMasks[shift] << origin);
+                        if (covered)
+                            written |= shade_coarse_quad<pass, PixelShader>(ctx, v0, v1, v2, material, lights, s,
+                                bx, by, origin, shift, covered, stats);
+                    }
+                }
+                if (written) {
+                    update_hiz_block(ctx, hx, hy);
+                    tileChanged = true;
+                }
+            }
+            for (int i = 0; i < 3; ++i) e[i] += steps.col[i][1] * HIZ_BLOCK;
         }
+        for (int i = 0; i < 3; ++i) blockRow[i] += steps.row[i] * HIZ_BLOCK;
     }
 
-    Vertex top = { 0.0f, radius, -3.0f, 0.0f, 1.0f, 0.0f };
-    Vertex bottom = { 0.0f, -radius, -3.0f, 0.0f, -1.0f, 0.0f };
-    gVertexBuffer[gNumVertices++] = top;
-    gVertexBuffer[gNumVertices++] = bottom;
+    if (tileChanged) update_hiz_tile(ctx, tx, ty);
+}
+
+// The default scene: a unit sphere three units in front of the default
+// camera. create_scene() is its fixed 32x16 tessellation (--lod=off);
+// otherwise a SphereLod picks one per frame.
+static const float kSceneRadius = 1.0f;
+static const float kSceneCenter[3] = { 0.0f, 0.0f, -3.0f };
+
+Mesh create_scene() {
+    return make_sphere_mesh(32, 16, kSceneRadius, kSceneCenter[0], kSceneCenter[1], kSceneCenter[2]);
+}
+
+// Perspective divide and viewport transform of one clip-space position.
+static inline void clip_to_screen(const RenderContext& ctx, const ClipVertex& c, Vertex& v) {
+    float xp = c.x / c.w, yp = c.y / c.w, zp = c.z / c.w;
+
+    v.x = (1.0f - xp) * 0.5f * ctx.target.width();
+    v.y = (yp + 1.0f) * 0.5f * ctx.target.height();
+    v.z = (zp + 1.0f) * 0.5f;
+}
+
+// Tangent of half the vertical field of view (90 degrees).
+static const float kTanHalfFovY = 1.0f;
+
+// Pixels per unit of view-space slope (y / -z) on a target `height` pixels
+// tall.
+float focal_length_px(int height) {
+    return 0.5f * (float)height / kTanHalfFovY;
 }
 
-void project_vertices() {
-    float l = -0.1f, r = 0.1f, b = -0.1f, tproj = 0.1f, n = 0.1f, f = 1000.0f;
-    float P[4][4] = { 0 };
+// Builds the view-projection matrix for the camera and the target's aspect
+// ratio (the vertical extent is fixed), and the guard band clip planes,
+// which depend on the resolution.
+void setup_projection(RenderContext& ctx) {
+    float aspect = (float)ctx.target.width() / (float)ctx.target.height();
+    float n = 0.1f, f = 1000.0f, tproj = n * kTanHalfFovY, b = -tproj, l = -tproj * aspect, r = tproj * aspect;
+    Mat4 proj = {};
+    float (*P)[4] = proj.m;
     P[0][0] = 2.0f * n / (r - l);
     P[1][1] = 2.0f * n / (tproj - b);
     P[2][2] = -(f + n) / (f - n);
     P[2][3] = -(2.0f * f * n) / (f - n);
     P[3][2] = -1.0f;
 
-    for (int i = 0; i < gNumVertices; ++i) {
-        float x = gVertexBuffer[i].wx;
-        float y = gVertexBuffer[i].wy;
-        float z = gVertexBuffer[i].wz;
+    const Camera& cam = ctx.camera;
+    VertexTransform& t = ctx.transform;
+    t.mvp = mat4_multiply(proj, mat4_look_at(cam.position, cam.target, cam.up));
+    t.width = (float)ctx.target.width();
+    t.height = (float)ctx.target.height();
+    t.guardBandX = 0.99f * (2.0f * GUARD_BAND / ctx.target.width() - 1.0f);
+    t.guardBandY = 0.99f * (2.0f * GUARD_BAND / ctx.target.height() - 1.0f);
+}
+
+static inline ClipVertex clip_vertex(const RenderContext& ctx, int i) {
+    ClipVertex c = { ctx.clipX[i], ctx.clipY[i], ctx.clipZ[i], ctx.clipW[i] };
+    return c;
+}
+
+// x and y clip against the guard band instead of the viewport, so only
+// triangles that would overflow the fixed-point range or cross the near/far
+// planes get clipped; the rest are trimmed by the rasterizer's bounding box
+// for free.
+static inline float clip_distance(const RenderContext& ctx, const ClipVertex& c, int plane) {
+    return clip_plane_distance(ctx.transform, c.x, c.y, c.z, c.w, plane);
+}
 
-        float xp = P[0][0] * x;
-        float yp = P[1][1] * y;
-        float zp = P[2][2] * z + P[2][3];
-        float wp = -z;
+// Bounding sphere of one mesh, computed once per frame however many
+// instances share the mesh.
+typedef struct {
+    const Mesh* mesh;
+    float center[3];
+    float radius;
+} MeshBounds;
 
-        xp /= wp; yp /= wp; zp /= wp;
+// Instance stage: drops instances whose bounding sphere lies entirely
+// outside one of the view frustum planes and lays out the vertices of the
+// others back to back in the post-transform streams. A lone instance is not
+// tested; primitive assembly culls its triangles anyway.
+void cull_instances(RenderContext& ctx, const std::vector<Instance>& instances) {
+    ctx.draws.clear();
+    STAT_ADD(ctx.primStats.instances, (long long)instances.size());
 
-        gVertexBuffer[i].x = (1.0f - xp) * 0.5f * SCREEN_WIDTH;
-        gVertexBuffer[i].y = (yp + 1.0f) * 0.5f * SCREEN_HEIGHT;
-        gVertexBuffer[i].z = (zp + 1.0f) * 0.5f;
+    // World-space planes w + x, w - x, w + y, ... of the view-projection
+    // matrix, scaled so that they return signed distances.
+    const float (*M)[4] = ctx.transform.mvp.m;
+    float planes[6][4];
+    for (int p = 0; p < 6; ++p) {
+        float sign = (p & 1) ? -1.0f : 1.0f;
+        for (int k = 0; k < 4; ++k) planes[p][k] = M[3][k] + sign * M[p / 2][k];
+        float len = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+        for (int k = 0; k < 4; ++k) planes[p][k] /= len;
     }
-}
 
-void render_scene() {
-    int width = 32;
-    int height = 16;
-    int poleTop = (height - 2) * width;
-    int poleBottom = poleTop + 1;
+    std::vector<MeshBounds> bounds;
+    bool test = instances.size() > 1;
+    size_t firstVertex = 0;
+    for (size_t i = 0; i < instances.size(); ++i) {
+        const Instance& inst = instances[i];
+        if (test) {
+            size_t b = 0;
+            while (b < bounds.size() && bounds[b].mesh != inst.mesh) ++b;
+            if (b == bounds.size()) {
+                MeshBounds mb;
+                mb.mesh = inst.mesh;
+                mesh_bounding_sphere(*inst.mesh, mb.center, mb.radius);
+                bounds.push_back(mb);
+            }
 
-    for (int y = 0; y < height - 3; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int nextX = (x + 1) % width;
-            int i0 = y * width + x;
-            int i1 = y * width + nextX;
-            int i2 = (y + 1) * width + x;
-            int i3 = (y + 1) * width + nextX;
-            rasterize_triangle(gVertexBuffer[i0], gVertexBuffer[i2], gVertexBuffer[i1]);
-            rasterize_triangle(gVertexBuffer[i1], gVertexBuffer[i2], gVertexBuffer[i3]);
+            float c[3];
+            mat4_transform_point(inst.model, bounds[b].center, c);
+            float r = bounds[b].radius * mat4_max_scale(inst.model);
+            bool outside = false;
+            for (int p = 0; p < 6 && !outside; ++p)
+                outside = planes[p][0] * c[0] + planes[p][1] * c[1] + planes[p][2] * c[2] + planes[p][3] < -r;
+            if (outside) {
+                STAT_ADD(ctx.primStats.instancesCulled, 1);
+                continue;
+            }
         }
-    }
 
-    for (int x = 0; x < width; ++x) {
-        int nextX = (x + 1) % width;
-        rasterize_triangle(gVertexBuffer[poleTop], gVertexBuffer[x], gVertexBuffer[nextX]);
+        InstanceDraw d;
+        d.mesh = inst.mesh;
+        d.transform = ctx.transform;
+        d.transform.mvp = mat4_multiply(ctx.transform.mvp, inst.model);
+        d.model = inst.model;
+        // The cofactors point normals inward when the model mirrors.
+        d.mirrored = mat4_normal_matrix(inst.model, d.normal) < 0.0f;
+        if (d.mirrored)
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c) d.normal[r][c] = -d.normal[r][c];
+        d.material = inst.material;
+        d.firstVertex = firstVertex;
+        firstVertex += inst.mesh->vertex_count();
+        ctx.draws.push_back(d);
     }
+}
 
-    int base = (height - 3) * width;
-    for (int x = 0; x < width; ++x) {
-        int nextX = (x + 1) % width;
-        rasterize_triangle(gVertexBuffer[poleBottom], gVertexBuffer[base + nextX], gVertexBuffer[base + x]);
+// Vertex shaders: a type whose shade<Attributes>() writes the attributes in
+// `Attributes` of vertex `src` of the draw's mesh. Screen position comes
+// from the SIMD transform kernel and is not the vertex shader's business.
+struct ModelVertexShader {
+    template <unsigned Attributes>
+    static void shade(const InstanceDraw& d, size_t src, Vertex& v) {
+        const Mesh& mesh = *d.mesh;
+        if (Attributes & ATTR_POSITION) {
+            const float (*M)[4] = d.model.m;
+            float x = mesh.x[src], y = mesh.y[src], z = mesh.z[src];
+            v.wx = M[0][0] * x + M[0][1] * y + M[0][2] * z + M[0][3];
+            v.wy = M[1][0] * x + M[1][1] * y + M[1][2] * z + M[1][3];
+            v.wz = M[2][0] * x + M[2][1] * y + M[2][2] * z + M[2][3];
+        }
+        if (Attributes & ATTR_NORMAL) {
+            const float (*N)[3] = d.normal;
+            float nx = mesh.nx[src], ny = mesh.ny[src], nz = mesh.nz[src];
+            v.nx = N[0][0] * nx + N[0][1] * ny + N[0][2] * nz;
+            v.ny = N[1][0] * nx + N[1][1] * ny + N[1][2] * nz;
+            v.nz = N[2][0] * nx + N[2][1] * ny + N[2][2] * nz;
+        }
+        if (Attributes & ATTR_TEXCOORD) {
+            bool has = mesh.has_texcoords();
+            v.u = has ? mesh.u[src] : 0.0f;
+            v.v = has ? mesh.v[src] : 0.0f;
+        }
     }
+};
+
+// Vertex stage: transforms the vertices of every visible instance by its
+// model-view-projection matrix and computes their clip outcodes with the
+// widest SIMD kernel available, VERTEX_CHUNK vertices per pool job (a job
+// may span several small instances), then gathers screen position and the
+// vertex shader's `Attributes` into vertexBuffer for triangle setup.
+// Attributes outside the set are left unset.
+#define VERTEX_CHUNK 16384
+
+template <class VertexShader, unsigned Attributes>
+void transform_vertices(RenderContext& ctx, ThreadPool& pool) {
+    const std::vector<InstanceDraw>& draws = ctx.draws;
+    size_t count = draws.empty() ? 0 : draws.back().firstVertex + draws.back().mesh->vertex_count();
+    ctx.clipX.resize(count); ctx.clipY.resize(count); ctx.clipZ.resize(count); ctx.clipW.resize(count);
+    ctx.screenX.resize(count); ctx.screenY.resize(count); ctx.screenZ.resize(count);
+    ctx.outcodes.resize(count);
+    ctx.vertexBuffer.resize(count);
+    STAT_ADD(ctx.primStats.verticesTransformed, (long long)count);
+
+    TransformFunc transform = transform_func(ctx.options.rasterPath);
+    int chunks = (int)((count + VERTEX_CHUNK - 1) / VERTEX_CHUNK);
+    pool.run(chunks, [&](int chunk, int) {
+        size_t begin = (size_t)chunk * VERTEX_CHUNK;
+        size_t end = std::min(begin + VERTEX_CHUNK, count);
+        // Last instance starting at or before `begin`.
+        size_t k = std::upper_bound(draws.begin(), draws.end(), begin,
+            [](size_t v, const InstanceDraw& d) { return v < d.firstVertex; }) - draws.begin() - 1;
+
+        for (size_t at = begin; at < end; ++k) {
+            const InstanceDraw& d = draws[k];
+            const Mesh& mesh = *d.mesh;
+            size_t local = at - d.firstVertex;
+            size_t n = std::min(end - at, mesh.vertex_count() - local);
+            if (!n) continue;
+            VertexStreams out = {
+                &ctx.clipX[at], &ctx.clipY[at], &ctx.clipZ[at], &ctx.clipW[at],
+                &ctx.screenX[at], &ctx.screenY[at], &ctx.screenZ[at], &ctx.outcodes[at]
+            };
+            transform(d.transform, &mesh.x[local], &mesh.y[local], &mesh.z[local], n, out);
+
+            for (size_t j = 0; j < n; ++j) {
+                size_t i = at + j;
+                Vertex& v = ctx.vertexBuffer[i];
+                v.x = ctx.screenX[i];
+                v.y = ctx.screenY[i];
+                v.z = ctx.screenZ[i];
+                if (Attributes & ATTR_TEXCOORD) v.rhw = 1.0f / ctx.clipW[i];
+                VertexShader::template shade<Attributes>(d, local + j, v);
+            }
+            at += n;
+        }
+    });
 }
 
-void save_image(const char* filename) {
-    FILE* f;
-    if (fopen_s(&f, filename, "wb") != 0) {
-        fprintf(stderr, "Error: Could not open file for writing.\n");
-        return;
-    }
-    fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
-    fwrite(framebuffer, 1, SCREEN_WIDTH * SCREEN_HEIGHT * 3, f);
-    fclose(f);
+// Appends a vertex at parameter t along a -> b, interpolating clip position
+// and attributes linearly in clip space.
+static int add_clip_vertex(RenderContext& ctx, int a, int b, float t) {
+    // Copies: the push_back calls below may reallocate the buffers.
+    ClipVertex ca = clip_vertex(ctx, a), cb = clip_vertex(ctx, b);
+    Vertex va = ctx.vertexBuffer[a], vb = ctx.vertexBuffer[b];
+
+    ClipVertex c;
+    c.x = ca.x + (cb.x - ca.x) * t;
+    c.y = ca.y + (cb.y - ca.y) * t;
+    c.z = ca.z + (cb.z - ca.z) * t;
+    c.w = ca.w + (cb.w - ca.w) * t;
+
+    Vertex v;
+    v.wx = va.wx + (vb.wx - va.wx) * t;
+    v.wy = va.wy + (vb.wy - va.wy) * t;
+    v.wz = va.wz + (vb.wz - va.wz) * t;
+    v.nx = va.nx + (vb.nx - va.nx) * t;
+    v.ny = va.ny + (vb.ny - va.ny) * t;
+    v.nz = va.nz + (vb.nz - va.nz) * t;
+    v.u = va.u + (vb.u - va.u) * t;
+    v.v = va.v + (vb.v - va.v) * t;
+    v.rhw = 1.0f / c.w;
+    clip_to_screen(ctx, c, v);
+
+    ctx.clipX.push_back(c.x);
+    ctx.clipY.push_back(c.y);
+    ctx.clipZ.push_back(c.z);
+    ctx.clipW.push_back(c.w);
+    ctx.vertexBuffer.push_back(v);
+    return (int)ctx.vertexBuffer.size() - 1;
 }
 
-int main() {
-    clear_buffers();
-    create_scene();
-    project_vertices();
-    render_scene();
-    save_image("output.ppm");
-    return 0;
+// Sutherland-Hodgman clip of one triangle against the planes in `planes`;
+// the resulting convex polygon is fanned back into triangles.
+static void clip_triangle(RenderContext& ctx, const Triangle& t, unsigned planes) {
+    int poly[3 + CLIP_PLANES], next[3 + CLIP_PLANES];
+    int count = 3;
+    poly[0] = t.i0; poly[1] = t.i1; poly[2] = t.i2;
+
+    for (int p = 0; p < CLIP_PLANES && count >= 3; ++p) {
+        if (!(planes & (1u << p))) continue;
+        int n = 0;
+        for (int i = 0; i < count; ++i) {
+            int a = poly[i], b = poly[(i + 1) % count];
+            float da = clip_distance(ctx, clip_vertex(ctx, a), p);
+            float db = clip_distance(ctx, clip_vertex(ctx, b), p);
+            if (da >= 0.0f) next[n++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+                next[n++] = add_clip_vertex(ctx, a, b, da / (da - db));
+        }
+        count = n;
+        for (int i = 0; i < count; ++i) poly[i] = next[i];
+    }
+
+    for (int i = 1; i + 1 < count; ++i) {
+        Triangle tri = { poly[0], poly[i], poly[i + 1], t.material };
+        ctx.triangles.push_back(tri);
+    }
+}
+
+// Primitive assembly: walks the index buffer of every visible instance,
+// rejects triangles entirely outside one clip plane and clips the ones that
+// cross the near/far planes or the guard band. Expects transform_vertices()
+// to have run.
+void assemble_triangles(RenderContext& ctx) {
+    ctx.triangles.clear();
+
+    const unsigned char* outcodes = ctx.outcodes.data();
+    for (size_t k = 0; k < ctx.draws.size(); ++k) {
+        const InstanceDraw& d = ctx.draws[k];
+        const uint32_t* idx = d.mesh->indices.data();
+        size_t count = d.mesh->triangle_count();
+        int base = (int)d.firstVertex;
+        // A mirroring model reverses the winding; swapping two corners
+        // restores it.
+        int second = d.mirrored ? 2 : 1, third = d.mirrored ? 1 : 2;
+        for (size_t i = 0; i < count; ++i, idx += 3) {
+            Triangle t = { base + (int)idx[0], base + (int)idx[second], base + (int)idx[third], d.material };
+            unsigned c0 = outcodes[t.i0];
+            unsigned c1 = outcodes[t.i1];
+            unsigned c2 = outcodes[t.i2];
+
+            STAT_ADD(ctx.primStats.triangles, 1);
+            if (c0 & c1 & c2) {
+                STAT_ADD(ctx.primStats.frustumCulled, 1);
+            } else if ((c0 | c1 | c2) == 0) {
+                ctx.triangles.push_back(t);
+            } else {
+                STAT_ADD(ctx.primStats.clipped, 1);
+                clip_triangle(ctx, t, c0 | c1 | c2);
+            }
+        }
+    }
+}
+
+// Runs triangle setup and appends every surviving triangle to the bin of
+// each tile its pixel bounding box overlaps. Bins keep submission order, so
+// per-pixel results do not depend on how tiles are scheduled.
+void bin_triangles(RenderContext& ctx) {
+    for (size_t i = 0; i < ctx.tileBins.size(); ++i) ctx.tileBins[i].clear();
+    ctx.triangleSetups.clear();
+
+    for (int t = 0; t < (int)ctx.triangles.size(); ++t) {
+        TriangleSetup s;
+        STAT_ADD(ctx.primStats.trianglesSetUp, 1);
+        if (!setup_triangle(ctx, t, s)) continue;
+        STAT_ADD(ctx.primStats.trianglesBinned, 1);
+
+        int index = (int)ctx.triangleSetups.size();
+        ctx.triangleSetups.push_back(s);
+        for (int ty = s.miny / TILE_SIZE; ty <= s.maxy / TILE_SIZE; ++ty)
+            for (int tx = s.minx / TILE_SIZE; tx <= s.maxx / TILE_SIZE; ++tx)
+                ctx.tileBins[(size_t)ty * ctx.tilesX + tx].push_back(index);
+    }
+}
+
+// Box around the world-space vertices of triangle `t`.
+static inline void triangle_world_box(const RenderContext& ctx, const Triangle& t, float lo[3], float hi[3]) {
+    const Vertex* v[3] = { &ctx.vertexBuffer[t.i0], &ctx.vertexBuffer[t.i1], &ctx.vertexBuffer[t.i2] };
+    lo[0] = hi[0] = v[0]->wx;
+    lo[1] = hi[1] = v[0]->wy;
+    lo[2] = hi[2] = v[0]->wz;
+    for (int k = 1; k < 3; ++k) {
+        float p[3] = { v[k]->wx, v[k]->wy, v[k]->wz };
+        for (int c = 0; c < 3; ++c) {
+            lo[c] = fminf(lo[c], p[c]);
+            hi[c] = fmaxf(hi[c], p[c]);
+        }
+    }
+}
+
+// Whether `light` reaches into the box [lo, hi]; lights that do not add
+// exactly nothing to the points inside.
+static inline bool light_reaches_box(const Light& light, const float lo[3], const float hi[3]) {
+    float d2 = 0.0f;
+    for (int c = 0; c < 3; ++c) {
+        float p = light.position[c];
+        float d = p < lo[c] ? lo[c] - p : p > hi[c] ? p - hi[c] : 0.0f;
+        d2 += d * d;
+    }
+    return d2 < light.range * light.range;
+}
+
+// RATE_ADAPTIVE: the largest change of a linear color channel allowed
+// across one coarse pixel.
+static const float kRateColorStep = 0.02f;
+
+// Bound on the change per pixel of any color channel over triangle setup
+// `s` lit by `lights`. The interpolated normal is linear in screen space, so
+// its gradient is constant: the diffuse term changes at most as fast as the
+// normal, the specular term p (N.H)^(p - 1) times as fast, with N.H bounded
+// over the cone of the vertex normals (H taken at the vertices). Each
+// light reaching the triangle adds its terms scaled by its brightest
+// channel; attenuation only scales them down, and its own change is not
+// bounded.
+template <unsigned Attributes>
+float color_gradient(const RenderContext& ctx, const TriangleSetup& s, const LightList& lights) {
+    // Texture detail has no bound the vertices could give.
+    if (Attributes & ATTR_TEXCOORD) return INFINITY;
+    // Without normals a triangle's color is constant.
+    if (!(Attributes & ATTR_NORMAL)) return 0.0f;
+    const Triangle& t = ctx.triangles[s.tri];
+    const Vertex* v[3] = { &ctx.vertexBuffer[t.i0], &ctx.vertexBuffer[t.i1], &ctx.vertexBuffer[t.i2] };
+
+    // Screen gradients of alpha and beta, as interpolate_depth() computes them.
+    float ax = (v[1]->y - v[2]->y) / s.area, ay = (v[2]->x - v[1]->x) / s.area;
+    float bx = (v[2]->y - v[0]->y) / s.area, by = (v[0]->x - v[2]->x) / s.area;
+    float n[3][3], len[3];
+    for (int k = 0; k < 3; ++k) {
+        n[k][0] = v[k]->nx; n[k][1] = v[k]->ny; n[k][2] = v[k]->nz;
+        len[k] = sqrtf(n[k][0] * n[k][0] + n[k][1] * n[k][1] + n[k][2] * n[k][2]);
+    }
+    float dx2 = 0.0f, dy2 = 0.0f;
+    for (int c = 0; c < 3; ++c) {
+        float d0 = n[0][c] - n[2][c], d1 = n[1][c] - n[2][c];
+        float dx = d0 * ax + d1 * bx, dy = d0 * ay + d1 * by;
+        dx2 += dx * dx;
+        dy2 += dy * dy;
+    }
+    float minLen = fminf(len[0], fminf(len[1], len[2]));
+    if (!(minLen > 0.0f)) return INFINITY;
+    float g = sqrtf(fmaxf(dx2, dy2)) / minLen;
+    if (!(Attributes & ATTR_POSITION)) return g;
+
+    const Material& m = ctx.materials[t.material];
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for (int k = 0; k < 3; ++k)
+        for (int c = 0; c < 3; ++c) mean[c] += n[k][c] / len[k];
+    float meanLen = sqrtf(mean[0] * mean[0] + mean[1] * mean[1] + mean[2] * mean[2]);
+    if (!(meanLen > 0.0f)) return INFINITY;
+    float cone = 1.0f;
+    for (int k = 0; k < 3; ++k)
+        cone = fminf(cone, (n[k][0] * mean[0] + n[k][1] * mean[1] + n[k][2] * mean[2]) / (len[k] * meanLen));
+    float sinCone = sqrtf(fmaxf(0.0f, 1.0f - cone * cone));
+
+    const float* eye = ctx.camera.position;
+    float diffuse = fmaxf(m.diffuse[0], fmaxf(m.diffuse[1], m.diffuse[2]));
+    float specularMax = fmaxf(m.specular[0], fmaxf(m.specular[1], m.specular[2]));
+    float lo[3], hi[3];
+    triangle_world_box(ctx, t, lo, hi);
+    float total = 0.0f;
+    for (int l = 0; l < lights.count; ++l) {
+        const Light& light = lights.lights[l];
+        // Whether light culling is on must not change the rate.
+        if (!light_reaches_box(light, lo, hi)) continue;
+        float maxNdotH = 0.0f;
+        for (int k = 0; k < 3; ++k) {
+            float lx = light.position[0] - v[k]->wx, ly = light.position[1] - v[k]->wy, lz = light.position[2] - v[k]->wz;
+            float ex = eye[0] - v[k]->wx, ey = eye[1] - v[k]->wy, ez = eye[2] - v[k]->wz;
+            float ll = sqrtf(lx * lx + ly * ly + lz * lz), el = sqrtf(ex * ex + ey * ey + ez * ez);
+            float hx = lx / ll + ex / el, hy = ly / ll + ey / el, hz = lz / ll + ez / el;
+            float c = (mean[0] * hx + mean[1] * hy + mean[2] * hz) / (meanLen * sqrtf(hx * hx + hy * hy + hz * hz));
+            // cos(angle to H - cone angle), or 1 once H is inside the cone.
+            maxNdotH = fmaxf(maxNdotH, c >= cone ? 1.0f : c * cone + sqrtf(fmaxf(0.0f, 1.0f - c * c)) * sinCone);
+        }
+        float specular = specularMax;
+        if (m.shininess > 0) specular *= m.shininess * pow_int(fminf(maxNdotH, 1.0f), m.shininess - 1);
+        else specular = 0.0f;
+        float brightest = fmaxf(light.color[0], fmaxf(light.color[1], light.color[2]));
+        total += brightest * (diffuse + specular);
+    }
+    return total * g;
+}
+
+// Coarsest rate shift at which no triangle in `bin` changes color by more
+// than kRateColorStep across a coarse pixel.
+template <unsigned Attributes>
+int adaptive_tile_rate(const RenderContext& ctx, const std::vector<int>& bin, const LightList& lights) {
+    float worst = 0.0f;
+    for (size_t i = 0; i < bin.size(); ++i) {
+        worst = fmaxf(worst, color_gradient<Attributes>(ctx, ctx.triangleSetups[bin[i]], lights));
+        if (!(2.0f * worst <= kRateColorStep)) return 0;
+    }
+    return 4.0f * worst <= kRateColorStep ? 2 : 1;
+}
+
+// Finest rate of the rate image samples under the tile, the image
+// stretched over the frame; samples are the first channel.
+int image_tile_rate(const RenderContext& ctx, int tile) {
+    const Image& image = *ctx.options.rateImage;
+    int w = ctx.target.width(), h = ctx.target.height();
+    int x0 = (tile % ctx.tilesX) * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, w);
+    int y0 = (tile / ctx.tilesX) * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, h);
+    // Raster columns [x0, x1) are image columns [w - x1, w - x0); rows alike.
+    int ix0 = (int)((long long)(w - x1) * image.width / w);
+    int ix1 = std::max(ix0 + 1, (int)(((long long)(w - x0) * image.width + w - 1) / w));
+    int iy0 = (int)((long long)(h - y1) * image.height / h);
+    int iy1 = std::max(iy0 + 1, (int)(((long long)(h - y0) * image.height + h - 1) / h));
+    unsigned char lo = 255;
+    for (int iy = iy0; iy < iy1; ++iy)
+        for (int ix = ix0; ix < ix1; ++ix)
+            lo = std::min(lo, image.rgb[((size_t)iy * image.width + ix) * 3]);
+    return lo < 85 ? 0 : lo < 170 ? 1 : 2;
+}
+
+template <class PixelShader>
+int tile_shading_rate(const RenderContext& ctx, int tile) {
+    switch (ctx.options.shadingRate) {
+    case RATE_2X2: return 1;
+    case RATE_4X4: return 2;
+    case RATE_ADAPTIVE: return adaptive_tile_rate<PixelShader::attributes>(ctx, ctx.tileBins[tile], light_list(ctx.tileLights[tile]));
+    case RATE_IMAGE: return image_tile_rate(ctx, tile);
+    default: return 0;
+    }
+}
+
+// Pads a box of interpolated world-space positions for the rounding of the
+// interpolation and for slightly negative barycentrics inside snapped
+// triangles.
+static void pad_shading_box(float lo[3], float hi[3]) {
+    float extent = fmaxf(hi[0] - lo[0], fmaxf(hi[1] - lo[1], hi[2] - lo[2]));
+    for (int c = 0; c < 3; ++c) {
+        float pad = 1e-3f * extent + 1e-5f * fmaxf(fabsf(lo[c]), fabsf(hi[c]));
+        lo[c] -= pad;
+        hi[c] += pad;
+    }
+}
+
+// Fills ctx.tileLights[tile] with the frame's lights, in frame order, that
+// reach the vertices' box of some triangle in the tile's bin: the lights
+// its light tiles and its adaptive rate pick from. With light culling off
+// every light is kept; a shader that reads no lights gets none.
+template <class PixelShader>
+void gather_tile_lights(RenderContext& ctx, int tile) {
+    std::vector<Light>& out = ctx.tileLights[tile];
+    out.clear();
+    if (!PixelShader::lit) return;
+    const LightList& lights = ctx.lights;
+    if (!ctx.options.lightCulling) {
+        out.assign(lights.lights, lights.lights + lights.count);
+        return;
+    }
+
+    const std::vector<int>& bin = ctx.tileBins[tile];
+    float lo[3] = { INFINITY, INFINITY, INFINITY }, hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (size_t i = 0; i < bin.size(); ++i) {
+        float vlo[3], vhi[3];
+        triangle_world_box(ctx, ctx.triangles[ctx.triangleSetups[bin[i]].tri], vlo, vhi);
+        for (int c = 0; c < 3; ++c) {
+            lo[c] = fminf(lo[c], vlo[c]);
+            hi[c] = fmaxf(hi[c], vhi[c]);
+        }
+    }
+    pad_shading_box(lo, hi);
+    for (int i = 0; i < lights.count; ++i)
+        if (light_reaches_box(lights.lights[i], lo, hi)) out.push_back(lights.lights[i]);
+}
+
+// Fills ctx.lightTiles for the light tiles of `tile`, shaded at rate
+// `shift`, with those of ctx.tileLights[tile] that reach a box around every
+// world-space position the light tile's pixels are shaded at. Positions are
+// interpolated affinely in screen space, so at the full rate a triangle's
+// lie in the box of its positions at the corners of its bounding rectangle
+// within the light tile, and in the box of its vertices; coarse pixel
+// centers are pulled onto their triangle, so coarser rates use the vertex
+// box alone. Once `depthFinal`, triangles whose nearest depth is behind
+// every block of a light tile are hidden there and skipped.
+void cull_light_tiles(RenderContext& ctx, int tile, int shift, bool depthFinal, RasterStats& stats) {
+    const int n = TILE_SIZE / LIGHT_TILE, blocks = LIGHT_TILE / HIZ_BLOCK;
+    int tminx = (tile % ctx.tilesX) * TILE_SIZE, tminy = (tile / ctx.tilesX) * TILE_SIZE;
+    int tmaxx = std::min(tminx + TILE_SIZE, ctx.target.width()) - 1;
+    int tmaxy = std::min(tminy + TILE_SIZE, ctx.target.height()) - 1;
+    int lx0 = tminx / LIGHT_TILE, ly0 = tminy / LIGHT_TILE;
+    int lx1 = tmaxx / LIGHT_TILE, ly1 = tmaxy / LIGHT_TILE;
+    const std::vector<Light>& candidates = ctx.tileLights[tile];
+
+    if (!ctx.options.lightCulling || candidates.empty()) {
+        for (int ly = ly0; ly <= ly1; ++ly)
+            for (int lx = lx0; lx <= lx1; ++lx)
+                ctx.lightTiles[(size_t)ly * ctx.lightTilesX + lx] = candidates;
+    } else {
+        float lo[n * n][3], hi[n * n][3], maxz[n * n];
+        for (int ly = ly0; ly <= ly1; ++ly) {
+            for (int lx = lx0; lx <= lx1; ++lx) {
+                int k = (ly - ly0) * n + (lx - lx0);
+                for (int c = 0; c < 3; ++c) {
+                    lo[k][c] = INFINITY;
+                    hi[k][c] = -INFINITY;
+                }
+                maxz[k] = depthFinal ? -INFINITY : INFINITY;
+                if (!depthFinal) continue;
+                for (int hy = ly * blocks; hy < (ly + 1) * blocks && hy < ctx.hizH; ++hy)
+                    for (int hx = lx * blocks; hx < (lx + 1) * blocks && hx < ctx.hizW; ++hx)
+                        maxz[k] = fmaxf(maxz[k], ctx.hizMax[(size_t)hy * ctx.hizW + hx]);
+            }
+        }
+
+        const std::vector<int>& bin = ctx.tileBins[tile];
+        for (size_t i = 0; i < bin.size(); ++i) {
+            const TriangleSetup& s = ctx.triangleSetups[bin[i]];
+            int minx = std::max(s.minx, tminx), miny = std::max(s.miny, tminy);
+            int maxx = std::min(s.maxx, tmaxx), maxy = std::min(s.maxy, tmaxy);
+            if (minx > maxx || miny > maxy) continue;
+            const Triangle& t = ctx.triangles[s.tri];
+            const Vertex* v[3] = { &ctx.vertexBuffer[t.i0], &ctx.vertexBuffer[t.i1], &ctx.vertexBuffer[t.i2] };
+            float vlo[3], vhi[3];
+            triangle_world_box(ctx, t, vlo, vhi);
+
+            for (int ly = miny / LIGHT_TILE; ly <= maxy / LIGHT_TILE; ++ly) {
+                for (int lx = minx / LIGHT_TILE; lx <= maxx / LIGHT_TILE; ++lx) {
+                    int k = (ly - ly0) * n + (lx - lx0);
+                    if (s.minz > maxz[k]) continue;
+                    float tlo[3] = { vlo[0], vlo[1], vlo[2] }, thi[3] = { vhi[0], vhi[1], vhi[2] };
+                    if (!shift) {
+                        float x0 = (float)std::max(minx, lx * LIGHT_TILE), x1 = (float)std::min(maxx, lx * LIGHT_TILE + LIGHT_TILE - 1);
+                        float y0 = (float)std::max(miny, ly * LIGHT_TILE), y1 = (float)std::min(maxy, ly * LIGHT_TILE + LIGHT_TILE - 1);
+                        const float corners[4][2] = { { x0, y0 }, { x1, y0 }, { x0, y1 }, { x1, y1 } };
+                        float clo[3] = { INFINITY, INFINITY, INFINITY }, chi[3] = { -INFINITY, -INFINITY, -INFINITY };
+                        for (int j = 0; j < 4; ++j) {
+                            float x = corners[j][0], y = corners[j][1];
+                            float alpha = ((v[1]->x - x) * (v[2]->y - y) - (v[2]->x - x) * (v[1]->y - y)) / s.area;
+                            float beta = ((v[2]->x - x) * (v[0]->y - y) - (v[0]->x - x) * (v[2]->y - y)) / s.area;
+                            float gamma = 1.0f - alpha - beta;
+                            float p[3] = {
+                                alpha * v[0]->wx + beta * v[1]->wx + gamma * v[2]->wx,
+                                alpha * v[0]->wy + beta * v[1]->wy + gamma * v[2]->wy,
+                                alpha * v[0]->wz + beta * v[1]->wz + gamma * v[2]->wz
+                            };
+                            for (int c = 0; c < 3; ++c) {
+                                clo[c] = fminf(clo[c], p[c]);
+                                chi[c] = fmaxf(chi[c], p[c]);
+                            }
+                        }
+                        bool empty = false;
+                        for (int c = 0; c < 3; ++c) {
+                            tlo[c] = fmaxf(tlo[c], clo[c]);
+                            thi[c] = fminf(thi[c], chi[c]);
+                            empty |= !(tlo[c] <= thi[c]);
+                        }
+                        // Only the triangle's bounding box, not its area, meets the light tile.
+                        if (empty) continue;
+                    }
+                    for (int c = 0; c < 3; ++c) {
+                        lo[k][c] = fminf(lo[k][c], tlo[c]);
+                        hi[k][c] = fmaxf(hi[k][c], thi[c]);
+                    }
+                }
+            }
+        }
+
+        for (int ly = ly0; ly <= ly1; ++ly) {
+            for (int lx = lx0; lx <= lx1; ++lx) {
+                int k = (ly - ly0) * n + (lx - lx0);
+                std::vector<Light>& out = ctx.lightTiles[(size_t)ly * ctx.lightTilesX + lx];
+                out.clear();
+                if (!(lo[k][0] <= hi[k][0])) continue;
+                pad_shading_box(lo[k], hi[k]);
+                for (size_t i = 0; i < candidates.size(); ++i)
+                    if (light_reaches_box(candidates[i], lo[k], hi[k])) out.push_back(candidates[i]);
+            }
+        }
+    }
+
+#if PIPELINE_COUNTERS
+    for (int ly = ly0; ly <= ly1; ++ly)
+        for (int lx = lx0; lx <= lx1; ++lx)
+            stats.maxTileLights = std::max(stats.maxTileLights, (long long)ctx.lightTiles[(size_t)ly * ctx.lightTilesX + lx].size());
+#else
+    (void)stats;
+#endif
+}
+
+template <class PixelShader>
+void render_tile(RenderContext& ctx, int tile, RasterStats& stats) {
+    int tminx = (tile % ctx.tilesX) * TILE_SIZE;
+    int tminy = (tile / ctx.tilesX) * TILE_SIZE;
+    int tmaxx = std::min(tminx + TILE_SIZE, ctx.target.width()) - 1;
+    int tmaxy = std::min(tminy + TILE_SIZE, ctx.target.height()) - 1;
+
+    const std::vector<int>& bin = ctx.tileBins[tile];
+    if (ctx.tileClear[tile] == TILE_PENDING) {
+        // Pixels of an empty tile are not read again this frame.
+        clear_tile(ctx, tile, bin.empty());
+        STAT_ADD(bin.empty() ? stats.tilesClearedEmpty : stats.tilesClearedOnUse, 1);
+        ctx.tileClear[tile] = TILE_CLEAN;
+    }
+    if (bin.empty()) return;
+    ctx.tileClear[tile] = TILE_DIRTY;
+    gather_tile_lights<PixelShader>(ctx, tile);
+    int shift = tile_shading_rate<PixelShader>(ctx, tile);
+    ctx.tileRates[tile] = (unsigned char)shift;
+    STAT_ADD(stats.rateTiles[shift], 1);
+
+    const std::vector<TriangleSetup>& setups = ctx.triangleSetups;
+    if (ctx.options.shadingMode == SHADING_VISIBILITY) {
+        for (size_t i = 0; i < bin.size(); ++i)
+            rasterize_triangle<PASS_VISIBILITY, NoShader>(ctx, setups[bin[i]], bin[i], tminx, tminy, tmaxx, tmaxy, shift, stats);
+        return;
+    }
+
+    // Light tiles are culled once the tile's depth is as final as shading
+    // will see it: after the prepass, else against the bin alone.
+    if (ctx.options.depthMode == DEPTH_PREPASS) {
+        for (size_t i = 0; i < bin.size(); ++i)
+            rasterize_triangle<PASS_DEPTH_ONLY, NoShader>(ctx, setups[bin[i]], bin[i], tminx, tminy, tmaxx, tmaxy, shift, stats);
+        cull_light_tiles(ctx, tile, shift, true, stats);
+        for (size_t i = 0; i < bin.size(); ++i)
+            rasterize_triangle<PASS_SHADE_EQUAL, PixelShader>(ctx, setups[bin[i]], bin[i], tminx, tminy, tmaxx, tmaxy, shift, stats);
+    } else if (ctx.options.depthMode == DEPTH_LATE) {
+        cull_light_tiles(ctx, tile, shift, false, stats);
+        for (size_t i = 0; i < bin.size(); ++i)
+            rasterize_triangle<PASS_SHADE_LATE, PixelShader>(ctx, setups[bin[i]], bin[i], tminx, tminy, tmaxx, tmaxy, shift, stats);
+    } else {
+        cull_light_tiles(ctx, tile, shift, false, stats);
+        for (size_t i = 0; i < bin.size(); ++i)
+            rasterize_triangle<PASS_SHADE_EARLY, PixelShader>(ctx, setups[bin[i]], bin[i], tminx, tminy, tmaxx, tmaxy, shift, stats);
+    }
+}
+
+// Visibility-buffer shading pass over the tiles of row band `band`: walks
+// the coarse quads of each tile that was rendered to, at the tile's shading
+// rate, and shades every covered pixel exactly once from its stored
+// triangle. A quad holding several triangles is shaded once per triangle,
+// each time writing only that triangle's pixels. Clean tiles hold no ids.
+template <class PixelShader>
+void shade_visibility_band(RenderContext& ctx, int band, RasterStats& stats) {
+    FrameBuffer& target = ctx.target;
+    const uint32_t* ids = target.ids();
+    int w = target.width(), h = target.height();
+    int y0 = band * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, h);
+
+    for (int tx = 0; tx < ctx.tilesX; ++tx) {
+        int tile = band * ctx.tilesX + tx;
+        if (ctx.tileClear[tile] != TILE_DIRTY) continue;
+        int shift = ctx.tileRates[tile];
+        cull_light_tiles(ctx, tile, shift, true, stats);
+        int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, w);
+        for (int by = y0; by < y1; by += HIZ_BLOCK) {
+            for (int bx = x0; bx < x1; bx += HIZ_BLOCK) {
+                const LightList lights = pixel_lights(ctx, bx, by);
+                size_t index[HIZ_BLOCK * HIZ_BLOCK];
+                uint32_t pixelIds[HIZ_BLOCK * HIZ_BLOCK];
+                for (uint64_t quads = kCoarseQuadOrigins[shift]; quads; quads &= quads - 1) {
+                    int origin = lowest_set_bit(quads);
+                    uint64_t pending = 0;
+                    for (uint64_t m = kCoarseQuadMasks[shift] << origin; m; m &= m - 1) {
+                        int bit = lowest_set_bit(m);
+                        int px = bx + bit % HIZ_BLOCK, py = by + bit / HIZ_BLOCK;
+                        if (px >= x1 || py >= y1) continue;
+                        index[bit] = pixel_index(ctx, px, py);
+                        pixelIds[bit] = ids[index[bit]];
+                        if (pixelIds[bit] != VIS_EMPTY) pending |= 1ull << bit;
+                    }
+
+                    while (pending) {
+                        uint32_t id = pixelIds[lowest_set_bit(pending)];
+                        uint64_t pixels = 0;
+                        for (uint64_t m = pending; m; m &= m - 1) {
+                            int bit = lowest_set_bit(m);
+                            if (pixelIds[bit] == id) pixels |= 1ull << bit;
+                        }
+                        pending &= ~pixels;
+
+                        const TriangleSetup& s = ctx.triangleSetups[id];
+                        const Triangle& t = ctx.triangles[s.tri];
+                        const Vertex& v0 = ctx.vertexBuffer[t.i0];
+                        const Vertex& v1 = ctx.vertexBuffer[t.i1];
+                        const Vertex& v2 = ctx.vertexBuffer[t.i2];
+
+                        __m128 alpha, beta, gamma;
+                        QuadInput in;
+                        unsigned char color[QUAD_LANES][3];
+                        unsigned lanes = coarse_lanes(pixels, origin, shift);
+                        interpolate_coarse_quad(v0, v1, v2, s, bx + origin % HIZ_BLOCK, by + origin / HIZ_BLOCK,
+                            shift, alpha, beta, gamma);
+                        interpolate_quad_attributes<PixelShader::attributes>(v0, v1, v2, alpha, beta, gamma, in);
+                        PixelShader::shade_quad(ctx, in, ctx.materials[t.material], lights, color);
+                        STAT_ADD(stats.quadsShaded, 1);
+                        STAT_ADD(stats.lightQuads, lights.count);
+                        STAT_ADD(stats.helperLanes, QUAD_LANES - quad_lane_count(lanes));
+                        for (uint64_t m = pixels; m; m &= m - 1) {
+                            int bit = lowest_set_bit(m);
+                            target.set_color(index[bit], color[coarse_lane(origin, bit, shift)]);
+                            count_shading(ctx, bx + bit % HIZ_BLOCK, by + bit / HIZ_BLOCK, stats);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Stores the time since the previous lap (or construction) in `stage`.
+class StageTimer {
+public:
+#if PIPELINE_COUNTERS
+    StageTimer() : last(std::chrono::steady_clock::now()) {}
+    void lap(double& stage) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        stage = std::chrono::duration<double, std::milli>(now - last).count();
+        last = now;
+    }
+
+private:
+    std::chrono::steady_clock::time_point last;
+#else
+    void lap(double&) {}
+#endif
+};
+
+// Stages from the vertex shader on, instantiated per shader pair so the
+// shaders inline into the vertex gather and the pixel loops. Expects
+// cull_instances() to have run.
+template <class VertexShader, class PixelShader>
+void run_pipeline(RenderContext& ctx, ThreadPool& pool, StageTimer& timer) {
+    transform_vertices<VertexShader, PixelShader::attributes>(ctx, pool);
+    timer.lap(ctx.stageTimes.vertex);
+    assemble_triangles(ctx);
+    timer.lap(ctx.stageTimes.assembly);
+    bin_triangles(ctx);
+    timer.lap(ctx.stageTimes.binning);
+
+    ctx.workerStats.assign(pool.size(), RasterStats());
+    pool.run(ctx.tilesX * ctx.tilesY, [&ctx](int tile, int worker) {
+        render_tile<PixelShader>(ctx, tile, ctx.workerStats[worker]);
+    });
+    timer.lap(ctx.stageTimes.raster);
+
+    if (ctx.options.shadingMode == SHADING_VISIBILITY) {
+        pool.run(ctx.tilesY, [&ctx](int band, int worker) {
+            shade_visibility_band<PixelShader>(ctx, band, ctx.workerStats[worker]);
+        });
+        timer.lap(ctx.stageTimes.shading);
+    }
+}
+
+// Renders `instances` into ctx.target, which must have been cleared; every
+// instance's material index must be valid in `materials`, and every
+// material is lit by `lights`. Triangles of all instances are binned
+// together, in instance order. Tiles of one render are spread over `pool`;
+// renders of separate contexts may run at the same time.
+void render_instances(RenderContext& ctx, const std::vector<Instance>& instances,
+    const std::vector<Material>& materials, const std::vector<Light>& lights, ThreadPool& pool) {
+    ctx.primStats = PrimitiveStats();
+    ctx.stageTimes = StageTimes();
+    ctx.materials = materials.data();
+    ctx.lights.lights = lights.data();
+    ctx.lights.count = (int)lights.size();
+    std::fill(ctx.overdraw.begin(), ctx.overdraw.end(), 0u);
+    StageTimer timer;
+
+    setup_projection(ctx);
+    cull_instances(ctx, instances);
+    // The only per-frame shader dispatch.
+    switch (ctx.options.shader) {
+    case SHADER_REFERENCE: run_pipeline<ModelVertexShader, PhongReferenceShader>(ctx, pool, timer); break;
+    case SHADER_FAST: run_pipeline<ModelVertexShader, PhongFastShader>(ctx, pool, timer); break;
+    case SHADER_NORMAL: run_pipeline<ModelVertexShader, NormalShader>(ctx, pool, timer); break;
+    case SHADER_UNLIT: run_pipeline<ModelVertexShader, UnlitShader>(ctx, pool, timer); break;
+    case SHADER_TEXTURED: run_pipeline<ModelVertexShader, TexturedShader>(ctx, pool, timer); break;
+    }
+}
+
+// Renders `mesh` once, untransformed, with `material` and `lights`.
+void render_scene(RenderContext& ctx, const Mesh& mesh, const Material& material, const std::vector<Light>& lights,
+    ThreadPool& pool) {
+    Instance instance = { &mesh, mat4_identity(), 0 };
+    render_instances(ctx, std::vector<Instance>(1, instance), std::vector<Material>(1, material), lights, pool);
+}
+
+RasterStats total_raster_stats(const RenderContext& ctx) {
+    RasterStats total = RasterStats();
+    for (size_t i = 0; i < ctx.workerStats.size(); ++i) {
+        const RasterStats& w = ctx.workerStats[i];
+        total.pixelsTested += w.pixelsTested;
+        total.depthPassed += w.depthPassed;
+        total.depthFailed += w.depthFailed;
+        total.pixelsShaded += w.pixelsShaded;
+        total.quadsShaded += w.quadsShaded;
+        total.helperLanes += w.helperLanes;
+        for (int r = 0; r < 3; ++r) total.rateTiles[r] += w.rateTiles[r];
+        total.lightQuads += w.lightQuads;
+        total.maxTileLights = std::max(total.maxTileLights, w.maxTileLights);
+        total.tileTriangles += w.tileTriangles;
+        total.tileTrianglesCulled += w.tileTrianglesCulled;
+        total.blocksTested += w.blocksTested;
+        total.blocksCulled += w.blocksCulled;
+        total.tilesClearedOnUse += w.tilesClearedOnUse;
+        total.tilesClearedEmpty += w.tilesClearedEmpty;
+    }
+    return total;
+}
+
+void print_raster_stats(const RenderContext& ctx) {
+#if !PIPELINE_COUNTERS
+    printf("stats: pipeline counters are compiled out (PIPELINE_COUNTERS=0)\n");
+    (void)ctx;
+#else
+    RasterStats st = total_raster_stats(ctx);
+    const PrimitiveStats& ps = ctx.primStats;
+    const StageTimes& tm = ctx.stageTimes;
+    printf("instances: %lld submitted, %lld frustum culled\n", ps.instances, ps.instancesCulled);
+    printf("vertices: %lld transformed\n", ps.verticesTransformed);
+    printf("primitives: %lld triangles, %lld frustum culled, %lld clipped\n",
+        ps.triangles, ps.frustumCulled, ps.clipped);
+    printf("setup: %lld triangles set up, %lld back-face culled, %lld degenerate, %lld cover no pixels, %lld binned\n",
+        ps.trianglesSetUp, ps.backfaceCulled, ps.degenerateCulled, ps.emptyCulled, ps.trianglesBinned);
+    printf("depth: %lld pixels tested, %lld passed, %lld failed\n", st.pixelsTested, st.depthPassed, st.depthFailed);
+    printf("shading: %lld pixels shaded in %lld quads, %lld helper lanes (%.1f%% of lanes), %.2f pixels per lane\n",
+        st.pixelsShaded, st.quadsShaded, st.helperLanes,
+        st.quadsShaded ? 100.0 * st.helperLanes / (st.quadsShaded * QUAD_LANES) : 0.0,
+        st.quadsShaded ? (double)st.pixelsShaded / (st.quadsShaded * QUAD_LANES) : 0.0);
+    if (ctx.options.shadingRate != RATE_1X1)
+        printf("rate: %lld tiles at 1x1, %lld at 2x2, %lld at 4x4\n", st.rateTiles[0], st.rateTiles[1], st.rateTiles[2]);
+    printf("lights: %d in the frame, %.2f per shaded quad, %lld at most in a light tile\n",
+        ctx.lights.count, st.quadsShaded ? (double)st.lightQuads / st.quadsShaded : 0.0, st.maxTileLights);
+    if (!ctx.overdraw.empty()) {
+        long long covered = 0;
+        uint32_t most = 0;
+        for (size_t i = 0; i < ctx.overdraw.size(); ++i) {
+            covered += ctx.overdraw[i] != 0;
+            most = std::max(most, ctx.overdraw[i]);
+        }
+        printf("overdraw: %.2f shader invocations per covered pixel, %u at most\n",
+            covered ? (double)st.pixelsShaded / covered : 0.0, most);
+    }
+    printf("hi-z: %lld/%lld triangle-tiles culled, %lld/%lld %dx%d blocks culled\n",
+        st.tileTrianglesCulled, st.tileTriangles, st.blocksCulled, st.blocksTested, HIZ_BLOCK, HIZ_BLOCK);
+    if (ctx.options.fastClear) {
+        long long tiles = (long long)ctx.tilesX * ctx.tilesY;
+        printf("clear: %lld/%lld tiles cleared before use, %lld empty tiles streamed, %lld already clear\n",
+            st.tilesClearedOnUse, tiles, st.tilesClearedEmpty,
+            tiles - st.tilesClearedOnUse - st.tilesClearedEmpty);
+    }
+    printf("time: vertex %.2f ms, assembly %.2f ms, binning %.2f ms, raster %.2f ms, shading %.2f ms\n",
+        tm.vertex, tm.assembly, tm.binning, tm.raster, tm.shading);
+#endif
+}
+
+// Overdraw heatmap in image orientation: black where nothing was shaded,
+// then blue, cyan, green, yellow, orange and red for 1 to 6 shader
+// invocations, white for more.
+Image overdraw_image(const RenderContext& ctx) {
+    static const unsigned char palette[8][3] = {
+        { 0, 0, 0 }, { 0, 0, 160 }, { 0, 160, 255 }, { 0, 200, 0 },
+        { 230, 230, 0 }, { 255, 128, 0 }, { 255, 0, 0 }, { 255, 255, 255 }
+    };
+    Image image;
+    int w = image.width = ctx.target.width();
+    int h = image.height = ctx.target.height();
+    image.rgb.resize((size_t)w * h * 3);
+    unsigned char* out = image.rgb.data();
+    for (int fy = 0; fy < h; ++fy) {
+        for (int fx = 0; fx < w; ++fx, out += 3) {
+            uint32_t n = ctx.overdraw[(size_t)(h - 1 - fy) * w + (w - 1 - fx)];
+            memcpy(out, palette[std::min(n, 7u)], 3);
+        }
+    }
+    return image;
+}
+
+// "dir/name.png" -> "dir/name_overdraw.png".
+std::string overdraw_path(const std::string& path) {
+    size_t dot = path.rfind('.');
+    return path.substr(0, dot) + "_overdraw" + path.substr(dot);
+}
+
+// Number of pixels whose color or depth differ between two targets of the
+// same size; the layouts and color formats may differ.
+static int count_mismatches(const FrameBuffer& a, const FrameBuffer& b) {
+    int mismatches = 0;
+    for (int y = 0; y < a.height(); ++y) {
+        for (int x = 0; x < a.width(); ++x) {
+            size_t ia = a.index(x, y), ib = b.index(x, y);
+            unsigned char ca[3], cb[3];
+            a.get_color(ia, ca);
+            b.get_color(ib, cb);
+            if (memcmp(ca, cb, 3) != 0 || memcmp(&a.depth()[ia], &b.depth()[ib], sizeof(float)) != 0)
+                ++mismatches;
+        }
+    }
+    return mismatches;
+}
+
+// Renders the scene with every coverage path the CPU supports, each in every
+// target layout and color format, and checks that all of them produce
+// exactly the same color and depth as the scalar loop on a planar, linear
+// target. A last scalar render with light culling toggled checks that the
+// lights a tile leaves out add nothing. The variants render concurrently,
+// one context per pool job.
+int compare_raster_paths(const std::vector<Instance>& instances, const std::vector<Material>& materials,
+    const std::vector<Light>& lights, int width, int height, const RenderOptions& options, ThreadPool& pool) {
+    static const ColorFormat formats[2] = { COLOR_PLANAR, COLOR_RGBA8 };
+    static const PixelLayout layouts[2] = { LAYOUT_LINEAR, LAYOUT_TILED };
+    RasterPath best = detect_raster_path();
+
+    std::vector<RenderContext> contexts;
+    contexts.reserve((best + 1) * 4 + 1);
+    for (int path = RASTER_SCALAR; path <= best; ++path) {
+        RenderOptions o = options;
+        o.rasterPath = (RasterPath)path;
+        for (int f = 0; f < 2; ++f)
+            for (int l = 0; l < 2; ++l)
+                contexts.emplace_back(width, height, o, formats[f], layouts[l]);
+    }
+    RenderOptions culling = options;
+    culling.rasterPath = RASTER_SCALAR;
+    culling.lightCulling = !options.lightCulling;
+    contexts.emplace_back(width, height, culling);
+
+    pool.run((int)contexts.size(), [&](int job, int) {
+        ThreadPool serial(1);
+        clear_buffers(contexts[job]);
+        render_instances(contexts[job], instances, materials, lights, serial);
+    });
+
+    int failures = 0;
+    for (size_t i = 1; i + 1 < contexts.size(); ++i) {
+        const FrameBuffer& target = contexts[i].target;
+        int mismatches = count_mismatches(target, contexts[0].target);
+        printf("%s %s %s vs scalar: %d mismatching pixels\n",
+            raster_path_name(contexts[i].options.rasterPath),
+            target.format() == COLOR_RGBA8 ? "rgba8" : "planar",
+            target.layout() == LAYOUT_TILED ? "tiled" : "linear", mismatches);
+        if (mismatches) ++failures;
+    }
+    int mismatches = count_mismatches(contexts.back().target, contexts[0].target);
+    printf("light culling %s vs %s, %d lights: %d mismatching pixels\n", culling.lightCulling ? "tiled" : "off",
+        options.lightCulling ? "tiled" : "off", (int)lights.size(), mismatches);
+    if (mismatches) ++failures;
+    return failures ? 1 : 0;
+}
+
+// Whether only whitespace follows the first `used` characters of `text`;
+// `used` comes from a %n and stays -1 when the conversions before it failed.
+static bool only_blanks_after(const char* text, int used) {
+    return used >= 0 && text[used + strspn(text + used, " \t\r\n")] == '\0';
+}
+
+// The integer that makes up all of `text`.
+static bool parse_int_arg(const char* text, int& value) {
+    int used = -1;
+    return sscanf(text, "%d%n", &value, &used) == 1 && only_blanks_after(text, used);
+}
+
+// Parses "ex,ey,ez" or "ex,ey,ez,tx,ty,tz" (commas or blanks); the target
+// defaults to the center of the default scene and up is +y. Only
+// whitespace may follow the numbers.
+bool parse_camera(const char* text, Camera& camera) {
+    camera = kDefaultCamera;
+    float* p = camera.position;
+    float* t = camera.target;
+    int used = -1;
+    if (sscanf(text, "%f%*[, ]%f%*[, ]%f%*[, ]%f%*[, ]%f%*[, ]%f%n", &p[0], &p[1], &p[2], &t[0], &t[1], &t[2], &used) == 6 &&
+        only_blanks_after(text, used))
+        return true;
+    t[0] = 0.0f; t[1] = 0.0f; t[2] = -3.0f;
+    used = -1;
+    return sscanf(text, "%f%*[, ]%f%*[, ]%f%n", &p[0], &p[1], &p[2], &used) == 3 && only_blanks_after(text, used);
+}
+
+// One camera per line as accepted by parse_camera(); blank lines and lines
+// starting with '#' are skipped.
+bool load_cameras(const char* path, std::vector<Camera>& cameras) {
+    FILE* f = open_file(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Could not open camera list %s.\n", path);
+        return false;
+    }
+    char line[512];
+    for (int lineNo = 1; fgets(line, sizeof(line), f); ++lineNo) {
+        const char* p = line + strspn(line, " \t\r\n");
+        if (*p == '\0' || *p == '#') continue;
+        Camera camera;
+        if (!parse_camera(p, camera)) {
+            fprintf(stderr, "Error: %s:%d: expected 3 or 6 numbers.\n", path, lineNo);
+            fclose(f);
+            return false;
+        }
+        cameras.push_back(camera);
+    }
+    fclose(f);
+    return true;
+}
+
+// `count` cameras evenly spaced on a circle of `radius` around the scene
+// center, `height` above it, all looking at the center.
+std::vector<Camera> orbit_cameras(int count, float radius, float height) {
+    std::vector<Camera> cameras(count, kDefaultCamera);
+    for (int i = 0; i < count; ++i) {
+        float angle = 2.0f * (float)M_PI * i / count;
+        Camera& c = cameras[i];
+        c.target[0] = 0.0f; c.target[1] = 0.0f; c.target[2] = -3.0f;
+        c.position[0] = radius * sinf(angle);
+        c.position[1] = height;
+        c.position[2] = -3.0f + radius * cosf(angle);
+    }
+    return cameras;
+}
+
+// Number of "%d"-style frame number conversions in an output pattern
+// ("%d", "%04d", ...; "%%" is a literal percent sign), or -1 when it holds
+// any other conversion.
+int frame_conversions(const char* pattern) {
+    int count = 0;
+    for (const char* p = pattern; *p; ++p) {
+        if (*p != '%') continue;
+        if (p[1] == '%') {
+            ++p;
+            continue;
+        }
+        p += 1 + strspn(p + 1, "0123456789");
+        if (*p != 'd') return -1;
+        ++count;
+    }
+    return count;
+}
+
+std::string frame_path(const char* pattern, int frame) {
+    char path[1024];
+    snprintf(path, sizeof(path), pattern, frame);
+    return path;
+}
+
+// What render_batch() draws: instances of the scene object, which sits at
+// kSceneCenter with radius kSceneRadius in object space. The object is a
+// fixed mesh (a loaded model, or the default sphere with --lod=off), or the
+// default sphere tessellated per instance and frame so its silhouette stays
+// within lodErrorPx of a circle. Instance meshes are filled in per frame.
+// Every material is lit by `lights`.
+typedef struct {
+    const Mesh* mesh;
+    SphereLod* lod;
+    float lodErrorPx;
+    std::vector<Instance> instances;
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+} Scene;
+
+// The scene's instances with their meshes for a view from `camera` on a
+// target `height` pixels tall, and the coarsest and finest LOD level used
+// (-1 for a fixed mesh).
+void scene_instances(const Scene& scene, const Camera& camera, int height,
+    std::vector<Instance>& out, int& coarsest, int& finest) {
+    out = scene.instances;
+    coarsest = finest = -1;
+    if (!scene.lod) {
+        for (size_t i = 0; i < out.size(); ++i) out[i].mesh = scene.mesh;
+        return;
+    }
+
+    const Mesh* meshes[SPHERE_LOD_LEVELS] = {};
+    float focal = focal_length_px(height);
+    coarsest = SPHERE_LOD_LEVELS;
+    for (size_t i = 0; i < out.size(); ++i) {
+        float center[3];
+        mat4_transform_point(out[i].model, kSceneCenter, center);
+        float radius = kSceneRadius * mat4_max_scale(out[i].model);
+        int level = select_sphere_lod(center, radius, camera.position, focal, scene.lodErrorPx);
+        if (!meshes[level]) meshes[level] = &scene.lod->mesh(level);
+        out[i].mesh = meshes[level];
+        coarsest = std::min(coarsest, level);
+        finest = std::max(finest, level);
+    }
+}
+
+// Materials of the --instances parts; the first is the default material.
+static const Material kPartMaterials[] = {
+    { { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.5f, 0.0f }, { 1.0f, 1.0f, 1.0f }, 16, nullptr },
+    { { 1.0f, 0.1f, 0.1f }, { 0.6f, 0.05f, 0.05f }, { 1.0f, 1.0f, 1.0f }, 32, nullptr },
+    { { 1.0f, 0.6f, 0.0f }, { 0.5f, 0.3f, 0.0f }, { 0.5f, 0.5f, 0.5f }, 8, nullptr },
+    { { 0.2f, 0.4f, 1.0f }, { 0.1f, 0.2f, 0.6f }, { 1.0f, 1.0f, 1.0f }, 64, nullptr },
+    { { 0.8f, 0.8f, 0.8f }, { 0.5f, 0.5f, 0.5f }, { 0.3f, 0.3f, 0.3f }, 4, nullptr },
+    { { 0.7f, 0.2f, 1.0f }, { 0.4f, 0.1f, 0.6f }, { 1.0f, 1.0f, 1.0f }, 16, nullptr },
+};
+
+// Uniform value in [0, 1) from an integer.
+static inline float hash_unit(uint32_t i) {
+    i ^= i >> 16;
+    i *= 0x7feb352du;
+    i ^= i >> 15;
+    i *= 0x846ca68bu;
+    i ^= i >> 16;
+    return (float)(i >> 8) / 16777216.0f;
+}
+
+// Texture of the textured shader when none is given: `checks` x `checks`
+// light and dark squares over `size` x `size` pixels.
+Image make_checker_image(int size, int checks) {
+    Image image;
+    image.width = image.height = size;
+    image.rgb.resize((size_t)size * size * 3);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            bool light = ((x * checks / size) ^ (y * checks / size)) & 1;
+            unsigned char* p = &image.rgb[((size_t)y * size + x) * 3];
+            p[0] = light ? 240 : 40;
+            p[1] = light ? 240 : 40;
+            p[2] = light ? 230 : 60;
+        }
+    }
+    return image;
+}
+
+// `count` instances of the scene object as parts on a floor receding from
+// the default camera: a square grid one unit apart at y = -1, starting two
+// units ahead, each part 0.2 to 0.3 units in radius with a pseudo-random
+// rotation about +y and material. Much of a large grid lies outside the
+// view.
+void make_part_grid(int count, Scene& scene) {
+    int side = (int)ceil(sqrt((double)count));
+    int materials = (int)(sizeof(kPartMaterials) / sizeof(kPartMaterials[0]));
+    Mat4 toOrigin = mat4_translate(-kSceneCenter[0], -kSceneCenter[1], -kSceneCenter[2]);
+    scene.materials.assign(kPartMaterials, kPartMaterials + materials);
+    scene.instances.clear();
+    scene.instances.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        float x = (float)(i % side) - 0.5f * (float)(side - 1);
+        float z = -2.0f - (float)(i / side);
+        float scale = (0.2f + 0.1f * hash_unit(3 * i)) / kSceneRadius;
+        Mat4 place = mat4_multiply(mat4_translate(x, -1.0f, z),
+            mat4_multiply(mat4_rotate_y(6.2831853f * hash_unit(3 * i + 1)), mat4_scale(scale)));
+        Instance instance = { nullptr, mat4_multiply(place, toOrigin), (int)(hash_unit(3 * i + 2) * materials) };
+        scene.instances.push_back(instance);
+    }
+}
+
+// Box around the scene object of every instance.
+void scene_bounds(const Scene& scene, float lo[3], float hi[3]) {
+    for (int c = 0; c < 3; ++c) {
+        lo[c] = INFINITY;
+        hi[c] = -INFINITY;
+    }
+    for (size_t i = 0; i < scene.instances.size(); ++i) {
+        float center[3];
+        mat4_transform_point(scene.instances[i].model, kSceneCenter, center);
+        float radius = kSceneRadius * mat4_max_scale(scene.instances[i].model);
+        for (int c = 0; c < 3; ++c) {
+            lo[c] = fminf(lo[c], center[c] - radius);
+            hi[c] = fmaxf(hi[c], center[c] + radius);
+        }
+    }
+}
+
+// Lights of a --lights scene reaching any point, on average.
+static const float kLightOverlap = 6.0f;
+
+// `count` point lights of pseudo-random saturated colors scattered uniformly
+// through the box [lo, hi] grown by half the scene radius on every side,
+// with the range at which about kLightOverlap of them reach each point of
+// it; dimmer the more overlap, so their sum stays near one white light.
+std::vector<Light> scatter_lights(int count, const float lo[3], const float hi[3]) {
+    float blo[3], size[3], volume = 1.0f;
+    for (int c = 0; c < 3; ++c) {
+        blo[c] = lo[c] - 0.5f * kSceneRadius;
+        size[c] = hi[c] - lo[c] + kSceneRadius;
+        volume *= size[c];
+    }
+    float range = cbrtf(3.0f * kLightOverlap * volume / (4.0f * (float)M_PI * (float)count));
+
+    std::vector<Light> lights(count);
+    for (int i = 0; i < count; ++i) {
+        Light& light = lights[i];
+        for (int c = 0; c < 3; ++c) light.position[c] = blo[c] + size[c] * hash_unit(4 * i + c);
+        // Hue around the color wheel, one channel full and one off.
+        float h = 6.0f * hash_unit(4 * i + 3);
+        int sector = (int)h % 6;
+        float f = h - (float)(int)h;
+        float rgb[6][3] = { { 1, f, 0 }, { 1 - f, 1, 0 }, { 0, 1, f }, { 0, 1 - f, 1 }, { f, 0, 1 }, { 1, 0, 1 - f } };
+        for (int c = 0; c < 3; ++c) light.color[c] = rgb[sector][c] * 2.0f / kLightOverlap;
+        light.range = range;
+    }
+    return lights;
+}
+
+typedef struct {
+    std::vector<Camera> cameras;    // frame i uses cameras[i % size]
+    int frames;
+    int frameJobs;                  // frames rendered at once; 0 = automatic
+    const char* outputPattern;      // printf pattern taking the frame number
+    bool overdraw;                  // also write <output>_overdraw heatmaps
+} BatchOptions;
+
+// Renders every frame of `batch` and hands the images to `writer`. Up to
+// frameJobs frames are in flight at once, each on its own context and its
+// own slice of the pool's threads for tile parallelism; frames are taken
+// from a shared counter, so lanes finishing early pick up more. The
+// automatic split renders as many frames at once as there are threads,
+// which suits many small frames; a single large frame gets every thread.
+void render_batch(const Scene& scene, int width, int height, const RenderOptions& options,
+    ColorFormat format, PixelLayout layout, const BatchOptions& batch, bool showStats,
+    ThreadPool& pool, ImageWriter& writer) {
+    int jobs = batch.frameJobs > 0 ? batch.frameJobs : pool.size();
+    jobs = std::max(1, std::min(jobs, std::min(batch.frames, pool.size())));
+    int tileThreads = std::max(1, pool.size() / jobs);
+
+    std::atomic<int> next(0);
+    auto lane = [&](ThreadPool& tiles) {
+        RenderContext ctx(width, height, options, format, layout);
+        std::vector<Instance> instances;
+        if (batch.overdraw) ctx.overdraw.resize((size_t)width * height);
+        for (int frame; (frame = next++) < batch.frames;) {
+            ctx.camera = batch.cameras[frame % batch.cameras.size()];
+            int coarsest, finest;
+            scene_instances(scene, ctx.camera, height, instances, coarsest, finest);
+            clear_buffers(ctx);
+            render_instances(ctx, instances, scene.materials, scene.lights, tiles);
+            std::string path = frame_path(batch.outputPattern, frame);
+            writer.submit(path, read_image(ctx.target));
+            if (batch.overdraw) writer.submit(overdraw_path(path), overdraw_image(ctx));
+            if (showStats && batch.frames == 1) {
+                if (coarsest == finest && finest >= 0)
+                    printf("lod: level %d (%dx%d sphere, %zu triangles)\n", finest,
+                        sphere_lod_segments(finest), sphere_lod_segments(finest) / 2, instances[0].mesh->triangle_count());
+                else if (finest >= 0)
+                    printf("lod: levels %d to %d (%dx%d to %dx%d spheres)\n", coarsest, finest,
+                        sphere_lod_segments(coarsest), sphere_lod_segments(coarsest) / 2,
+                        sphere_lod_segments(finest), sphere_lod_segments(finest) / 2);
+                print_raster_stats(ctx);
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (jobs == 1) {
+        lane(pool);
+    } else {
+        pool.run(jobs, [&](int, int) {
+            ThreadPool tiles(tileThreads);
+            lane(tiles);
+        });
+    }
+    if (batch.frames > 1) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        printf("batch: %d frames in %.1f ms (%.2f ms/frame), %d frame jobs x %d tile threads\n",
+            batch.frames, elapsed.count(), elapsed.count() / batch.frames, jobs, tileThreads);
+    }
+}
+
+// Benchmark scene: one sphere, or a grid of grid x grid smaller ones, each
+// of `segments` x `rings` as in make_sphere_mesh().
+typedef struct {
+    int segments, rings;
+    int grid;
+} BenchScene;
+
+typedef struct {
+    int width, height;
+} BenchSize;
+
+// Median frame time in ms (clear plus render_scene()) after one warm-up
+// frame, rendering until at least `minMs` have passed and at least three
+// frames were timed.
+static double time_frames(RenderContext& ctx, const Mesh& mesh, const Material& material,
+    const std::vector<Light>& lights, ThreadPool& pool, double minMs, int& frames) {
+    clear_buffers(ctx);
+    render_scene(ctx, mesh, material, lights, pool);
+
+    std::vector<double> times;
+    double total = 0.0;
+    while (times.size() < 3 || (total < minMs && times.size() < 1000)) {
+        auto start = std::chrono::steady_clock::now();
+        clear_buffers(ctx);
+        render_scene(ctx, mesh, material, lights, pool);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        times.push_back(elapsed.count());
+        total += elapsed.count();
+    }
+    frames = (int)times.size();
+    std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+    return times[times.size() / 2];
+}
+
+// Renders scenes of increasing tessellation and instance count at
+// increasing resolutions with 1, 2, 4, ... up to `maxThreads` threads, and
+// writes the results to stdout as JSON (progress goes to stderr). "full"
+// runs the whole matrix up to a 4096x2048 sphere at 8K; the default is a
+// subset that finishes in well under a minute. Throughputs count submitted
+// triangles and shaded pixels per second of frame time; nsPerPixel is the
+// frame time divided by the target's pixel count. The default material
+// carries `texture` (may be null) for the textured shader, and each scene
+// is lit by the default light plus `lightCount` lights scattered around it.
+int run_benchmark(bool full, const RenderOptions& options, ColorFormat format, PixelLayout layout, int maxThreads,
+    const Texture* texture, int lightCount) {
+    static const BenchScene quickScenes[] = { { 32, 16, 1 }, { 256, 128, 1 }, { 1024, 512, 1 }, { 32, 16, 8 } };
+    static const BenchScene fullScenes[] = {
+        { 32, 16, 1 }, { 128, 64, 1 }, { 512, 256, 1 }, { 1024, 512, 1 }, { 2048, 1024, 1 }, { 4096, 2048, 1 },
+        { 64, 32, 8 }, { 32, 16, 32 }
+    };
+    static const BenchSize quickSizes[] = { { 512, 512 }, { 1920, 1080 } };
+    static const BenchSize fullSizes[] = { { 512, 512 }, { 1024, 1024 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+    const BenchScene* scenes = full ? fullScenes : quickScenes;
+    int sceneCount = full ? (int)(sizeof(fullScenes) / sizeof(fullScenes[0])) : (int)(sizeof(quickScenes) / sizeof(quickScenes[0]));
+    const BenchSize* sizes = full ? fullSizes : quickSizes;
+    int sizeCount = full ? (int)(sizeof(fullSizes) / sizeof(fullSizes[0])) : (int)(sizeof(quickSizes) / sizeof(quickSizes[0]));
+    double minMs = full ? 500.0 : 200.0;
+
+    if (maxThreads <= 0) maxThreads = ThreadPool().size();
+    std::vector<int> threadCounts;
+    for (int t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(maxThreads);
+
+    static const char* depthNames[] = { "late", "early", "prepass" };
+    static const char* cullNames[] = { "none", "back", "front" };
+    static const char* shaderNames[] = { "reference", "fast", "normal", "unlit", "textured" };
+    static const char* rateNames[] = { "1x1", "2x2", "4x4", "auto", "image" };
+    printf("{\n  \"schema\": 1,\n");
+    printf("  \"config\": { \"suite\": \"%s\", \"raster\": \"%s\", \"depth\": \"%s\", \"shading\": \"%s\", "
+        "\"shader\": \"%s\", \"rate\": \"%s\", \"cull\": \"%s\", \"clear\": \"%s\", \"format\": \"%s\", \"layout\": \"%s\", "
+        "\"filter\": \"%s\", \"textureLayout\": \"%s\", \"lights\": %d, \"lightCulling\": \"%s\", "
+        "\"maxThreads\": %d, \"counters\": %s },\n",
+        full ? "full" : "quick", raster_path_name(options.rasterPath), depthNames[options.depthMode],
+        options.shadingMode == SHADING_VISIBILITY ? "visibility" : "forward",
+        shaderNames[options.shader], rateNames[options.shadingRate], cullNames[options.cullMode],
+        options.fastClear ? "fast" : "full", format == COLOR_RGBA8 ? "rgba8" : "planar",
+        layout == LAYOUT_TILED ? "tiled" : "linear", texture_filter_name(options.textureFilter),
+        texture ? texture_layout_name(texture->layout()) : "none", lightCount + 1, options.lightCulling ? "tiled" : "off",
+        maxThreads, PIPELINE_COUNTERS ? "true" : "false");
+    printf("  \"results\": [");
+
+    Material material = kDefaultMaterial;
+    material.texture = texture;
+    bool first = true;
+    for (int si = 0; si < sceneCount; ++si) {
+        const BenchScene& sc = scenes[si];
+        Mesh mesh = sc.grid > 1 ? make_sphere_grid(sc.grid, sc.segments, sc.rings, 5.0f, 0.0f, 0.0f, -3.0f)
+                                : make_sphere_mesh(sc.segments, sc.rings, 1.0f, 0.0f, 0.0f, -3.0f);
+        std::vector<Light> lights(1, kDefaultLight);
+        if (lightCount) {
+            float center[3], radius, lo[3], hi[3];
+            mesh_bounding_sphere(mesh, center, radius);
+            for (int c = 0; c < 3; ++c) {
+                lo[c] = center[c] - radius;
+                hi[c] = center[c] + radius;
+            }
+            std::vector<Light> scattered = scatter_lights(lightCount, lo, hi);
+            lights.insert(lights.end(), scattered.begin(), scattered.end());
+        }
+        char name[64];
+        if (sc.grid > 1) snprintf(name, sizeof(name), "grid %dx%d of sphere %dx%d", sc.grid, sc.grid, sc.segments, sc.rings);
+        else snprintf(name, sizeof(name), "sphere %dx%d", sc.segments, sc.rings);
+
+        for (int zi = 0; zi < sizeCount; ++zi) {
+            const BenchSize& size = sizes[zi];
+            RenderContext ctx(size.width, size.height, options, format, layout);
+            double singleMs = 0.0;
+            for (size_t ti = 0; ti < threadCounts.size(); ++ti) {
+                ThreadPool pool(threadCounts[ti]);
+                int frames;
+                double ms = time_frames(ctx, mesh, material, lights, pool, minMs, frames);
+                if (ti == 0) singleMs = ms;
+                RasterStats st = total_raster_stats(ctx);
+                double pixels = (double)size.width * size.height;
+                fprintf(stderr, "bench: %s at %dx%d, %d threads: %.2f ms\n", name, size.width, size.height, pool.size(), ms);
+
+                printf("%s\n    { \"scene\": \"%s\", \"triangles\": %zu, \"width\": %d, \"height\": %d, \"threads\": %d, "
+                    "\"frames\": %d, \"msPerFrame\": %.4f, \"mtrisPerSec\": %.3f, ",
+                    first ? "" : ",", name, mesh.triangle_count(), size.width, size.height, pool.size(),
+                    frames, ms, mesh.triangle_count() / (ms * 1000.0));
+#if PIPELINE_COUNTERS
+                printf("\"trianglesBinned\": %lld, \"pixelsShaded\": %lld, \"mpixPerSec\": %.3f, \"lightsPerQuad\": %.3f, ",
+                    ctx.primStats.trianglesBinned, st.pixelsShaded, st.pixelsShaded / (ms * 1000.0),
+                    st.quadsShaded ? (double)st.lightQuads / st.quadsShaded : 0.0);
+#else
+                (void)st;
+                printf("\"trianglesBinned\": null, \"pixelsShaded\": null, \"mpixPerSec\": null, \"lightsPerQuad\": null, ");
+#endif
+                printf("\"nsPerPixel\": %.4f, \"speedup\": %.3f, \"efficiency\": %.3f, "
+                    "\"stageMs\": { \"vertex\": %.4f, \"assembly\": %.4f, \"binning\": %.4f, \"raster\": %.4f, \"shading\": %.4f } }",
+                    ms * 1e6 / pixels, singleMs / ms, singleMs / ms / pool.size(),
+                    ctx.stageTimes.vertex, ctx.stageTimes.assembly, ctx.stageTimes.binning,
+                    ctx.stageTimes.raster, ctx.stageTimes.shading);
+                fflush(stdout);
+                first = false;
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+// Compares compute_phong_color_fast() against the reference shader and its
+// quad kernel against it on random surface points around the sphere, lit by
+// the default light alone and with scattered colored ones, checks the gamma
+// table on a dense sweep, and times all three.
+int report_shader_accuracy() {
+    const int count = 1 << 20;
+    std::vector<float> in((size_t)count * 6);
+    srand(1);
+    for (int i = 0; i < count; ++i) {
+        float* p = &in[(size_t)i * 6];
+        float nx, ny, nz, len;
+        do {
+            nx = 2.0f * rand() / RAND_MAX - 1.0f;
+            ny = 2.0f * rand() / RAND_MAX - 1.0f;
+            nz = 2.0f * rand() / RAND_MAX - 1.0f;
+            len = sqrtf(nx * nx + ny * ny + nz * nz);
+        } while (len < 0.1f || len > 1.0f);
+        p[0] = nx / len; p[1] = ny / len; p[2] = nz / len - 3.0f;
+        p[3] = nx; p[4] = ny; p[5] = nz;
+    }
+
+    const float eye[3] = { 0.0f, 0.0f, 0.0f };
+    const LightList lights = { &kDefaultLight, 1 };
+    int maxError = 0;
+    long long mismatches = 0;
+    for (int i = 0; i < count; ++i) {
+        const float* p = &in[(size_t)i * 6];
+        unsigned char ref[3], fast[3];
+        compute_phong_color(p[0], p[1], p[2], p[3], p[4], p[5], eye, lights, kDefaultMaterial, ref);
+        compute_phong_color_fast(p[0], p[1], p[2], p[3], p[4], p[5], eye, lights, kDefaultMaterial, fast);
+        for (int c = 0; c < 3; ++c) {
+            int err = abs((int)ref[c] - (int)fast[c]);
+            if (err > maxError) maxError = err;
+            if (err) ++mismatches;
+        }
+    }
+    printf("shader: max error %d LSB, %lld of %d channels differ\n", maxError, mismatches, count * 3);
+
+    // Consecutive samples fill the lanes of one quad.
+    std::vector<QuadInput> quads(count / QUAD_LANES);
+    for (int i = 0; i < count; ++i) {
+        const float* p = &in[(size_t)i * 6];
+        QuadInput& q = quads[i / QUAD_LANES];
+        int lane = i % QUAD_LANES;
+        q.px[lane] = p[0]; q.py[lane] = p[1]; q.pz[lane] = p[2];
+        q.nx[lane] = p[3]; q.ny[lane] = p[4]; q.nz[lane] = p[5];
+    }
+    long long quadMismatches = 0;
+    for (int i = 0; i < count; i += QUAD_LANES) {
+        unsigned char quad[QUAD_LANES][3];
+        compute_phong_color_fast_quad(quads[i / QUAD_LANES], eye, lights, kDefaultMaterial, quad);
+        for (int lane = 0; lane < QUAD_LANES; ++lane) {
+            const float* p = &in[(size_t)(i + lane) * 6];
+            unsigned char fast[3];
+            compute_phong_color_fast(p[0], p[1], p[2], p[3], p[4], p[5], eye, lights, kDefaultMaterial, fast);
+            quadMismatches += memcmp(fast, quad[lane], 3) != 0;
+        }
+    }
+    printf("quad shader: %lld of %d pixels differ from the fast shader\n", quadMismatches, count);
+
+    // The same with colored lights of limited range around the samples,
+    // some of which reach no lane of a quad.
+    float sceneLo[3] = { -1.0f, -1.0f, -4.0f }, sceneHi[3] = { 1.0f, 1.0f, -2.0f };
+    std::vector<Light> scattered = scatter_lights(16, sceneLo, sceneHi);
+    scattered.insert(scattered.begin(), kDefaultLight);
+    const LightList manyLights = { scattered.data(), (int)scattered.size() };
+    int manyError = 0;
+    long long manyQuadMismatches = 0;
+    for (int i = 0; i < count; i += QUAD_LANES) {
+        unsigned char quad[QUAD_LANES][3];
+        compute_phong_color_fast_quad(quads[i / QUAD_LANES], eye, manyLights, kDefaultMaterial, quad);
+        for (int lane = 0; lane < QUAD_LANES; ++lane) {
+            const float* p = &in[(size_t)(i + lane) * 6];
+            unsigned char ref[3], fast[3];
+            compute_phong_color(p[0], p[1], p[2], p[3], p[4], p[5], eye, manyLights, kDefaultMaterial, ref);
+            compute_phong_color_fast(p[0], p[1], p[2], p[3], p[4], p[5], eye, manyLights, kDefaultMaterial, fast);
+            for (int c = 0; c < 3; ++c) manyError = std::max(manyError, abs((int)ref[c] - (int)fast[c]));
+            manyQuadMismatches += memcmp(fast, quad[lane], 3) != 0;
+        }
+    }
+    printf("%d lights: fast shader max error %d LSB, %lld of %d quad pixels differ from it\n",
+        manyLights.count, manyError, manyQuadMismatches, count);
+
+    int gammaError = 0;
+    for (int i = 0; i <= 1 << 24; ++i) {
+        float c = (float)i / (float)(1 << 24);
+        int ref = (int)(unsigned char)(255.0f * powf(c, 1.0f / 2.2f));
+        int err = abs(ref - (int)encode_gamma(c));
+        if (err > gammaError) gammaError = err;
+    }
+    printf("gamma table: max error %d LSB over 2^24 + 1 samples of [0, 1]\n", gammaError);
+
+    // The quad encode must agree everywhere, including out of range.
+    long long gammaQuadMismatches = 0;
+    const float edges[QUAD_LANES] = { -1.0f, NAN, 2.0f, INFINITY };
+    for (int i = -QUAD_LANES; i <= 1 << 24; i += QUAD_LANES) {
+        float c[QUAD_LANES];
+        for (int lane = 0; lane < QUAD_LANES; ++lane)
+            c[lane] = i < 0 ? edges[lane] : (float)(i + lane) / (float)(1 << 24);
+        unsigned char quad[QUAD_LANES];
+        encode_gamma_quad(_mm_loadu_ps(c), quad, 1);
+        for (int lane = 0; lane < QUAD_LANES; ++lane) gammaQuadMismatches += quad[lane] != encode_gamma(c[lane]);
+    }
+    printf("quad gamma: %lld samples differ from the table\n", gammaQuadMismatches);
+
+    unsigned sink = 0;
+
+    // Both texture layouts hold the same texels, and the SIMD sampler
+    // matches the scalar one in every filter mode, including coordinates
+    // far outside [0, 1) and NaN.
+    ThreadPool pool;
+    Image noise;
+    noise.width = 1000;
+    noise.height = 600;
+    noise.rgb.resize((size_t)noise.width * noise.height * 3);
+    for (size_t i = 0; i < noise.rgb.size(); ++i) noise.rgb[i] = (unsigned char)(hash_unit((uint32_t)i) * 256.0f);
+    Texture textures[2];
+    textures[0].create(noise, TEXTURE_LINEAR, pool);
+    textures[1].create(noise, TEXTURE_MORTON, pool);
+    long long texelMismatches = 0;
+    for (int level = 0; level < textures[0].level_count(); ++level) {
+        int w = std::max(1, textures[0].width() >> level), h = std::max(1, textures[0].height() >> level);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) texelMismatches += textures[0].texel(level, x, y) != textures[1].texel(level, x, y);
+    }
+    long long sampleMismatches = 0;
+    const float oddCoords[QUAD_LANES] = { -1e9f, NAN, 3e7f, -2.5f };
+    for (int i = 0; i < 1 << 16; ++i) {
+        float u[QUAD_LANES], v[QUAD_LANES];
+        for (int lane = 0; lane < QUAD_LANES; ++lane) {
+            u[lane] = i < 4 ? oddCoords[(lane + i) % QUAD_LANES] : 4.0f * hash_unit(8 * i + lane) - 2.0f;
+            v[lane] = i < 4 ? oddCoords[lane] : 4.0f * hash_unit(8 * i + lane + 4) - 2.0f;
+        }
+        float lod = 14.0f * hash_unit(i) - 2.0f;
+        for (int f = FILTER_BILINEAR; f <= FILTER_TRILINEAR; ++f) {
+            __m128 rgb[2][3];
+            float lanes[2][3][QUAD_LANES];
+            for (int t = 0; t < 2; ++t) {
+                textures[t].sample4(u, v, lod, (TextureFilter)f, rgb[t]);
+                for (int c = 0; c < 3; ++c) _mm_storeu_ps(lanes[t][c], rgb[t][c]);
+            }
+            for (int lane = 0; lane < QUAD_LANES; ++lane) {
+                float ref[3];
+                textures[0].sample(u[lane], v[lane], lod, (TextureFilter)f, ref);
+                bool same = true;
+                for (int c = 0; c < 3; ++c)
+                    same = same && lanes[0][c][lane] == ref[c] && lanes[1][c][lane] == ref[c];
+                sampleMismatches += !same;
+            }
+        }
+    }
+    printf("texture: %lld texels differ between layouts, %lld of %d samples differ from the scalar sampler\n",
+        texelMismatches, sampleMismatches, 3 << 18);
+
+    // Trilinear sampling of a surface minified about 2.5x and seen rotated,
+    // scanned in quads like the rasterizer does. Row-major order reads a
+    // new cache line per texel once the rows cross the texture's columns.
+    Image big;
+    big.width = big.height = 4096;
+    big.rgb.resize((size_t)big.width * big.height * 3);
+    for (size_t i = 0; i < big.rgb.size(); ++i) big.rgb[i] = (unsigned char)(i * 7 + (i >> 12) * 13);
+    for (int t = 0; t < 2; ++t) textures[t].create(big, t ? TEXTURE_MORTON : TEXTURE_LINEAR, pool);
+    const float angles[3] = { 0.0f, 45.0f, 90.0f };
+    for (int a = 0; a < 3; ++a) {
+        float step = 2.5f / 4096.0f;
+        float cs = cosf(angles[a] * 0.017453293f) * step, sn = sinf(angles[a] * 0.017453293f) * step;
+        double texNs[2];
+        for (int t = 0; t < 2; ++t) {
+            float lod = textures[t].lod(cs, sn, -sn, cs);
+            float sum = 0.0f;
+            auto start = std::chrono::steady_clock::now();
+            for (int y = 0; y < 1024; y += 2) {
+                for (int x = 0; x < 1024; x += 2) {
+                    float u[QUAD_LANES], v[QUAD_LANES];
+                    for (int lane = 0; lane < QUAD_LANES; ++lane) {
+                        float px = (float)(x + (lane & 1)), py = (float)(y + (lane >> 1));
+                        u[lane] = px * cs - py * sn;
+                        v[lane] = px * sn + py * cs;
+                    }
+                    __m128 rgb[3];
+                    textures[t].sample4(u, v, lod, FILTER_TRILINEAR, rgb);
+                    sum += _mm_cvtss_f32(_mm_add_ps(rgb[0], rgb[2]));
+                }
+            }
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            texNs[t] = elapsed.count() / (1024.0 * 1024.0);
+            sink += (unsigned)sum;
+        }
+        printf("texture sampling, %d deg: linear %.2f ns/pixel, morton %.2f ns/pixel (%.2fx)\n",
+            (int)angles[a], texNs[0], texNs[1], texNs[0] / texNs[1]);
+    }
+
+    typedef void (*ShaderFunc)(float, float, float, float, float, float, const float*, const LightList&, const Material&,
+        unsigned char*);
+    ShaderFunc funcs[2] = { compute_phong_color, compute_phong_color_fast };
+    const char* names[2] = { "reference", "fast" };
+    double ns[2];
+    for (int f = 0; f < 2; ++f) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i) {
+            const float* p = &in[(size_t)i * 6];
+            unsigned char rgb[3];
+            funcs[f](p[0], p[1], p[2], p[3], p[4], p[5], eye, lights, kDefaultMaterial, rgb);
+            sink += rgb[0] + rgb[1] + rgb[2];
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        ns[f] = elapsed.count() / count;
+        printf("%s: %.2f ns/pixel\n", names[f], ns[f]);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < quads.size(); ++q) {
+        unsigned char rgb[QUAD_LANES][3];
+        compute_phong_color_fast_quad(quads[q], eye, lights, kDefaultMaterial, rgb);
+        for (int lane = 0; lane < QUAD_LANES; ++lane) sink += rgb[lane][0] + rgb[lane][1] + rgb[lane][2];
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    double quadNs = elapsed.count() / count;
+    printf("fast quad: %.2f ns/pixel\n", quadNs);
+    start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < quads.size(); ++q) {
+        unsigned char rgb[QUAD_LANES][3];
+        compute_phong_color_fast_quad(quads[q], eye, manyLights, kDefaultMaterial, rgb);
+        for (int lane = 0; lane < QUAD_LANES; ++lane) sink += rgb[lane][0] + rgb[lane][1] + rgb[lane][2];
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    printf("fast quad, %d lights: %.2f ns/pixel\n", manyLights.count, elapsed.count() / count);
+    printf("speedup: %.2fx fast, %.2fx fast quad (checksum %u)\n", ns[0] / ns[1], ns[0] / quadNs, sink);
+    return maxError > 1 || gammaError > 1 || quadMismatches != 0 || gammaQuadMismatches != 0 ||
+        manyError > 1 || manyQuadMismatches != 0 || texelMismatches != 0 || sampleMismatches != 0;
+}
+
+int main(int argc, char** argv) {
+    int threads = 0;
+    bool showStats = false;
+    bool compare = false;
+    int bench = 0;                  // 1 = quick suite, 2 = full suite
+    const char* meshPath = nullptr;
+    bool meshCache = true;
+    bool useLod = true;
+    float lodError = 0.5f;
+    int instanceCount = 0;
+    int lightCount = 0;
+    PngCompression png = PNG_FAST;
+    BatchOptions batch;
+    batch.frames = 0;
+    batch.frameJobs = 0;
+    batch.outputPattern = "output.ppm";
+    batch.overdraw = false;
+    float orbit[2];
+    bool useOrbit = false;
+    int width = SCREEN_WIDTH, height = SCREEN_HEIGHT;
+    ColorFormat format = COLOR_PLANAR;
+    PixelLayout layout = LAYOUT_LINEAR;
+    RenderOptions options = kDefaultOptions;
+    Image rateImage;
+    const char* texturePath = nullptr;
+    TextureLayout textureLayout = TEXTURE_MORTON;
+
+    options.rasterPath = detect_raster_path();
+    for (int i = 1; i < argc; ++i) {
+        int w, h;
+        if (strcmp(argv[i], "--raster=scalar") == 0) options.rasterPath = RASTER_SCALAR;
+        // A path the CPU lacks keeps the detected one.
+        else if (strcmp(argv[i], "--raster=sse2") == 0) {
+            if (detect_raster_path() >= RASTER_SSE2) options.rasterPath = RASTER_SSE2;
+        }
+        else if (strcmp(argv[i], "--raster=avx2") == 0) {
+            if (detect_raster_path() >= RASTER_AVX2) options.rasterPath = RASTER_AVX2;
+        }
+        else if (strcmp(argv[i], "--depth=late") == 0) options.depthMode = DEPTH_LATE;
+        else if (strcmp(argv[i], "--depth=early") == 0) options.depthMode = DEPTH_EARLY;
+        else if (strcmp(argv[i], "--depth=prepass") == 0) options.depthMode = DEPTH_PREPASS;
+        else if (strcmp(argv[i], "--shading=forward") == 0) options.shadingMode = SHADING_FORWARD;
+        else if (strcmp(argv[i], "--shading=visibility") == 0) options.shadingMode = SHADING_VISIBILITY;
+        else if (strcmp(argv[i], "--cull=none") == 0) options.cullMode = CULL_NONE;
+        else if (strcmp(argv[i], "--cull=back") == 0) options.cullMode = CULL_BACK;
+        else if (strcmp(argv[i], "--cull=front") == 0) options.cullMode = CULL_FRONT;
+        else if (strcmp(argv[i], "--shader=reference") == 0) options.shader = SHADER_REFERENCE;
+        else if (strcmp(argv[i], "--shader=fast") == 0) options.shader = SHADER_FAST;
+        else if (strcmp(argv[i], "--shader=normal") == 0) options.shader = SHADER_NORMAL;
+        else if (strcmp(argv[i], "--shader=unlit") == 0) options.shader = SHADER_UNLIT;
+        else if (strcmp(argv[i], "--shader=textured") == 0) options.shader = SHADER_TEXTURED;
+        else if (strncmp(argv[i], "--texture=", 10) == 0) {
+            texturePath = argv[i] + 10;
+            options.shader = SHADER_TEXTURED;
+        }
+        else if (strcmp(argv[i], "--texture-layout=linear") == 0) textureLayout = TEXTURE_LINEAR;
+        else if (strcmp(argv[i], "--texture-layout=morton") == 0) textureLayout = TEXTURE_MORTON;
+        else if (strcmp(argv[i], "--filter=bilinear") == 0) options.textureFilter = FILTER_BILINEAR;
+        else if (strcmp(argv[i], "--filter=mipmap") == 0) options.textureFilter = FILTER_MIPMAP;
+        else if (strcmp(argv[i], "--filter=trilinear") == 0) options.textureFilter = FILTER_TRILINEAR;
+        else if (strcmp(argv[i], "--rate=1x1") == 0) options.shadingRate = RATE_1X1;
+        else if (strcmp(argv[i], "--rate=2x2") == 0) options.shadingRate = RATE_2X2;
+        else if (strcmp(argv[i], "--rate=4x4") == 0) options.shadingRate = RATE_4X4;
+        else if (strcmp(argv[i], "--rate=auto") == 0) options.shadingRate = RATE_ADAPTIVE;
+        else if (strncmp(argv[i], "--rate-image=", 13) == 0) {
+            if (!load_image(argv[i] + 13, rateImage)) return 1;
+            options.shadingRate = RATE_IMAGE;
+            options.rateImage = &rateImage;
+        }
+        else if (strcmp(argv[i], "--clear=fast") == 0) options.fastClear = true;
+        else if (strcmp(argv[i], "--clear=full") == 0) options.fastClear = false;
+        else if (strcmp(argv[i], "--format=planar") == 0) format = COLOR_PLANAR;
+        else if (strcmp(argv[i], "--format=rgba8") == 0) format = COLOR_RGBA8;
+        else if (strcmp(argv[i], "--layout=linear") == 0) layout = LAYOUT_LINEAR;
+        else if (strcmp(argv[i], "--layout=tiled") == 0) layout = LAYOUT_TILED;
+        else if (strncmp(argv[i], "--size=", 7) == 0) {
+            int used = -1;
+            bool parsed = sscanf(argv[i] + 7, "%dx%d%n", &w, &h, &used) == 2 && only_blanks_after(argv[i] + 7, used);
+            // The guard band must stay wider than the screen.
+            if (!parsed || w <= 0 || h <= 0 || w > GUARD_BAND / 2 || h > GUARD_BAND / 2) {
+                fprintf(stderr, "Error: --size takes WxH between 1x1 and %dx%d.\n", GUARD_BAND / 2, GUARD_BAND / 2);
+                return 1;
+            }
+            width = w;
+            height = h;
+        }
+        else if (strncmp(argv[i], "--mesh=", 7) == 0) meshPath = argv[i] + 7;
+        else if (strncmp(argv[i], "--output=", 9) == 0) {
+            ImageFormat format;
+            batch.outputPattern = argv[i] + 9;
+            if (!image_format_for_path(batch.outputPattern, format) || frame_conversions(batch.outputPattern) > 1 ||
+                frame_conversions(batch.outputPattern) < 0) {
+                fprintf(stderr, "Error: output must be a .ppm, .qoi or .png file name, with at most one %%d for the frame number.\n");
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--camera=", 9) == 0) {
+            Camera camera;
+            if (!parse_camera(argv[i] + 9, camera)) {
+                fprintf(stderr, "Error: --camera takes ex,ey,ez or ex,ey,ez,tx,ty,tz.\n");
+                return 1;
+            }
+            batch.cameras.push_back(camera);
+        }
+        else if (strncmp(argv[i], "--cameras=", 10) == 0) {
+            if (!load_cameras(argv[i] + 10, batch.cameras)) return 1;
+        }
+        else if (strncmp(argv[i], "--orbit=", 8) == 0) {
+            const char* text = argv[i] + 8;
+            int used = -1;
+            orbit[1] = 0.0f;
+            bool parsed = sscanf(text, "%f%n", &orbit[0], &used) == 1;
+            if (parsed && text[used] == ',') {
+                text += used + 1;
+                used = -1;
+                parsed = sscanf(text, "%f%n", &orbit[1], &used) == 1;
+            }
+            if (!parsed || !only_blanks_after(text, used) || !(orbit[0] > 0.0f)) {
+                fprintf(stderr, "Error: --orbit takes radius[,height] with a positive radius.\n");
+                return 1;
+            }
+            useOrbit = true;
+        }
+        else if (strncmp(argv[i], "--frames=", 9) == 0) {
+            if (!parse_int_arg(argv[i] + 9, w) || w <= 0) {
+                fprintf(stderr, "Error: frames must be a positive integer.\n");
+                return 1;
+            }
+            batch.frames = w;
+        }
+        else if (strncmp(argv[i], "--frame-jobs=", 13) == 0) {
+            if (!parse_int_arg(argv[i] + 13, w) || w < 0) {
+                fprintf(stderr, "Error: frame jobs must be a non-negative integer.\n");
+                return 1;
+            }
+            batch.frameJobs = w;
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            if (!parse_int_arg(argv[i] + 10, w) || w < 0) {
+                fprintf(stderr, "Error: threads must be a non-negative integer.\n");
+                return 1;
+            }
+            threads = w;
+        }
+        else if (strcmp(argv[i], "--png=stored") == 0) png = PNG_STORED;
+        else if (strcmp(argv[i], "--png=fast") == 0) png = PNG_FAST;
+        else if (strncmp(argv[i], "--instances=", 12) == 0) {
+            if (!parse_int_arg(argv[i] + 12, w) || w <= 0) {
+                fprintf(stderr, "Error: instances must be a positive integer.\n");
+                return 1;
+            }
+            instanceCount = w;
+        }
+        else if (strncmp(argv[i], "--lights=", 9) == 0) {
+            if (!parse_int_arg(argv[i] + 9, w) || w < 0) {
+                fprintf(stderr, "Error: lights must be a non-negative integer.\n");
+                return 1;
+            }
+            lightCount = w;
+        }
+        else if (strcmp(argv[i], "--light-culling=tiled") == 0) options.lightCulling = true;
+        else if (strcmp(argv[i], "--light-culling=off") == 0) options.lightCulling = false;
+        else if (strcmp(argv[i], "--lod=on") == 0) useLod = true;
+        else if (strcmp(argv[i], "--lod=off") == 0) useLod = false;
+        else if (strncmp(argv[i], "--lod-error=", 12) == 0) {
+            int used = -1;
+            if (sscanf(argv[i] + 12, "%f%n", &lodError, &used) != 1 || !only_blanks_after(argv[i] + 12, used) ||
+                !(lodError > 0.0f)) {
+                fprintf(stderr, "Error: --lod-error takes a positive number of pixels.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--mesh-cache=on") == 0) meshCache = true;
+        else if (strcmp(argv[i], "--mesh-cache=off") == 0) meshCache = false;
+        else if (strcmp(argv[i], "--shader-report") == 0) return report_shader_accuracy();
+        else if (strcmp(argv[i], "--stats") == 0) showStats = true;
+        else if (strcmp(argv[i], "--overdraw") == 0) {
+            if (!PIPELINE_COUNTERS) {
+                fprintf(stderr, "Error: --overdraw needs a build with PIPELINE_COUNTERS=1.\n");
+                return 1;
+            }
+            batch.overdraw = true;
+        }
+        else if (strcmp(argv[i], "--compare-raster") == 0) compare = true;
+        else if (strcmp(argv[i], "--bench") == 0) bench = 1;
+        else if (strcmp(argv[i], "--bench=full") == 0) bench = 2;
+        else {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    ThreadPool pool(threads);
+    Texture texture;
+    if (options.shader == SHADER_TEXTURED) {
+        Image image;
+        if (texturePath && !load_image(texturePath, image)) return 1;
+        if (!texturePath) image = make_checker_image(512, 8);
+        auto start = std::chrono::steady_clock::now();
+        texture.create(image, textureLayout, pool);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (!bench)
+            printf("texture: %s: %dx%d as %dx%d %s, %d levels, %.1f MB, mips in %.1f ms\n",
+                texturePath ? texturePath : "checker", image.width, image.height, texture.width(), texture.height(),
+                texture_layout_name(textureLayout), texture.level_count(), texture.bytes() / 1048576.0, elapsed.count());
+    }
+
+    if (bench)
+        return run_benchmark(bench == 2, options, format, layout, threads, texture.empty() ? nullptr : &texture, lightCount);
+
+    if (useOrbit) {
+        if (!batch.frames) batch.frames = 1;
+        batch.cameras = orbit_cameras(batch.frames, orbit[0], orbit[1]);
+    }
+    if (batch.cameras.empty()) batch.cameras.push_back(kDefaultCamera);
+    if (!batch.frames) batch.frames = (int)batch.cameras.size();
+    if (batch.frames > 1 && frame_conversions(batch.outputPattern) != 1) {
+        fprintf(stderr, "Error: rendering %d frames needs a %%d in the output name.\n", batch.frames);
+        return 1;
+    }
+
+    Mesh model;
+    SphereLod sphere(kSceneRadius, kSceneCenter[0], kSceneCenter[1], kSceneCenter[2]);
+    Scene scene;
+    scene.mesh = &model;
+    scene.lod = nullptr;
+    scene.lodErrorPx = lodError;
+    if (instanceCount) {
+        make_part_grid(instanceCount, scene);
+    } else {
+        Instance instance = { nullptr, mat4_identity(), 0 };
+        scene.instances.push_back(instance);
+        scene.materials.push_back(kDefaultMaterial);
+    }
+    for (size_t i = 0; i < scene.materials.size(); ++i) scene.materials[i].texture = texture.empty() ? nullptr : &texture;
+    scene.lights.push_back(kDefaultLight);
+    if (lightCount) {
+        float lo[3], hi[3];
+        scene_bounds(scene, lo, hi);
+        std::vector<Light> lights = scatter_lights(lightCount, lo, hi);
+        scene.lights.insert(scene.lights.end(), lights.begin(), lights.end());
+    }
+    if (meshPath) {
+        MeshLoadStats load;
+        if (!load_mesh_cached(meshPath, model, pool, load, meshCache)) return 1;
+        // Put the model where the default sphere would be.
+        fit_mesh(model, kSceneRadius, kSceneCenter[0], kSceneCenter[1], kSceneCenter[2]);
+        printf("mesh: %s: %zu vertices, %zu triangles, %.1f MB in %.1f ms ", meshPath,
+            model.vertex_count(), model.triangle_count(), load.bytes / 1048576.0, load.parseMs + load.normalsMs);
+        if (load.cached) printf("(from cache)\n");
+        else printf("(parse %.1f ms, normals %.1f ms)\n", load.parseMs, load.normalsMs);
+    } else if (useLod) {
+        scene.lod = &sphere;
+    } else {
+        model = create_scene();
+    }
+    if (compare) {
+        std::vector<Instance> instances;
+        int coarsest, finest;
+        scene_instances(scene, kDefaultCamera, height, instances, coarsest, finest);
+        return compare_raster_paths(instances, scene.materials, scene.lights, width, height, options, pool);
+    }
+
+    ImageWriter writer(png);
+    render_batch(scene, width, height, options, format, layout, batch, showStats, pool, writer);
+    return writer.flush() ? 0 : 1;
 }
@@ -0,0 +1,220 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Indexed triangle mesh; every three entries of `indices` form one triangle,
+// wound clockwise when seen from its front side (the rasterizer's front-face
+// convention; the loaders flip the counter-clockwise winding of OBJ and PLY).
+// Vertex attributes are stored as separate streams (structure of arrays) so
+// the vertex stage can load several vertices per SIMD register: vertex i is
+// at (x[i], y[i], z[i]) with normal (nx[i], ny[i], nz[i]) and texture
+// coordinates (u[i], v[i]), v pointing up the image as in OBJ. Meshes
+// without texture coordinates leave u and v empty.
+struct Mesh {
+    std::vector<float> x, y, z;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> u, v;
+    std::vector<uint32_t> indices;
+
+    size_t vertex_count() const { return x.size(); }
+    size_t triangle_count() const { return indices.size() / 3; }
+    bool has_texcoords() const { return !u.empty(); }
+
+    void reserve_vertices(size_t count) {
+        x.reserve(count); y.reserve(count); z.reserve(count);
+        nx.reserve(count); ny.reserve(count); nz.reserve(count);
+    }
+
+    uint32_t add_vertex(float px, float py, float pz, float nxv, float nyv, float nzv) {
+        x.push_back(px); y.push_back(py); z.push_back(pz);
+        nx.push_back(nxv); ny.push_back(nyv); nz.push_back(nzv);
+        return (uint32_t)x.size() - 1;
+    }
+
+    void add_texcoord(float uv, float vv) {
+        u.push_back(uv);
+        v.push_back(vv);
+    }
+
+    void add_triangle(uint32_t i0, uint32_t i1, uint32_t i2) {
+        indices.push_back(i0);
+        indices.push_back(i1);
+        indices.push_back(i2);
+    }
+};
+
+// UV sphere of `width` segments around and `height` rings from pole to pole
+// (the poles are single vertices stored last), centered at (cx, cy, cz).
+// Texture coordinates map longitude to u and latitude to v, so the first
+// and last columns coincide at the u = 0 / u = 1 seam.
+inline Mesh make_sphere_mesh(int width, int height, float radius, float cx, float cy, float cz) {
+    Mesh mesh;
+    mesh.reserve_vertices((size_t)(height - 2) * width + 2);
+    mesh.u.reserve((size_t)(height - 2) * width + 2);
+    mesh.v.reserve((size_t)(height - 2) * width + 2);
+    mesh.indices.reserve((size_t)(height - 2) * width * 6);
+
+    for (int j = 1; j < height - 1; ++j) {
+        for (int i = 0; i < width; ++i) {
+            float theta = (float)i / (float)(width - 1) * 2.0f * M_PI;
+            float phi = (float)j / (float)(height - 1) * M_PI;
+            float x = sinf(phi) * cosf(theta);
+            float y = cosf(phi);
+            float z = sinf(phi) * sinf(theta);
+            mesh.add_vertex(x * radius + cx, y * radius + cy, z * radius + cz, x, y, z);
+            mesh.add_texcoord((float)i / (float)(width - 1), 1.0f - (float)j / (float)(height - 1));
+        }
+    }
+
+    mesh.add_vertex(cx, cy + radius, cz, 0.0f, 1.0f, 0.0f);
+    mesh.add_texcoord(0.5f, 1.0f);
+    mesh.add_vertex(cx, cy - radius, cz, 0.0f, -1.0f, 0.0f);
+    mesh.add_texcoord(0.5f, 0.0f);
+
+    uint32_t poleTop = (uint32_t)(height - 2) * width;
+    uint32_t poleBottom = poleTop + 1;
+
+    for (int y = 0; y < height - 3; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int nextX = (x + 1) % width;
+            uint32_t i0 = y * width + x;
+            uint32_t i1 = y * width + nextX;
+            uint32_t i2 = (y + 1) * width + x;
+            uint32_t i3 = (y + 1) * width + nextX;
+            mesh.add_triangle(i0, i2, i1);
+            mesh.add_triangle(i1, i2, i3);
+        }
+    }
+
+    for (int x = 0; x < width; ++x) {
+        int nextX = (x + 1) % width;
+        mesh.add_triangle(poleTop, x, nextX);
+    }
+
+    uint32_t base = (uint32_t)(height - 3) * width;
+    for (int x = 0; x < width; ++x) {
+        int nextX = (x + 1) % width;
+        mesh.add_triangle(poleBottom, base + nextX, base + x);
+    }
+    return mesh;
+}
+
+// `count` x `count` spheres of make_sphere_mesh(width, height, ...) merged
+// into one mesh, filling a square of side `size` centered at (cx, cy, cz)
+// and facing +z. Neighbouring spheres touch at their equators.
+inline Mesh make_sphere_grid(int count, int width, int height, float size, float cx, float cy, float cz) {
+    float spacing = size / count;
+    Mesh sphere = make_sphere_mesh(width, height, 0.5f * spacing, 0.0f, 0.0f, 0.0f);
+    size_t sphereVertices = sphere.vertex_count();
+
+    Mesh mesh;
+    mesh.reserve_vertices(sphereVertices * count * count);
+    mesh.indices.reserve(sphere.indices.size() * count * count);
+    for (int j = 0; j < count; ++j) {
+        for (int i = 0; i < count; ++i) {
+            float ox = cx + ((float)i + 0.5f) * spacing - 0.5f * size;
+            float oy = cy + ((float)j + 0.5f) * spacing - 0.5f * size;
+            uint32_t base = (uint32_t)mesh.vertex_count();
+            for (size_t v = 0; v < sphereVertices; ++v) {
+                mesh.add_vertex(sphere.x[v] + ox, sphere.y[v] + oy, sphere.z[v] + cz,
+                    sphere.nx[v], sphere.ny[v], sphere.nz[v]);
+                mesh.add_texcoord(sphere.u[v], sphere.v[v]);
+            }
+            for (size_t k = 0; k < sphere.indices.size(); ++k)
+                mesh.indices.push_back(base + sphere.indices[k]);
+        }
+    }
+    return mesh;
+}
+
+// Area-weighted smooth normals, for meshes loaded without normals. Vertices
+// no triangle references keep a +y normal.
+inline void compute_vertex_normals(Mesh& mesh) {
+    size_t count = mesh.vertex_count();
+    mesh.nx.assign(count, 0.0f);
+    mesh.ny.assign(count, 0.0f);
+    mesh.nz.assign(count, 0.0f);
+
+    const uint32_t* idx = mesh.indices.data();
+    for (size_t t = 0; t < mesh.triangle_count(); ++t, idx += 3) {
+        uint32_t a = idx[0], b = idx[1], c = idx[2];
+        float ux = mesh.x[b] - mesh.x[a], uy = mesh.y[b] - mesh.y[a], uz = mesh.z[b] - mesh.z[a];
+        float vx = mesh.x[c] - mesh.x[a], vy = mesh.y[c] - mesh.y[a], vz = mesh.z[c] - mesh.z[a];
+        // Twice the triangle area times its unit normal; v x u because the
+        // winding is clockwise.
+        float fx = vy * uz - vz * uy, fy = vz * ux - vx * uz, fz = vx * uy - vy * ux;
+        for (int k = 0; k < 3; ++k) {
+            mesh.nx[idx[k]] += fx;
+            mesh.ny[idx[k]] += fy;
+            mesh.nz[idx[k]] += fz;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        float len = sqrtf(mesh.nx[i] * mesh.nx[i] + mesh.ny[i] * mesh.ny[i] + mesh.nz[i] * mesh.nz[i]);
+        if (len > 0.0f) {
+            mesh.nx[i] /= len;
+            mesh.ny[i] /= len;
+            mesh.nz[i] /= len;
+        } else {
+            mesh.ny[i] = 1.0f;
+        }
+    }
+}
+
+// Sphere around the center of the bounding box that holds every vertex; a
+// zero radius for an empty mesh.
+inline void mesh_bounding_sphere(const Mesh& mesh, float center[3], float& radius) {
+    center[0] = center[1] = center[2] = 0.0f;
+    radius = 0.0f;
+    size_t count = mesh.vertex_count();
+    if (!count) return;
+    float lo[3] = { mesh.x[0], mesh.y[0], mesh.z[0] }, hi[3] = { lo[0], lo[1], lo[2] };
+    for (size_t i = 1; i < count; ++i) {
+        lo[0] = fminf(lo[0], mesh.x[i]); hi[0] = fmaxf(hi[0], mesh.x[i]);
+        lo[1] = fminf(lo[1], mesh.y[i]); hi[1] = fmaxf(hi[1], mesh.y[i]);
+        lo[2] = fminf(lo[2], mesh.z[i]); hi[2] = fmaxf(hi[2], mesh.z[i]);
+    }
+    for (int k = 0; k < 3; ++k) center[k] = 0.5f * (lo[k] + hi[k]);
+
+    float r2 = 0.0f;
+    for (size_t i = 0; i < count; ++i) {
+        float dx = mesh.x[i] - center[0], dy = mesh.y[i] - center[1], dz = mesh.z[i] - center[2];
+        r2 = fmaxf(r2, dx * dx + dy * dy + dz * dz);
+    }
+    radius = sqrtf(r2);
+}
+
+// Uniformly scales and translates the mesh so its bounding box is centered
+// at (cx, cy, cz) with a half diagonal of `radius`. Normals are unchanged.
+inline void fit_mesh(Mesh& mesh, float radius, float cx, float cy, float cz) {
+    size_t count = mesh.vertex_count();
+    if (!count) return;
+    float lo[3] = { mesh.x[0], mesh.y[0], mesh.z[0] }, hi[3] = { lo[0], lo[1], lo[2] };
+    for (size_t i = 1; i < count; ++i) {
+        float p[3] = { mesh.x[i], mesh.y[i], mesh.z[i] };
+        for (int k = 0; k < 3; ++k) {
+            lo[k] = fminf(lo[k], p[k]);
+            hi[k] = fmaxf(hi[k], p[k]);
+        }
+    }
+
+    float d[3] = { hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2] };
+    float halfDiagonal = 0.5f * sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    float scale = halfDiagonal > 0.0f ? radius / halfDiagonal : 1.0f;
+    float mx = 0.5f * (lo[0] + hi[0]), my = 0.5f * (lo[1] + hi[1]), mz = 0.5f * (lo[2] + hi[2]);
+    for (size_t i = 0; i < count; ++i) {
+        mesh.x[i] = (mesh.x[i] - mx) * scale + cx;
+        mesh.y[i] = (mesh.y[i] - my) * scale + cy;
+        mesh.z[i] = (mesh.z[i] - mz) * scale + cz;
+    }
+}
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef MESH_CACHE_HPP
+#define MESH_CACHE_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "file_io.hpp"
+#include "mesh.hpp"
+#include "mesh_loader.hpp"
+#include "thread_pool.hpp"
+
+// Binary mesh cache, written next to a parsed mesh as "<source>.swmesh" and
+// memory-mapped on later runs. All values are little-endian.
+//
+//   MeshCacheHeader        padded to MESH_CACHE_ALIGN bytes
+//   uint64_t checksums[]   one per MESH_CACHE_BLOCK bytes of payload, padded
+//   payload:
+//     uint16_t qx[], qy[], qz[]   positions quantized to the bounds
+//     uint32_t normals[]          octahedral, two snorm16 (u low, v high)
+//     float texcoords[][2]        (u, v), only when hasTexcoords is set
+//     uint16_t/uint32_t indices[]
+//
+// Every payload section starts on a MESH_CACHE_ALIGN boundary and padding is
+// zero, so the payload is a whole number of 64-bit words.
+#define MESH_CACHE_MAGIC 0x434D5753u  // "SWMC"
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_ALIGN 64
+#define MESH_CACHE_BLOCK (256 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t indexSize;         // 2 or 4 bytes
+    uint32_t blockCount;
+    uint32_t hasTexcoords;      // 0 or 1
+    uint32_t reserved;          // zero
+    float boundsMin[3];
+    float boundsMax[3];
+    uint64_t sourceSize;        // size and modification time of the file
+    int64_t sourceTime;         // the cache was built from
+    uint64_t tableChecksum;     // over checksums[]
+    uint64_t headerChecksum;    // over this header with this field zero
+} MeshCacheHeader;
+
+inline size_t cache_align(size_t n) {
+    return (n + MESH_CACHE_ALIGN - 1) & ~(size_t)(MESH_CACHE_ALIGN - 1);
+}
+
+// Word-wise hash; every step is invertible, so any single corrupted word
+// changes the result.
+inline uint64_t cache_checksum(const unsigned char* p, size_t bytes, uint64_t h = 0x243F6A8885A308D3ull) {
+    for (size_t i = 0; i + 8 <= bytes; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+// Byte offsets of the payload sections, relative to the payload start.
+typedef struct {
+    size_t x, y, z, normals, texcoords, indices, end;
+} MeshCacheLayout;
+
+inline MeshCacheLayout mesh_cache_layout(size_t vertices, size_t indices, size_t indexSize, bool texcoords) {
+    MeshCacheLayout l;
+    l.x = 0;
+    l.y = l.x + cache_align(vertices * 2);
+    l.z = l.y + cache_align(vertices * 2);
+    l.normals = l.z + cache_align(vertices * 2);
+    l.texcoords = l.normals + cache_align(vertices * 4);
+    l.indices = l.texcoords + (texcoords ? cache_align(vertices * 8) : 0);
+    l.end = l.indices + cache_align(indices * indexSize);
+    return l;
+}
+
+inline size_t mesh_cache_table_offset() {
+    return cache_align(sizeof(MeshCacheHeader));
+}
+
+inline size_t mesh_cache_payload_offset(size_t blockCount) {
+    return mesh_cache_table_offset() + cache_align(blockCount * 8);
+}
+
+inline int16_t snorm16(float v) {
+    return (int16_t)lrintf(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f);
+}
+
+inline float sign_not_zero(float v) {
+    return v < 0.0f ? -1.0f : 1.0f;
+}
+
+// Octahedral normal encoding: project onto |x| + |y| + |z| = 1 and fold the
+// lower hemisphere over the diagonals.
+inline uint32_t encode_octahedral(float x, float y, float z) {
+    float s = fabsf(x) + fabsf(y) + fabsf(z);
+    float u = s > 0.0f ? x / s : 0.0f, v = s > 0.0f ? y / s : 0.0f;
+    if (z < 0.0f) {
+        float fu = (1.0f - fabsf(v)) * sign_not_zero(u);
+        v = (1.0f - fabsf(u)) * sign_not_zero(v);
+        u = fu;
+    }
+    return (uint16_t)snorm16(u) | (uint32_t)(uint16_t)snorm16(v) << 16;
+}
+
+inline void decode_octahedral(uint32_t e, float& x, float& y, float& z) {
+    float u = (float)(int16_t)(e & 0xFFFF) / 32767.0f, v = (float)(int16_t)(e >> 16) / 32767.0f;
+    z = 1.0f - fabsf(u) - fabsf(v);
+    if (z < 0.0f) {
+        float fu = (1.0f - fabsf(v)) * sign_not_zero(u);
+        v = (1.0f - fabsf(u)) * sign_not_zero(v);
+        u = fu;
+    }
+    float len = sqrtf(u * u + v * v + z * z);
+    x = u / len;
+    y = v / len;
+    z /= len;
+}
+
+// Streams the payload to a file in whole buffers, hashing each
+// MESH_CACHE_BLOCK as it goes.
+class MeshCacheWriter {
+public:
+    explicit MeshCacheWriter(FILE* file) : file(file), buffer(64 * 1024) {}
+
+    template <typename T>
+    void put(T value) {
+        if (fill + sizeof(T) > buffer.size()) flush();
+        memcpy(&buffer[fill], &value, sizeof(T));
+        fill += sizeof(T);
+    }
+
+    // Zero padding up to the next section boundary.
+    void align() {
+        while (fill % MESH_CACHE_ALIGN) buffer[fill++] = 0;
+    }
+
+    // Writes what is buffered; returns the block checksums when done.
+    bool finish(std::vector<uint64_t>& checksums) {
+        align();
+        flush();
+        if (blockFill) sums.push_back(hash);
+        checksums.swap(sums);
+        return ok;
+    }
+
+private:
+    // The buffer size divides MESH_CACHE_BLOCK, so a flush never straddles
+    // two blocks.
+    void flush() {
+        hash = cache_checksum(buffer.data(), fill, blockFill ? hash : cache_checksum(nullptr, 0));
+        blockFill += fill;
+        if (blockFill == MESH_CACHE_BLOCK) {
+            sums.push_back(hash);
+            blockFill = 0;
+        }
+        ok = ok && fwrite(buffer.data(), 1, fill, file) == fill;
+        fill = 0;
+    }
+
+    FILE* file;
+    std::vector<unsigned char> buffer;
+    size_t fill = 0;
+    size_t blockFill = 0;
+    uint64_t hash = 0;
+    std::vector<uint64_t> sums;
+    bool ok = true;
+};
+
+// Writes `mesh` as a cache of `source`. The file is written under a
+// temporary name and renamed, so readers never see a partial cache.
+inline bool save_mesh_cache(const char* path, const Mesh& mesh, const FileStamp& source) {
+    size_t vertices = mesh.vertex_count(), indices = mesh.indices.size();
+    if (!vertices || mesh.nx.size() != vertices) return false;
+
+    MeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.vertexCount = (uint32_t)vertices;
+    header.indexCount = (uint32_t)indices;
+    header.indexSize = vertices <= 65536 ? 2 : 4;
+    header.hasTexcoords = mesh.has_texcoords();
+    header.sourceSize = source.size;
+    header.sourceTime = source.time;
+    const std::vector<float>* pos[3] = { &mesh.x, &mesh.y, &mesh.z };
+    for (int k = 0; k < 3; ++k) {
+        std::pair<std::vector<float>::const_iterator, std::vector<float>::const_iterator> range =
+            std::minmax_element(pos[k]->begin(), pos[k]->end());
+        header.boundsMin[k] = *range.first;
+        header.boundsMax[k] = *range.second;
+    }
+    MeshCacheLayout layout = mesh_cache_layout(vertices, indices, header.indexSize, header.hasTexcoords != 0);
+    header.blockCount = (uint32_t)((layout.end + MESH_CACHE_BLOCK - 1) / MESH_CACHE_BLOCK);
+
+    std::string temp = std::string(path) + ".tmp";
+    FILE* file = open_file(temp.c_str(), "wb");
+    if (!file) return false;
+    size_t payload = mesh_cache_payload_offset(header.blockCount);
+    bool ok = fseek(file, (long)payload, SEEK_SET) == 0;
+
+    MeshCacheWriter writer(file);
+    for (int k = 0; k < 3; ++k) {
+        float lo = header.boundsMin[k], extent = header.boundsMax[k] - lo;
+        float scale = extent > 0.0f ? 65535.0f / extent : 0.0f;
+        for (size_t i = 0; i < vertices; ++i)
+            writer.put((uint16_t)std::min(65535L, lrintf(((*pos[k])[i] - lo) * scale)));
+        writer.align();
+    }
+    for (size_t i = 0; i < vertices; ++i)
+        writer.put(encode_octahedral(mesh.nx[i], mesh.ny[i], mesh.nz[i]));
+    writer.align();
+    if (header.hasTexcoords) {
+        for (size_t i = 0; i < vertices; ++i) {
+            writer.put(mesh.u[i]);
+            writer.put(mesh.v[i]);
+        }
+        writer.align();
+    }
+    for (size_t i = 0; i < indices; ++i) {
+        if (header.indexSize == 2) writer.put((uint16_t)mesh.indices[i]);
+        else writer.put(mesh.indices[i]);
+    }
+    std::vector<uint64_t> checksums;
+    ok = writer.finish(checksums) && ok;
+
+    checksums.resize(cache_align(checksums.size() * 8) / 8, 0);
+    header.tableChecksum = cache_checksum((const unsigned char*)checksums.data(), header.blockCount * 8);
+    header.headerChecksum = cache_checksum((const unsigned char*)&header, sizeof(header));
+    std::vector<unsigned char> head(mesh_cache_table_offset(), 0);
+    memcpy(head.data(), &header, sizeof(header));
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(head.data(), 1, head.size(), file) == head.size() &&
+        fwrite(checksums.data(), 8, checksums.size(), file) == checksums.size();
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || !replace_file(temp.c_str(), path)) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Maps a cache and decodes it into `mesh`. Only the header and checksum
+// table are checked up front; each payload block is verified by the job
+// that decodes it, so validation costs no extra pass over the file.
+// `source` (optional) must match the stamp the cache was built from.
+// On failure `reason` says why and `mesh` is unspecified.
+inline bool load_mesh_cache(const char* path, const FileStamp* source, Mesh& mesh, ThreadPool& pool,
+    MeshLoadStats& stats, const char*& reason) {
+    MappedFile file;
+    if (!file.open(path)) {
+        reason = "missing";
+        return false;
+    }
+    stats.bytes = file.size();
+    const unsigned char* data = (const unsigned char*)file.data();
+
+    MeshCacheHeader header;
+    if (file.size() < mesh_cache_table_offset()) {
+        reason = "truncated";
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    uint64_t headerChecksum = header.headerChecksum;
+    header.headerChecksum = 0;
+    if (header.magic != MESH_CACHE_MAGIC || header.version != MESH_CACHE_VERSION ||
+        cache_checksum((const unsigned char*)&header, sizeof(header)) != headerChecksum) {
+        reason = "from another version or corrupt";
+        return false;
+    }
+    if (source && (header.sourceSize != source->size || header.sourceTime != source->time)) {
+        reason = "stale";
+        return false;
+    }
+    size_t vertices = header.vertexCount, indices = header.indexCount;
+    bool texcoords = header.hasTexcoords != 0;
+    MeshCacheLayout layout = mesh_cache_layout(vertices, indices, header.indexSize, texcoords);
+    size_t payload = mesh_cache_payload_offset(header.blockCount);
+    if ((header.indexSize != 2 && header.indexSize != 4) || indices % 3 || header.hasTexcoords > 1 ||
+        header.blockCount != (layout.end + MESH_CACHE_BLOCK - 1) / MESH_CACHE_BLOCK ||
+        file.size() != payload + layout.end) {
+        reason = "truncated";
+        return false;
+    }
+    const unsigned char* table = data + mesh_cache_table_offset();
+    if (cache_checksum(table, header.blockCount * 8) != header.tableChecksum) {
+        reason = "corrupt";
+        return false;
+    }
+
+    mesh = Mesh();
+    mesh.x.resize(vertices); mesh.y.resize(vertices); mesh.z.resize(vertices);
+    mesh.nx.resize(vertices); mesh.ny.resize(vertices); mesh.nz.resize(vertices);
+    if (texcoords) {
+        mesh.u.resize(vertices); mesh.v.resize(vertices);
+    }
+    mesh.indices.resize(indices);
+    std::vector<float>* pos[3] = { &mesh.x, &mesh.y, &mesh.z };
+    size_t posOffset[3] = { layout.x, layout.y, layout.z };
+    float step[3];
+    for (int k = 0; k < 3; ++k) step[k] = (header.boundsMax[k] - header.boundsMin[k]) / 65535.0f;
+
+    // Sections are aligned and element sizes divide the block size, so
+    // every block holds whole elements of at most a few sections.
+    std::atomic<bool> valid(true);
+    const unsigned char* base = data + payload;
+    pool.run((int)header.blockCount, [&](int block, int) {
+        size_t begin = (size_t)block * MESH_CACHE_BLOCK, end = std::min(begin + MESH_CACHE_BLOCK, layout.end);
+        uint64_t expected;
+        memcpy(&expected, table + (size_t)block * 8, 8);
+        if (cache_checksum(base + begin, end - begin) != expected) {
+            valid = false;
+            return;
+        }
+        // [first, last) elements of a section of `size`-byte elements
+        // starting at `offset` that lie in this block.
+        auto span = [&](size_t offset, size_t count, size_t size, size_t& first, size_t& last) {
+            first = begin > offset ? (begin - offset) / size : 0;
+            last = end > offset ? std::min(count, (end - offset) / size) : 0;
+            return first < last;
+        };
+        size_t first, last;
+        for (int k = 0; k < 3; ++k) {
+            if (!span(posOffset[k], vertices, 2, first, last)) continue;
+            float* out = pos[k]->data();
+            const unsigned char* src = base + posOffset[k];
+            for (size_t i = first; i < last; ++i) {
+                uint16_t q;
+                memcpy(&q, src + i * 2, 2);
+                out[i] = header.boundsMin[k] + q * step[k];
+            }
+        }
+        if (span(layout.normals, vertices, 4, first, last)) {
+            const unsigned char* src = base + layout.normals;
+            for (size_t i = first; i < last; ++i) {
+                uint32_t e;
+                memcpy(&e, src + i * 4, 4);
+                decode_octahedral(e, mesh.nx[i], mesh.ny[i], mesh.nz[i]);
+            }
+        }
+        if (span(layout.texcoords, texcoords ? vertices : 0, 8, first, last)) {
+            const unsigned char* src = base + layout.texcoords;
+            for (size_t i = first; i < last; ++i) {
+                memcpy(&mesh.u[i], src + i * 8, 4);
+                memcpy(&mesh.v[i], src + i * 8 + 4, 4);
+            }
+        }
+        if (span(layout.indices, indices, header.indexSize, first, last)) {
+            const unsigned char* src = base + layout.indices;
+            uint32_t* out = mesh.indices.data();
+            uint32_t bad = 0;
+            if (header.indexSize == 4) {
+                memcpy(out + first, src + first * 4, (last - first) * 4);
+                for (size_t i = first; i < last; ++i) bad |= out[i] >= vertices;
+            } else {
+                for (size_t i = first; i < last; ++i) {
+                    uint16_t v;
+                    memcpy(&v, src + i * 2, 2);
+                    out[i] = v;
+                    bad |= v >= vertices;
+                }
+            }
+            if (bad) valid = false;
+        }
+    });
+    if (!valid) {
+        reason = "corrupt";
+        return false;
+    }
+    return true;
+}
+
+inline std::string mesh_cache_path(const char* source) {
+    return std::string(source) + ".swmesh";
+}
+
+// load_mesh() through the cache: when `useCache` is set, a valid
+// "<path>.swmesh" for the current source file is decoded instead of parsing
+// the source, and a missing or invalid one is (re)written after parsing.
+// A path ending in .swmesh is loaded as a cache directly.
+inline bool load_mesh_cached(const char* path, Mesh& mesh, ThreadPool& pool, MeshLoadStats& stats, bool useCache) {
+    typedef std::chrono::steady_clock Clock;
+    stats = MeshLoadStats();
+    const char* reason = nullptr;
+    if (has_extension(path, ".swmesh")) {
+        Clock::time_point start = Clock::now();
+        if (!load_mesh_cache(path, nullptr, mesh, pool, stats, reason)) {
+            if (strcmp(reason, "missing") == 0) fprintf(stderr, "Error: Could not open mesh %s.\n", path);
+            else fprintf(stderr, "Error: %s: mesh cache is %s.\n", path, reason);
+            return false;
+        }
+        stats.parseMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        stats.cached = true;
+        return true;
+    }
+
+    if (!useCache) return load_mesh(path, mesh, pool, stats);
+    FileStamp stamp;
+    if (!file_stamp(path, stamp)) {
+        fprintf(stderr, "Error: Could not open mesh %s.\n", path);
+        return false;
+    }
+    std::string cache = mesh_cache_path(path);
+    Clock::time_point start = Clock::now();
+    if (load_mesh_cache(cache.c_str(), &stamp, mesh, pool, stats, reason)) {
+        stats.parseMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        stats.cached = true;
+        return true;
+    }
+
+    if (!load_mesh(path, mesh, pool, stats)) return false;
+    if (!save_mesh_cache(cache.c_str(), mesh, stamp))
+        fprintf(stderr, "Warning: Could not write mesh cache %s.\n", cache.c_str());
+    return true;
+}
+
+#endif
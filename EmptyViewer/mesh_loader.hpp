@@ -0,0 +1,817 @@
+#ifndef MESH_LOADER_HPP
+#define MESH_LOADER_HPP
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_io.hpp"
+#include "mesh.hpp"
+#include "thread_pool.hpp"
+
+typedef struct {
+    size_t bytes;
+    double parseMs;     // mapping and parsing into the mesh streams
+    double normalsMs;   // normal generation or per-corner normal remapping
+    bool cached;        // decoded from a mesh cache; parseMs is the decode
+} MeshLoadStats;
+
+// Text scanning over [p, end); the mapping is not NUL-terminated, so every
+// helper is bounded by `end`.
+inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline const char* skip_blanks(const char* p, const char* end) {
+    while (p < end && is_blank(*p)) ++p;
+    return p;
+}
+
+inline const char* line_end(const char* p, const char* end) {
+    const char* nl = (const char*)memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+inline bool parse_int(const char*& p, const char* end, long long& out) {
+    const char* s = p;
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+    if (s == end || *s < '0' || *s > '9') return false;
+    long long v = 0;
+    while (s < end && *s >= '0' && *s <= '9' && v < (1LL << 40)) v = v * 10 + (*s++ - '0');
+    out = neg ? -v : v;
+    p = s;
+    return true;
+}
+
+// Decimal float without locale or allocation: up to 19 significant digits
+// are accumulated exactly and scaled once in double precision, which is
+// well within float precision.
+inline bool parse_float(const char*& p, const char* end, float& out) {
+    static const double kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* s = p;
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) neg = *s++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exp10 = 0;
+    bool any = false;
+    for (; s < end && *s >= '0' && *s <= '9'; ++s, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa) ++digits;
+        } else {
+            ++exp10;
+        }
+    }
+    if (s < end && *s == '.') {
+        for (++s; s < end && *s >= '0' && *s <= '9'; ++s, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa) ++digits;
+                --exp10;
+            }
+        }
+    }
+    if (!any) return false;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char* e = s + 1;
+        long long value;
+        if (parse_int(e, end, value)) {
+            exp10 += (int)std::max(-1000LL, std::min(1000LL, value));
+            s = e;
+        }
+    }
+
+    double v = (double)mantissa;
+    if (mantissa == 0) v = 0.0;
+    else if (exp10 >= 0 && exp10 <= 22) v *= kPow10[exp10];
+    else if (exp10 < 0 && exp10 >= -22) v /= kPow10[-exp10];
+    else v *= pow(10.0, exp10);
+    out = (float)(neg ? -v : v);
+    p = s;
+    return true;
+}
+
+// Splits [data, data + size) into at most `count` pieces that each end
+// after a newline.
+inline std::vector<const char*> split_lines(const char* data, size_t size, int count) {
+    std::vector<const char*> bounds(1, data);
+    const char* end = data + size;
+    for (int i = 1; i < count; ++i) {
+        const char* p = std::max(bounds.back(), data + size / count * i);
+        if (p >= end) break;
+        p = line_end(p, end);
+        if (p < end) ++p;
+        if (p > bounds.back() && p < end) bounds.push_back(p);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+// One newline-aligned piece of an OBJ file. Pass 1 counts what it defines;
+// after a prefix sum, pass 2 parses it straight into its slice of the mesh.
+typedef struct {
+    const char* begin;
+    const char* end;
+    size_t positions, texcoords, normals, triangles;
+    size_t positionBase, texcoordBase, normalBase, triangleBase;
+    bool texcoordRefs;      // some face corner has a texture coordinate index
+    bool missingTexcoords;  // some face corner has none
+    bool normalRefs;        // some face corner has a normal index
+    bool missingNormals;    // some face corner has none
+    const char* error;
+} ObjChunk;
+
+enum ObjLine {
+    OBJ_OTHER,
+    OBJ_POSITION,
+    OBJ_TEXCOORD,
+    OBJ_NORMAL,
+    OBJ_FACE
+};
+
+inline ObjLine obj_line_type(const char*& p, const char* end) {
+    p = skip_blanks(p, end);
+    if (end - p < 2) return OBJ_OTHER;
+    if (p[0] == 'v' && is_blank(p[1])) { p += 2; return OBJ_POSITION; }
+    if (p[0] == 'f' && is_blank(p[1])) { p += 2; return OBJ_FACE; }
+    if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && is_blank(p[2])) { p += 3; return OBJ_NORMAL; }
+    if (end - p >= 3 && p[0] == 'v' && p[1] == 't' && is_blank(p[2])) { p += 3; return OBJ_TEXCOORD; }
+    return OBJ_OTHER;
+}
+
+inline void obj_count_chunk(ObjChunk& c) {
+    for (const char* line = c.begin; line < c.end;) {
+        const char* eol = line_end(line, c.end);
+        const char* p = line;
+        switch (obj_line_type(p, eol)) {
+        case OBJ_POSITION: ++c.positions; break;
+        case OBJ_TEXCOORD: ++c.texcoords; break;
+        case OBJ_NORMAL: ++c.normals; break;
+        case OBJ_FACE: {
+            int corners = 0;
+            for (;;) {
+                p = skip_blanks(p, eol);
+                if (p == eol) break;
+                // v, v/vt, v//vn or v/vt/vn
+                int slashes = 0;
+                bool texcoord = false, normal = false;
+                for (; p < eol && !is_blank(*p); ++p) {
+                    if (*p == '/') ++slashes;
+                    else if (slashes == 1) texcoord = true;
+                    else if (slashes == 2) normal = true;
+                }
+                if (texcoord) c.texcoordRefs = true;
+                else c.missingTexcoords = true;
+                if (normal) c.normalRefs = true;
+                else c.missingNormals = true;
+                ++corners;
+            }
+            if (corners >= 3) c.triangles += corners - 2;
+            break;
+        }
+        default: break;
+        }
+        line = eol + (eol < c.end);
+    }
+}
+
+// Resolves a 1-based or negative (relative) OBJ index against the `defined`
+// elements seen so far; returns false when it is out of [0, total).
+inline bool obj_resolve(long long index, size_t defined, size_t total, uint32_t& out) {
+    long long i = index > 0 ? index - 1 : (long long)defined + index;
+    if (index == 0 || i < 0 || i >= (long long)total) return false;
+    out = (uint32_t)i;
+    return true;
+}
+
+// Per-corner attribute indices of the triangles parsed so far, filled only
+// for the attributes the mesh takes from the file.
+typedef struct {
+    std::vector<float> texcoords;       // (u, v) pairs
+    std::vector<float> normals;         // (x, y, z) triples
+    std::vector<uint32_t> texcoordIndices;
+    std::vector<uint32_t> normalIndices;
+} ObjCorners;
+
+inline void obj_parse_chunk(ObjChunk& c, size_t totalPositions, size_t totalTexcoords, size_t totalNormals,
+    Mesh& mesh, ObjCorners& corners) {
+    size_t positions = c.positionBase, texcoords = c.texcoordBase, normals = c.normalBase;
+    uint32_t* tri = mesh.indices.data() + c.triangleBase * 3;
+    uint32_t* triTexcoord = corners.texcoordIndices.empty() ? nullptr : corners.texcoordIndices.data() + c.triangleBase * 3;
+    uint32_t* triNormal = corners.normalIndices.empty() ? nullptr : corners.normalIndices.data() + c.triangleBase * 3;
+
+    for (const char* line = c.begin; line < c.end && !c.error;) {
+        const char* eol = line_end(line, c.end);
+        const char* p = line;
+        switch (obj_line_type(p, eol)) {
+        case OBJ_POSITION: {
+            float v[3];
+            for (int k = 0; k < 3 && !c.error; ++k)
+                if (!parse_float(p = skip_blanks(p, eol), eol, v[k])) c.error = "malformed vertex position";
+            if (c.error) break;
+            mesh.x[positions] = v[0];
+            mesh.y[positions] = v[1];
+            mesh.z[positions] = v[2];
+            ++positions;
+            break;
+        }
+        case OBJ_TEXCOORD: {
+            // "vt u [v [w]]"; a missing v is 0.
+            float* t = &corners.texcoords[texcoords * 2];
+            if (!parse_float(p = skip_blanks(p, eol), eol, t[0])) c.error = "malformed texture coordinate";
+            if (!parse_float(p = skip_blanks(p, eol), eol, t[1])) t[1] = 0.0f;
+            ++texcoords;
+            break;
+        }
+        case OBJ_NORMAL: {
+            float* n = &corners.normals[normals * 3];
+            for (int k = 0; k < 3 && !c.error; ++k)
+                if (!parse_float(p = skip_blanks(p, eol), eol, n[k])) c.error = "malformed vertex normal";
+            ++normals;
+            break;
+        }
+        case OBJ_FACE: {
+            uint32_t first[3] = { 0, 0, 0 }, prev[3] = { 0, 0, 0 };
+            int count = 0;
+            for (;;) {
+                p = skip_blanks(p, eol);
+                if (p == eol) break;
+                long long v, vt = 0, vn = 0;
+                bool hasTexcoord = false, hasNormal = false;
+                if (!parse_int(p, eol, v)) { c.error = "malformed face"; break; }
+                if (p < eol && *p == '/') {
+                    ++p;
+                    if (p < eol && *p != '/') {
+                        if (!parse_int(p, eol, vt)) { c.error = "malformed face"; break; }
+                        hasTexcoord = true;
+                    }
+                    if (p < eol && *p == '/') {
+                        ++p;
+                        if (!parse_int(p, eol, vn)) { c.error = "malformed face"; break; }
+                        hasNormal = true;
+                    }
+                }
+                // Position, texture coordinate and normal index; an index
+                // that is present must resolve (OBJ indices are never 0).
+                uint32_t corner[3] = { 0, UINT32_MAX, UINT32_MAX };
+                if (!obj_resolve(v, positions, totalPositions, corner[0]) ||
+                    (hasTexcoord && !obj_resolve(vt, texcoords, totalTexcoords, corner[1])) ||
+                    (hasNormal && !obj_resolve(vn, normals, totalNormals, corner[2]))) {
+                    c.error = "face index out of range";
+                    break;
+                }
+
+                if (count == 0) {
+                    memcpy(first, corner, sizeof(first));
+                } else if (count >= 2) {
+                    // Fan around the first corner, flipped to clockwise.
+                    tri[0] = first[0]; tri[1] = corner[0]; tri[2] = prev[0];
+                    tri += 3;
+                    if (triTexcoord) {
+                        triTexcoord[0] = first[1]; triTexcoord[1] = corner[1]; triTexcoord[2] = prev[1];
+                        triTexcoord += 3;
+                    }
+                    if (triNormal) {
+                        triNormal[0] = first[2]; triNormal[1] = corner[2]; triNormal[2] = prev[2];
+                        triNormal += 3;
+                    }
+                }
+                memcpy(prev, corner, sizeof(prev));
+                ++count;
+            }
+            break;
+        }
+        default: break;
+        }
+        line = eol + (eol < c.end);
+    }
+}
+
+// (position, texture coordinate, normal) index triple of a face corner.
+typedef struct {
+    uint32_t p, t, n;
+} ObjCornerKey;
+
+inline bool operator==(const ObjCornerKey& a, const ObjCornerKey& b) {
+    return a.p == b.p && a.t == b.t && a.n == b.n;
+}
+
+struct ObjCornerHash {
+    size_t operator()(const ObjCornerKey& k) const {
+        uint64_t h = ((uint64_t)k.p << 32 | k.n) * 0x9E3779B97F4A7C15ull;
+        h ^= (h >> 29) + k.t * 0xBF58476D1CE4E5B9ull;
+        return (size_t)(h ^ h >> 32);
+    }
+};
+
+// Gives every vertex its file normal and texture coordinate from the
+// per-corner indices in `corners` (an empty index list leaves that
+// attribute as it is in `mesh`): positions whose corners all agree take
+// them directly, the others are split into one vertex per distinct
+// (position, texture coordinate, normal) triple.
+inline void obj_apply_corners(Mesh& mesh, const ObjCorners& corners) {
+    size_t count = mesh.vertex_count();
+    bool texcoords = !corners.texcoordIndices.empty(), normals = !corners.normalIndices.empty();
+    std::vector<uint32_t> assigned(count, UINT32_MAX);
+    bool split = false;
+    for (size_t i = 0; i < mesh.indices.size() && !split; ++i) {
+        uint32_t& a = assigned[mesh.indices[i]];
+        if (a == UINT32_MAX) a = (uint32_t)i;
+        else split = (texcoords && corners.texcoordIndices[a] != corners.texcoordIndices[i]) ||
+            (normals && corners.normalIndices[a] != corners.normalIndices[i]);
+    }
+
+    if (!split) {
+        if (normals) {
+            mesh.nx.assign(count, 0.0f);
+            mesh.ny.assign(count, 1.0f);
+            mesh.nz.assign(count, 0.0f);
+        }
+        if (texcoords) {
+            mesh.u.assign(count, 0.0f);
+            mesh.v.assign(count, 0.0f);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (assigned[i] == UINT32_MAX) continue;
+            if (normals) {
+                const float* n = &corners.normals[(size_t)corners.normalIndices[assigned[i]] * 3];
+                mesh.nx[i] = n[0];
+                mesh.ny[i] = n[1];
+                mesh.nz[i] = n[2];
+            }
+            if (texcoords) {
+                const float* t = &corners.texcoords[(size_t)corners.texcoordIndices[assigned[i]] * 2];
+                mesh.u[i] = t[0];
+                mesh.v[i] = t[1];
+            }
+        }
+        return;
+    }
+
+    Mesh out;
+    out.reserve_vertices(count);
+    out.indices.resize(mesh.indices.size());
+    std::unordered_map<ObjCornerKey, uint32_t, ObjCornerHash> remap;
+    remap.reserve(count);
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        ObjCornerKey key = { mesh.indices[i],
+            texcoords ? corners.texcoordIndices[i] : 0, normals ? corners.normalIndices[i] : 0 };
+        std::unordered_map<ObjCornerKey, uint32_t, ObjCornerHash>::iterator it = remap.find(key);
+        if (it == remap.end()) {
+            uint32_t p = key.p;
+            const float* fn = normals ? &corners.normals[(size_t)key.n * 3] : nullptr;
+            uint32_t v = fn ? out.add_vertex(mesh.x[p], mesh.y[p], mesh.z[p], fn[0], fn[1], fn[2])
+                : out.add_vertex(mesh.x[p], mesh.y[p], mesh.z[p], mesh.nx[p], mesh.ny[p], mesh.nz[p]);
+            if (texcoords) out.add_texcoord(corners.texcoords[(size_t)key.t * 2], corners.texcoords[(size_t)key.t * 2 + 1]);
+            it = remap.insert(std::make_pair(key, v)).first;
+        }
+        out.indices[i] = it->second;
+    }
+    mesh = out;
+}
+
+// Wavefront OBJ: v, vt, vn and f records (polygons are fanned; everything
+// else is ignored). Large files are parsed in parallel, newline-aligned
+// chunks.
+inline bool load_obj(const char* data, size_t size, Mesh& mesh, ThreadPool& pool, MeshLoadStats& stats, const char*& error) {
+    const size_t chunkBytes = 1 << 20;
+    int count = (int)std::min<size_t>(size / chunkBytes + 1, (size_t)pool.size() * 8);
+    std::vector<const char*> bounds = split_lines(data, size, count);
+    std::vector<ObjChunk> chunks(bounds.size() - 1);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        memset(&chunks[i], 0, sizeof(ObjChunk));
+        chunks[i].begin = bounds[i];
+        chunks[i].end = bounds[i + 1];
+    }
+    pool.run((int)chunks.size(), [&](int i, int) { obj_count_chunk(chunks[i]); });
+
+    size_t positions = 0, texcoords = 0, normals = 0, triangles = 0;
+    bool texcoordRefs = false, missingTexcoords = false, normalRefs = false, missingNormals = false;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ObjChunk& c = chunks[i];
+        c.positionBase = positions;
+        c.texcoordBase = texcoords;
+        c.normalBase = normals;
+        c.triangleBase = triangles;
+        positions += c.positions;
+        texcoords += c.texcoords;
+        normals += c.normals;
+        triangles += c.triangles;
+        texcoordRefs |= c.texcoordRefs;
+        missingTexcoords |= c.missingTexcoords;
+        normalRefs |= c.normalRefs;
+        missingNormals |= c.missingNormals;
+    }
+    if (!triangles) {
+        error = "no faces";
+        return false;
+    }
+    if (positions > UINT32_MAX || triangles * 3 > UINT32_MAX) {
+        error = "too many vertices or faces for 32-bit indices";
+        return false;
+    }
+
+    // File attributes are only usable when every corner references one.
+    bool useTexcoords = texcoordRefs && !missingTexcoords;
+    bool useNormals = normalRefs && !missingNormals;
+    mesh = Mesh();
+    mesh.x.resize(positions);
+    mesh.y.resize(positions);
+    mesh.z.resize(positions);
+    mesh.indices.resize(triangles * 3);
+    ObjCorners corners;
+    corners.texcoords.resize(texcoords * 2);
+    corners.normals.resize(normals * 3);
+    corners.texcoordIndices.resize(useTexcoords ? triangles * 3 : 0);
+    corners.normalIndices.resize(useNormals ? triangles * 3 : 0);
+    pool.run((int)chunks.size(), [&](int i, int) {
+        obj_parse_chunk(chunks[i], positions, texcoords, normals, mesh, corners);
+    });
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].error) {
+            error = chunks[i].error;
+            return false;
+        }
+    }
+
+    if (useTexcoords || useNormals) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        // Smooth normals are generated before texture seams split the
+        // positions, so the seams do not show in the shading.
+        if (!useNormals) compute_vertex_normals(mesh);
+        obj_apply_corners(mesh, corners);
+        stats.normalsMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    return true;
+}
+
+// PLY scalar types, in the order of the spec's type table.
+enum PlyType {
+    PLY_INVALID,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64
+};
+
+typedef struct {
+    std::string name;
+    PlyType type;
+    PlyType countType;    // PLY_INVALID unless this is a list
+} PlyProperty;
+
+typedef struct {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+} PlyElement;
+
+inline PlyType ply_type(const std::string& name) {
+    static const char* names[][2] = {
+        { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+    };
+    for (int i = 0; i < 8; ++i)
+        if (name == names[i][0] || name == names[i][1]) return (PlyType)(PLY_INT8 + i);
+    return PLY_INVALID;
+}
+
+inline size_t ply_type_size(PlyType t) {
+    static const size_t sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+    return sizes[t];
+}
+
+inline double ply_read(const char* p, PlyType t, bool swap) {
+    unsigned char b[8];
+    size_t n = ply_type_size(t);
+    memcpy(b, p, n);
+    if (swap) std::reverse(b, b + n);
+    switch (t) {
+    case PLY_INT8: return (double)(int8_t)b[0];
+    case PLY_UINT8: return (double)b[0];
+    case PLY_INT16: { int16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_UINT16: { uint16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_INT32: { int32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_UINT32: { uint32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+    default: return 0.0;
+    }
+}
+
+// Byte size of one record of an element whose properties are all scalars,
+// or 0 when it has a list.
+inline size_t ply_stride(const PlyElement& e) {
+    size_t stride = 0;
+    for (size_t i = 0; i < e.properties.size(); ++i) {
+        if (e.properties[i].countType != PLY_INVALID) return 0;
+        stride += ply_type_size(e.properties[i].type);
+    }
+    return stride;
+}
+
+// Advances p over one record of `e`; returns false on truncated data or a
+// negative list count.
+inline bool ply_skip_record(const PlyElement& e, const char*& p, const char* end, bool swap) {
+    for (size_t i = 0; i < e.properties.size(); ++i) {
+        const PlyProperty& prop = e.properties[i];
+        size_t n = 1;
+        if (prop.countType != PLY_INVALID) {
+            if ((size_t)(end - p) < ply_type_size(prop.countType)) return false;
+            // Count types are integers of at most 32 bits, exact in int64_t.
+            int64_t count = (int64_t)ply_read(p, prop.countType, swap);
+            if (count < 0) return false;
+            n = (size_t)count;
+            p += ply_type_size(prop.countType);
+        }
+        size_t size = ply_type_size(prop.type);
+        if ((size_t)(end - p) / size < n) return false;
+        p += n * size;
+    }
+    return true;
+}
+
+inline bool ply_parse_header(const char*& p, const char* end, std::vector<PlyElement>& elements, bool& swap, const char*& error) {
+    bool sawFormat = false, sawEnd = false;
+    for (int lineNo = 0; p < end && !sawEnd; ++lineNo) {
+        const char* eol = line_end(p, end);
+        std::vector<std::string> words;
+        for (const char* s = p; s < eol;) {
+            s = skip_blanks(s, eol);
+            const char* w = s;
+            while (s < eol && !is_blank(*s)) ++s;
+            if (s > w) words.push_back(std::string(w, s));
+        }
+        p = eol + (eol < end);
+
+        if (lineNo == 0) {
+            if (words.size() != 1 || words[0] != "ply") { error = "not a PLY file"; return false; }
+            continue;
+        }
+        if (words.empty() || words[0] == "comment" || words[0] == "obj_info") continue;
+        if (words[0] == "end_header") {
+            sawEnd = true;
+            continue;
+        }
+        if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "ascii") { error = "ASCII PLY is not supported, only binary"; return false; }
+            if (words[1] != "binary_little_endian" && words[1] != "binary_big_endian") { error = "unknown PLY format"; return false; }
+            // Every target this builds for is little-endian.
+            swap = words[1] == "binary_big_endian";
+            sawFormat = true;
+        } else if (words[0] == "element" && words.size() == 3) {
+            PlyElement e;
+            e.name = words[1];
+            e.count = (size_t)strtoull(words[2].c_str(), nullptr, 10);
+            elements.push_back(e);
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty prop;
+            if (words.size() == 5 && words[1] == "list") {
+                prop.countType = ply_type(words[2]);
+                prop.type = ply_type(words[3]);
+                prop.name = words[4];
+                if (prop.countType == PLY_INVALID || prop.countType == PLY_FLOAT32 || prop.countType == PLY_FLOAT64) prop.type = PLY_INVALID;
+            } else if (words.size() == 3) {
+                prop.countType = PLY_INVALID;
+                prop.type = ply_type(words[1]);
+                prop.name = words[2];
+            } else {
+                prop.type = PLY_INVALID;
+            }
+            if (prop.type == PLY_INVALID) { error = "unsupported PLY property"; return false; }
+            elements.back().properties.push_back(prop);
+        } else {
+            error = "malformed PLY header";
+            return false;
+        }
+    }
+    if (!sawEnd) { error = "truncated PLY header"; return false; }
+    if (!sawFormat) { error = "PLY header has no format line"; return false; }
+    return true;
+}
+
+inline int ply_find(const PlyElement& e, const char* name) {
+    for (size_t i = 0; i < e.properties.size(); ++i)
+        if (e.properties[i].name == name) return (int)i;
+    return -1;
+}
+
+inline bool ply_load_vertices(const PlyElement& e, const char*& p, const char* end, bool swap,
+    Mesh& mesh, bool& hasNormals, ThreadPool& pool, const char*& error) {
+    size_t stride = ply_stride(e);
+    // Texture coordinates go by several names; the first one present wins.
+    const char* names[8][3] = {
+        { "x" }, { "y" }, { "z" }, { "nx" }, { "ny" }, { "nz" },
+        { "u", "s", "texture_u" }, { "v", "t", "texture_v" }
+    };
+    int prop[8];
+    size_t offset[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    for (int k = 0; k < 8; ++k) {
+        prop[k] = -1;
+        for (int n = 0; n < 3 && names[k][n] && prop[k] < 0; ++n) prop[k] = ply_find(e, names[k][n]);
+        for (int i = 0; i < prop[k]; ++i) offset[k] += ply_type_size(e.properties[i].type);
+    }
+    if (!stride || prop[0] < 0 || prop[1] < 0 || prop[2] < 0) { error = "PLY vertices need scalar x, y and z"; return false; }
+    if (e.count > UINT32_MAX || (size_t)(end - p) / stride < e.count) { error = "truncated PLY vertex data"; return false; }
+
+    hasNormals = prop[3] >= 0 && prop[4] >= 0 && prop[5] >= 0;
+    bool hasTexcoords = prop[6] >= 0 && prop[7] >= 0;
+    mesh.x.resize(e.count); mesh.y.resize(e.count); mesh.z.resize(e.count);
+    if (hasNormals) {
+        mesh.nx.resize(e.count); mesh.ny.resize(e.count); mesh.nz.resize(e.count);
+    }
+    if (hasTexcoords) {
+        mesh.u.resize(e.count); mesh.v.resize(e.count);
+    }
+    std::vector<float>* dst[8] = { &mesh.x, &mesh.y, &mesh.z, &mesh.nx, &mesh.ny, &mesh.nz, &mesh.u, &mesh.v };
+    const char* base = p;
+    const size_t block = 1 << 16;
+    pool.run((int)((e.count + block - 1) / block), [&](int job, int) {
+        size_t begin = (size_t)job * block, n = std::min(block, e.count - begin);
+        for (int k = 0; k < 8; ++k) {
+            if ((k >= 3 && k < 6 && !hasNormals) || (k >= 6 && !hasTexcoords)) continue;
+            PlyType type = e.properties[prop[k]].type;
+            float* out = dst[k]->data() + begin;
+            const char* src = base + begin * stride + offset[k];
+            if (type == PLY_FLOAT32 && !swap) {
+                for (size_t i = 0; i < n; ++i, src += stride) memcpy(&out[i], src, 4);
+            } else {
+                for (size_t i = 0; i < n; ++i, src += stride) out[i] = (float)ply_read(src, type, swap);
+            }
+        }
+    });
+    p += e.count * stride;
+    return true;
+}
+
+inline bool ply_load_faces(const PlyElement& e, const char*& p, const char* end, bool swap,
+    Mesh& mesh, ThreadPool& pool, const char*& error) {
+    int list = ply_find(e, "vertex_indices");
+    if (list < 0) list = ply_find(e, "vertex_index");
+    if (list < 0 || e.properties[list].countType == PLY_INVALID) { error = "PLY faces need a vertex_indices list"; return false; }
+    const PlyProperty& prop = e.properties[list];
+    size_t countSize = ply_type_size(prop.countType), indexSize = ply_type_size(prop.type);
+    size_t vertices = mesh.vertex_count();
+
+    // Fast path: a face element holding only the index list, all triangles,
+    // has fixed-size records and is parsed in parallel. Checking the count
+    // of every record at the triangle stride is enough: the first
+    // non-triangle is still read at its true position and fails the check.
+    size_t record = countSize + 3 * indexSize;
+    if (e.properties.size() == 1 && (size_t)(end - p) / record >= e.count && e.count * 3 <= UINT32_MAX) {
+        std::atomic<bool> triangles(true), inRange(true);
+        const char* base = p;
+        const size_t block = 1 << 16;
+        int jobs = (int)((e.count + block - 1) / block);
+        pool.run(jobs, [&](int job, int) {
+            size_t begin = (size_t)job * block, n = std::min(block, e.count - begin);
+            for (size_t i = begin; i < begin + n; ++i)
+                if (ply_read(base + i * record, prop.countType, swap) != 3.0) { triangles = false; return; }
+        });
+        if (triangles) {
+            mesh.indices.resize(e.count * 3);
+            pool.run(jobs, [&](int job, int) {
+                size_t begin = (size_t)job * block, n = std::min(block, e.count - begin);
+                uint32_t* out = mesh.indices.data() + begin * 3;
+                for (size_t i = begin; i < begin + n; ++i) {
+                    const char* src = base + i * record + countSize;
+                    // Stored as 0, 2, 1: flipped to clockwise.
+                    for (int k = 0; k < 3; ++k, src += indexSize) {
+                        double v = ply_read(src, prop.type, swap);
+                        if (!(v >= 0.0 && v < (double)vertices)) inRange = false;
+                        out[k == 0 ? 0 : 3 - k] = (uint32_t)v;
+                    }
+                    out += 3;
+                }
+            });
+            if (!inRange) { error = "face index out of range"; return false; }
+            p += e.count * record;
+            return true;
+        }
+    }
+
+    // General path: mixed polygon sizes or extra face properties; fanned.
+    mesh.indices.clear();
+    mesh.indices.reserve(e.count * 3);
+    for (size_t f = 0; f < e.count; ++f) {
+        for (size_t i = 0; i < e.properties.size(); ++i) {
+            const PlyProperty& q = e.properties[i];
+            if ((int)i != list) {
+                PlyElement one;
+                one.properties.push_back(q);
+                if (!ply_skip_record(one, p, end, swap)) { error = "truncated PLY face data"; return false; }
+                continue;
+            }
+            if ((size_t)(end - p) < countSize) { error = "truncated PLY face data"; return false; }
+            int64_t count = (int64_t)ply_read(p, q.countType, swap);
+            if (count < 0) { error = "negative PLY list count"; return false; }
+            size_t n = (size_t)count;
+            p += countSize;
+            if ((size_t)(end - p) / indexSize < n) { error = "truncated PLY face data"; return false; }
+            uint32_t first = 0, prev = 0;
+            for (size_t k = 0; k < n; ++k, p += indexSize) {
+                double v = ply_read(p, q.type, swap);
+                if (!(v >= 0.0 && v < (double)vertices)) { error = "face index out of range"; return false; }
+                uint32_t idx = (uint32_t)v;
+                if (k == 0) first = idx;
+                else if (k >= 2) mesh.add_triangle(first, idx, prev);
+                prev = idx;
+            }
+        }
+    }
+    if (mesh.indices.size() > UINT32_MAX) { error = "too many faces for 32-bit indices"; return false; }
+    return true;
+}
+
+// Binary PLY (either byte order) with float or integer x, y, z, optional
+// nx, ny, nz and u, v (or s, t), and a face index list; other elements and
+// properties are skipped.
+inline bool load_ply(const char* data, size_t size, Mesh& mesh, ThreadPool& pool, bool& hasNormals, const char*& error) {
+    const char* p = data;
+    const char* end = data + size;
+    std::vector<PlyElement> elements;
+    bool swap = false;
+    if (!ply_parse_header(p, end, elements, swap, error)) return false;
+
+    mesh = Mesh();
+    hasNormals = false;
+    bool sawVertices = false, sawFaces = false;
+    for (size_t i = 0; i < elements.size(); ++i) {
+        const PlyElement& e = elements[i];
+        if (e.name == "vertex" && !sawVertices) {
+            if (!ply_load_vertices(e, p, end, swap, mesh, hasNormals, pool, error)) return false;
+            sawVertices = true;
+        } else if (e.name == "face" && sawVertices && !sawFaces) {
+            if (!ply_load_faces(e, p, end, swap, mesh, pool, error)) return false;
+            sawFaces = true;
+        } else if (size_t stride = ply_stride(e)) {
+            if ((size_t)(end - p) / stride < e.count) { error = "truncated PLY data"; return false; }
+            p += e.count * stride;
+        } else {
+            for (size_t r = 0; r < e.count; ++r)
+                if (!ply_skip_record(e, p, end, swap)) { error = "truncated PLY data"; return false; }
+        }
+    }
+    if (!sawFaces || mesh.indices.empty()) {
+        error = "no faces";
+        return false;
+    }
+    return true;
+}
+
+// Loads an .obj or binary .ply file into `mesh`, using `pool` for the
+// parallel parts. Meshes without normals get smooth ones. Prints the error
+// and returns false on failure.
+inline bool load_mesh(const char* path, Mesh& mesh, ThreadPool& pool, MeshLoadStats& stats) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    stats = MeshLoadStats();
+
+    MappedFile file;
+    if (!file.open(path)) {
+        fprintf(stderr, "Error: Could not open mesh %s.\n", path);
+        return false;
+    }
+    stats.bytes = file.size();
+
+    const char* error = nullptr;
+    bool hasNormals = true;
+    bool ok;
+    if (has_extension(path, ".ply")) ok = load_ply(file.data(), file.size(), mesh, pool, hasNormals, error);
+    else if (has_extension(path, ".obj")) ok = load_obj(file.data(), file.size(), mesh, pool, stats, error);
+    else {
+        ok = false;
+        error = "unknown mesh format, expected .obj or .ply";
+    }
+    Clock::time_point parsed = Clock::now();
+    if (!ok) {
+        fprintf(stderr, "Error: %s: %s.\n", path, error);
+        return false;
+    }
+
+    if (mesh.nx.size() != mesh.vertex_count()) hasNormals = false;
+    if (!hasNormals) compute_vertex_normals(mesh);
+    Clock::time_point done = Clock::now();
+    stats.parseMs = std::chrono::duration<double, std::milli>(parsed - start).count() - stats.normalsMs;
+    stats.normalsMs += std::chrono::duration<double, std::milli>(done - parsed).count();
+    return true;
+}
+
+#endif
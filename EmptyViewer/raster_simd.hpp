@@ -0,0 +1,170 @@
+#ifndef RASTER_SIMD_HPP
+#define RASTER_SIMD_HPP
+
+#include <stdint.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RASTER_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define RASTER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+enum RasterPath {
+    RASTER_SCALAR,
+    RASTER_SSE2,
+    RASTER_AVX2
+};
+
+inline const char* raster_path_name(RasterPath path) {
+    switch (path) {
+    case RASTER_SSE2: return "sse2";
+    case RASTER_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// Picks the widest coverage kernel the CPU and OS support.
+inline RasterPath detect_raster_path() {
+    unsigned regs[4] = { 0, 0, 0, 0 };
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    unsigned maxLeaf = (unsigned)info[0];
+    __cpuid(info, 1);
+    for (int i = 0; i < 4; ++i) regs[i] = (unsigned)info[i];
+#else
+    unsigned maxLeaf = __get_cpuid_max(0, 0);
+    __get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+    bool sse2 = (regs[3] & (1u << 26)) != 0;
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx = (regs[2] & (1u << 28)) != 0;
+    if (!sse2) return RASTER_SCALAR;
+    if (!osxsave || !avx || maxLeaf < 7) return RASTER_SSE2;
+
+    // The OS must save YMM state across context switches (XCR0 bits 1 and 2).
+#if defined(_MSC_VER)
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    unsigned leaf7ebx = (unsigned)info[1];
+#else
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    unsigned long long xcr0 = ((unsigned long long)edx << 32) | eax;
+    unsigned leaf7[4] = { 0, 0, 0, 0 };
+    __cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+    unsigned leaf7ebx = leaf7[1];
+#endif
+    if ((xcr0 & 6) != 6) return RASTER_SSE2;
+    return (leaf7ebx & (1u << 5)) ? RASTER_AVX2 : RASTER_SSE2;
+}
+
+inline int lowest_set_bit(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long i;
+    if (_BitScanForward(&i, (unsigned long)mask)) return (int)i;
+    _BitScanForward(&i, (unsigned long)(mask >> 32));
+    return (int)i + 32;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Per-edge integer steps for one triangle inside one tile. Edge values are
+// E = a * x + b * y + c; col[i][k] holds a[i] * k so a block row is one add.
+typedef struct {
+    int32_t col[3][8];
+    int32_t row[3];
+} EdgeSteps;
+
+// Coverage of the 4x4 block whose top-left pixel has edge values e[0..2].
+// Bit (row * 4 + col) is set when all three edge values are >= 0, which is
+// exactly the test the scalar loop performs.
+inline unsigned coverage_4x4_sse2(const EdgeSteps& s, const int32_t e[3]) {
+    __m128i w0 = _mm_add_epi32(_mm_set1_epi32(e[0]), _mm_loadu_si128((const __m128i*)s.col[0]));
+    __m128i w1 = _mm_add_epi32(_mm_set1_epi32(e[1]), _mm_loadu_si128((const __m128i*)s.col[1]));
+    __m128i w2 = _mm_add_epi32(_mm_set1_epi32(e[2]), _mm_loadu_si128((const __m128i*)s.col[2]));
+    const __m128i r0 = _mm_set1_epi32(s.row[0]);
+    const __m128i r1 = _mm_set1_epi32(s.row[1]);
+    const __m128i r2 = _mm_set1_epi32(s.row[2]);
+
+    unsigned mask = 0;
+    for (int row = 0; row < 4; ++row) {
+        __m128i any = _mm_or_si128(_mm_or_si128(w0, w1), w2);
+        mask |= (~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(any)) & 0xFu) << (row * 4);
+        w0 = _mm_add_epi32(w0, r0);
+        w1 = _mm_add_epi32(w1, r1);
+        w2 = _mm_add_epi32(w2, r2);
+    }
+    return mask;
+}
+
+// 8x8 block built from four 4x4 SSE2 tests; bit (row * 8 + col).
+inline uint64_t coverage_8x8_sse2(const EdgeSteps& s, const int32_t e[3]) {
+    uint64_t mask = 0;
+    for (int q = 0; q < 4; ++q) {
+        int qx = (q & 1) * 4, qy = (q >> 1) * 4;
+        int32_t eq[3];
+        for (int i = 0; i < 3; ++i) eq[i] = e[i] + s.col[i][qx] + s.row[i] * qy;
+        unsigned m = coverage_4x4_sse2(s, eq);
+        for (int row = 0; row < 4; ++row)
+            mask |= (uint64_t)((m >> (row * 4)) & 0xFu) << ((qy + row) * 8 + qx);
+    }
+    return mask;
+}
+
+// Reference 8x8 coverage with one add per edge per pixel.
+inline uint64_t coverage_8x8_scalar(const EdgeSteps& s, const int32_t e[3]) {
+    uint64_t mask = 0;
+    int32_t row0 = e[0], row1 = e[1], row2 = e[2];
+    for (int row = 0; row < 8; ++row) {
+        int32_t w0 = row0, w1 = row1, w2 = row2;
+        for (int col = 0; col < 8; ++col) {
+            if ((w0 | w1 | w2) >= 0) mask |= (uint64_t)1 << (row * 8 + col);
+            w0 += s.col[0][1];
+            w1 += s.col[1][1];
+            w2 += s.col[2][1];
+        }
+        row0 += s.row[0];
+        row1 += s.row[1];
+        row2 += s.row[2];
+    }
+    return mask;
+}
+
+// 8x8 variant of coverage_4x4_sse2(); bit (row * 8 + col).
+RASTER_TARGET_AVX2
+inline uint64_t coverage_8x8_avx2(const EdgeSteps& s, const int32_t e[3]) {
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(e[0]), _mm256_loadu_si256((const __m256i*)s.col[0]));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(e[1]), _mm256_loadu_si256((const __m256i*)s.col[1]));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(e[2]), _mm256_loadu_si256((const __m256i*)s.col[2]));
+    const __m256i r0 = _mm256_set1_epi32(s.row[0]);
+    const __m256i r1 = _mm256_set1_epi32(s.row[1]);
+    const __m256i r2 = _mm256_set1_epi32(s.row[2]);
+
+    uint64_t mask = 0;
+    for (int row = 0; row < 8; ++row) {
+        __m256i any = _mm256_or_si256(_mm256_or_si256(w0, w1), w2);
+        mask |= (uint64_t)(~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(any)) & 0xFFu) << (row * 8);
+        w0 = _mm256_add_epi32(w0, r0);
+        w1 = _mm256_add_epi32(w1, r1);
+        w2 = _mm256_add_epi32(w2, r2);
+    }
+    return mask;
+}
+
+typedef uint64_t (*BlockCoverageFunc)(const EdgeSteps& s, const int32_t e[3]);
+
+inline BlockCoverageFunc block_coverage_func(RasterPath path) {
+    switch (path) {
+    case RASTER_AVX2: return coverage_8x8_avx2;
+    case RASTER_SSE2: return coverage_8x8_sse2;
+    default: return coverage_8x8_scalar;
+    }
+}
+
+#endif
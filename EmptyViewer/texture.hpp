@@ -0,0 +1,413 @@
+#ifndef TEXTURE_HPP
+#define TEXTURE_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "framebuffer.hpp"
+#include "image_io.hpp"
+#include "thread_pool.hpp"
+
+// Order of the texels within each mip level.
+//   TEXTURE_LINEAR: row by row.
+//   TEXTURE_MORTON: Z-order, the bits of x and y interleaved, so texels that
+//     are close in both directions are close in memory whatever the angle
+//     the surface is seen at, and the four children of a texel are adjacent.
+enum TextureLayout {
+    TEXTURE_LINEAR,
+    TEXTURE_MORTON
+};
+
+// How a sample picks and blends texels.
+//   FILTER_BILINEAR: the base level only.
+//   FILTER_MIPMAP: bilinear in the level nearest the footprint.
+//   FILTER_TRILINEAR: bilinear in the two levels around it, blended.
+enum TextureFilter {
+    FILTER_BILINEAR,
+    FILTER_MIPMAP,
+    FILTER_TRILINEAR
+};
+
+inline const char* texture_layout_name(TextureLayout layout) {
+    return layout == TEXTURE_MORTON ? "morton" : "linear";
+}
+
+inline const char* texture_filter_name(TextureFilter filter) {
+    switch (filter) {
+    case FILTER_BILINEAR: return "bilinear";
+    case FILTER_MIPMAP: return "mipmap";
+    default: return "trilinear";
+    }
+}
+
+// Largest base level side; images are resampled to power-of-two sides.
+#define TEXTURE_MAX_SIZE 16384
+#define TEXTURE_MAX_LEVELS 15
+
+// Power of two nearest to n (ties round up), at most TEXTURE_MAX_SIZE.
+inline int texture_size(int n) {
+    int p = 1;
+    while (p < TEXTURE_MAX_SIZE && 2 * n >= 3 * p) p *= 2;
+    return p;
+}
+
+// Spreads the low 16 bits of v to the even bits.
+inline uint32_t morton_spread(uint32_t v) {
+    v &= 0xFFFF;
+    v = (v | v << 8) & 0x00FF00FF;
+    v = (v | v << 4) & 0x0F0F0F0F;
+    v = (v | v << 2) & 0x33333333;
+    return (v | v << 1) & 0x55555555;
+}
+
+inline __m128i morton_spread4(__m128i v) {
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 8)), _mm_set1_epi32(0x00FF00FF));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 4)), _mm_set1_epi32(0x0F0F0F0F));
+    v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 2)), _mm_set1_epi32(0x33333333));
+    return _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 1)), _mm_set1_epi32(0x55555555));
+}
+
+// Mipmapped RGB texture. Channels are stored as 8-bit square roots of
+// linear intensity, so decoding is one multiply and filtering happens in
+// linear light at a precision close to 8-bit sRGB. Texel (0, 0) is the
+// bottom-left corner of the image, matching OBJ texture coordinates, and
+// coordinates repeat outside [0, 1).
+class Texture {
+public:
+    Texture() {}
+    Texture(const Texture&) = delete;
+    Texture& operator=(const Texture&) = delete;
+
+    // Builds the mip chain of `image` (gamma-encoded RGB, top row first),
+    // resampled to power-of-two sides. Returns false for an empty image.
+    bool create(const Image& image, TextureLayout layout, ThreadPool& pool) {
+        if (image.width <= 0 || image.height <= 0) return false;
+        order = layout;
+        int w = texture_size(image.width), h = texture_size(image.height);
+        size_t total = 0;
+        levelCount = 0;
+        for (;;) {
+            Level& l = levels[levelCount++];
+            l.width = w;
+            l.height = h;
+            l.widthBits = log2_int(w);
+            l.heightBits = log2_int(h);
+            l.shared = std::min(l.widthBits, l.heightBits);
+            l.offset = total;
+            l.xMask = address_x(l, (uint32_t)w - 1);
+            l.yMask = address_y(l, (uint32_t)h - 1);
+            total += ((size_t)w * h + 15) & ~(size_t)15;
+            if (w == 1 && h == 1) break;
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        texels = AlignedArray<uint32_t>(total);
+        build_base(image, pool);
+        for (int i = 1; i < levelCount; ++i) build_level(i, pool);
+        return true;
+    }
+
+    bool empty() const { return levelCount == 0; }
+    int width() const { return levels[0].width; }
+    int height() const { return levels[0].height; }
+    int level_count() const { return levelCount; }
+    size_t bytes() const { return texels.size() * sizeof(uint32_t); }
+    TextureLayout layout() const { return order; }
+
+    // Packed texel (red in the low byte) at integer coordinates of a level.
+    uint32_t texel(int level, int x, int y) const {
+        const Level& l = levels[level];
+        return texels[l.offset + (address_x(l, (uint32_t)x) | address_y(l, (uint32_t)y))];
+    }
+
+    // Level of detail for a footprint with texture coordinate derivatives
+    // along x and y: log2 of the longer side in base level texels.
+    float lod(float dudx, float dvdx, float dudy, float dvdy) const {
+        float w = (float)width(), h = (float)height();
+        float ax = dudx * w, ay = dvdx * h, bx = dudy * w, by = dvdy * h;
+        float rho2 = std::max(ax * ax + ay * ay, bx * bx + by * by);
+        return rho2 > 1.0f ? 0.5f * log2f(rho2) : 0.0f;
+    }
+
+    // Linear RGB of four samples sharing one level of detail (a quad).
+    void sample4(const float u[4], const float v[4], float lod, TextureFilter filter, __m128 rgb[3]) const {
+        __m128 us = _mm_loadu_ps(u), vs = _mm_loadu_ps(v);
+        int level;
+        float t;
+        pick_levels(lod, filter, level, t);
+        bilinear4(levels[level], us, vs, rgb);
+        if (t > 0.0f) {
+            __m128 next[3];
+            bilinear4(levels[level + 1], us, vs, next);
+            __m128 ts = _mm_set1_ps(t);
+            for (int c = 0; c < 3; ++c) rgb[c] = _mm_add_ps(rgb[c], _mm_mul_ps(_mm_sub_ps(next[c], rgb[c]), ts));
+        }
+    }
+
+    // One lane of sample4(), with the same operations in the same order.
+    void sample(float u, float v, float lod, TextureFilter filter, float rgb[3]) const {
+        int level;
+        float t;
+        pick_levels(lod, filter, level, t);
+        bilinear(levels[level], u, v, rgb);
+        if (t > 0.0f) {
+            float next[3];
+            bilinear(levels[level + 1], u, v, next);
+            for (int c = 0; c < 3; ++c) rgb[c] = rgb[c] + (next[c] - rgb[c]) * t;
+        }
+    }
+
+private:
+    typedef struct {
+        int width, height;
+        int widthBits, heightBits;
+        int shared;         // min(widthBits, heightBits): interleaved bits
+        uint32_t xMask;     // address bits holding x
+        uint32_t yMask;     // address bits holding y
+        size_t offset;      // of texel 0 in `texels`
+    } Level;
+
+    static int log2_int(int v) {
+        int bits = 0;
+        while ((1 << bits) < v) ++bits;
+        return bits;
+    }
+
+    // A texel's address is address_x(x) | address_y(y). In Morton order the
+    // low `shared` bits of x and y are interleaved (x in the even bits) and
+    // the remaining high bits of the longer side go above them. Either way
+    // the address of the next texel along an axis, wrapping around, is the
+    // masked increment next_address(), so only one corner of a bilinear
+    // footprint needs the full computation.
+    static uint32_t next_address(uint32_t a, uint32_t mask) {
+        return ((a | ~mask) + 1) & mask;
+    }
+
+    static __m128i next_address4(__m128i a, uint32_t mask) {
+        __m128i m = _mm_set1_epi32((int)mask);
+        return _mm_and_si128(_mm_sub_epi32(_mm_or_si128(a, _mm_xor_si128(m, _mm_set1_epi32(-1))), _mm_set1_epi32(-1)), m);
+    }
+
+    uint32_t address_x(const Level& l, uint32_t x) const {
+        if (order == TEXTURE_LINEAR) return x;
+        return morton_spread(x & ((1u << l.shared) - 1)) | (x >> l.shared) << (2 * l.shared);
+    }
+
+    uint32_t address_y(const Level& l, uint32_t y) const {
+        if (order == TEXTURE_LINEAR) return y << l.widthBits;
+        return morton_spread(y & ((1u << l.shared) - 1)) << 1 | (y >> l.shared) << (2 * l.shared);
+    }
+
+    // Coordinates are already wrapped, so a square level has no high bits.
+    __m128i address_x4(const Level& l, __m128i x) const {
+        if (order == TEXTURE_LINEAR) return x;
+        if (l.widthBits == l.heightBits) return morton_spread4(x);
+        __m128i low = morton_spread4(_mm_and_si128(x, _mm_set1_epi32((1 << l.shared) - 1)));
+        __m128i high = _mm_sll_epi32(_mm_srl_epi32(x, _mm_cvtsi32_si128(l.shared)), _mm_cvtsi32_si128(2 * l.shared));
+        return _mm_or_si128(low, high);
+    }
+
+    __m128i address_y4(const Level& l, __m128i y) const {
+        if (order == TEXTURE_LINEAR) return _mm_sll_epi32(y, _mm_cvtsi32_si128(l.widthBits));
+        if (l.widthBits == l.heightBits) return _mm_slli_epi32(morton_spread4(y), 1);
+        __m128i low = _mm_slli_epi32(morton_spread4(_mm_and_si128(y, _mm_set1_epi32((1 << l.shared) - 1))), 1);
+        __m128i high = _mm_sll_epi32(_mm_srl_epi32(y, _mm_cvtsi32_si128(l.shared)), _mm_cvtsi32_si128(2 * l.shared));
+        return _mm_or_si128(low, high);
+    }
+
+    // First level to sample and the weight of the next one.
+    void pick_levels(float lod, TextureFilter filter, int& level, float& t) const {
+        level = 0;
+        t = 0.0f;
+        if (filter == FILTER_BILINEAR || !(lod > 0.0f)) return;
+        float last = (float)(levelCount - 1);
+        if (lod >= last) {
+            level = levelCount - 1;
+        } else if (filter == FILTER_MIPMAP) {
+            level = (int)(lod + 0.5f);
+        } else {
+            level = (int)lod;
+            t = lod - (float)level;
+        }
+    }
+
+    // Sample positions in texels, clamped so they convert to int (a NaN
+    // becomes the lower bound), split into the repeated integer corner and
+    // the fraction towards the next texel.
+    static void texel_coords4(__m128 s, int size, __m128i& i0, __m128& f) {
+        __m128 x = _mm_sub_ps(_mm_mul_ps(s, _mm_set1_ps((float)size)), _mm_set1_ps(0.5f));
+        x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-8388607.0f)), _mm_set1_ps(8388607.0f));
+        __m128i i = _mm_cvttps_epi32(x);
+        i = _mm_add_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(i), x)));
+        f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+        i0 = _mm_and_si128(i, _mm_set1_epi32(size - 1));
+    }
+
+    static void texel_coords(float s, int size, uint32_t& i0, float& f) {
+        float x = s * (float)size - 0.5f;
+        x = x > -8388607.0f ? x : -8388607.0f;
+        x = x < 8388607.0f ? x : 8388607.0f;
+        int i = (int)x;
+        if ((float)i > x) --i;
+        f = x - (float)i;
+        i0 = (uint32_t)i & (uint32_t)(size - 1);
+    }
+
+    void bilinear4(const Level& l, __m128 u, __m128 v, __m128 rgb[3]) const {
+        __m128i x0, y0;
+        __m128 fx, fy;
+        texel_coords4(u, l.width, x0, fx);
+        texel_coords4(v, l.height, y0, fy);
+        x0 = address_x4(l, x0);
+        y0 = address_y4(l, y0);
+        __m128i x1 = next_address4(x0, l.xMask), y1 = next_address4(y0, l.yMask);
+        alignas(16) uint32_t a[4][4];
+        _mm_store_si128((__m128i*)a[0], _mm_or_si128(x0, y0));
+        _mm_store_si128((__m128i*)a[1], _mm_or_si128(x1, y0));
+        _mm_store_si128((__m128i*)a[2], _mm_or_si128(x0, y1));
+        _mm_store_si128((__m128i*)a[3], _mm_or_si128(x1, y1));
+
+        const uint32_t* base = texels.data() + l.offset;
+        __m128 c[4][3];
+        __m128i byte = _mm_set1_epi32(0xFF);
+        for (int k = 0; k < 4; ++k) {
+            __m128i t = _mm_set_epi32((int)base[a[k][3]], (int)base[a[k][2]], (int)base[a[k][1]], (int)base[a[k][0]]);
+            for (int ch = 0; ch < 3; ++ch) {
+                __m128 e = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(t, 8 * ch), byte));
+                c[k][ch] = _mm_mul_ps(e, e);
+            }
+        }
+        __m128 one = _mm_set1_ps(1.0f), gx = _mm_sub_ps(one, fx), gy = _mm_sub_ps(one, fy);
+        __m128 scale = _mm_set1_ps(1.0f / 65025.0f);
+        for (int ch = 0; ch < 3; ++ch) {
+            __m128 bottom = _mm_add_ps(_mm_mul_ps(c[0][ch], gx), _mm_mul_ps(c[1][ch], fx));
+            __m128 top = _mm_add_ps(_mm_mul_ps(c[2][ch], gx), _mm_mul_ps(c[3][ch], fx));
+            rgb[ch] = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(bottom, gy), _mm_mul_ps(top, fy)), scale);
+        }
+    }
+
+    void bilinear(const Level& l, float u, float v, float rgb[3]) const {
+        uint32_t x0, y0;
+        float fx, fy;
+        texel_coords(u, l.width, x0, fx);
+        texel_coords(v, l.height, y0, fy);
+        x0 = address_x(l, x0);
+        y0 = address_y(l, y0);
+        uint32_t x1 = next_address(x0, l.xMask), y1 = next_address(y0, l.yMask);
+        const uint32_t* base = texels.data() + l.offset;
+        uint32_t t[4] = { base[x0 | y0], base[x1 | y0], base[x0 | y1], base[x1 | y1] };
+        float gx = 1.0f - fx, gy = 1.0f - fy;
+        for (int ch = 0; ch < 3; ++ch) {
+            float c[4];
+            for (int k = 0; k < 4; ++k) {
+                float e = (float)((t[k] >> (8 * ch)) & 0xFF);
+                c[k] = e * e;
+            }
+            float bottom = c[0] * gx + c[1] * fx;
+            float top = c[2] * gx + c[3] * fx;
+            rgb[ch] = (bottom * gy + top * fy) * (1.0f / 65025.0f);
+        }
+    }
+
+    static uint32_t encode_texel(const float rgb[3]) {
+        uint32_t t = 0xFF000000u;
+        for (int ch = 0; ch < 3; ++ch)
+            t |= (uint32_t)(sqrtf(std::min(1.0f, std::max(0.0f, rgb[ch]))) * 255.0f + 0.5f) << (8 * ch);
+        return t;
+    }
+
+    // Base level: the image resampled bilinearly in linear light, repeating
+    // at the edges like the sampler does, one job per band of rows.
+    void build_base(const Image& image, ThreadPool& pool) {
+        float linear[256];
+        for (int i = 0; i < 256; ++i) linear[i] = powf((float)i / 255.0f, 2.2f);
+        const Level& l = levels[0];
+        int iw = image.width, ih = image.height;
+        float sx = (float)iw / (float)l.width, sy = (float)ih / (float)l.height;
+        // Source columns and weight of the second one, shared by every row.
+        std::vector<int> col0(l.width), col1(l.width);
+        std::vector<float> colWeight(l.width);
+        for (int x = 0; x < l.width; ++x) {
+            float fx = ((float)x + 0.5f) * sx - 0.5f;
+            int x0 = (int)floorf(fx);
+            colWeight[x] = fx - (float)x0;
+            col0[x] = ((x0 % iw + iw) % iw) * 3;
+            col1[x] = (((x0 + 1) % iw + iw) % iw) * 3;
+        }
+        const int rows = 16;
+        pool.run((l.height + rows - 1) / rows, [&](int job, int) {
+            int yEnd = std::min(l.height, (job + 1) * rows);
+            for (int y = job * rows; y < yEnd; ++y) {
+                // Image rows run top to bottom, texture rows bottom to top.
+                float fy = ((float)y + 0.5f) * sy - 0.5f;
+                int y0 = (int)floorf(fy);
+                float wy = fy - (float)y0;
+                int r0 = ih - 1 - ((y0 % ih + ih) % ih), r1 = ih - 1 - (((y0 + 1) % ih + ih) % ih);
+                const unsigned char* row0 = &image.rgb[(size_t)r0 * iw * 3];
+                const unsigned char* row1 = &image.rgb[(size_t)r1 * iw * 3];
+                uint32_t ay = address_y(l, (uint32_t)y);
+                for (int x = 0; x < l.width; ++x) {
+                    int c0 = col0[x], c1 = col1[x];
+                    float wx = colWeight[x];
+                    float rgb[3];
+                    for (int ch = 0; ch < 3; ++ch) {
+                        float bottom = linear[row0[c0 + ch]] * (1.0f - wx) + linear[row0[c1 + ch]] * wx;
+                        float top = linear[row1[c0 + ch]] * (1.0f - wx) + linear[row1[c1 + ch]] * wx;
+                        rgb[ch] = bottom * (1.0f - wy) + top * wy;
+                    }
+                    texels[l.offset + (address_x(l, (uint32_t)x) | ay)] = encode_texel(rgb);
+                }
+            }
+        });
+    }
+
+    // Level i from level i - 1: each texel is the mean linear intensity of
+    // its two or four children. In Morton order the children of texel j are
+    // texels 2j.. or 4j.. of the finer level, so both levels are swept
+    // linearly; the row-major path reads the same children in the same
+    // order, so both layouts hold identical values.
+    void build_level(int i, ThreadPool& pool) {
+        const Level& fine = levels[i - 1];
+        const Level& l = levels[i];
+        int sx = fine.width > 1 ? 2 : 1, sy = fine.height > 1 ? 2 : 1, n = sx * sy;
+        const uint32_t* src = texels.data() + fine.offset;
+        uint32_t* dst = texels.data() + l.offset;
+        size_t count = (size_t)l.width * l.height;
+        const size_t block = 4096;
+        pool.run((int)((count + block - 1) / block), [&](int job, int) {
+            size_t end = std::min(count, (size_t)(job + 1) * block);
+            for (size_t j = (size_t)job * block; j < end; ++j) {
+                uint32_t children[4];
+                if (order == TEXTURE_MORTON) {
+                    for (int k = 0; k < n; ++k) children[k] = src[j * n + k];
+                } else {
+                    size_t x = j & (l.width - 1), y = j >> l.widthBits;
+                    for (int k = 0; k < n; ++k)
+                        children[k] = src[((y * sy + k / sx) << fine.widthBits) + x * sx + k % sx];
+                }
+                uint32_t t = 0xFF000000u;
+                for (int ch = 0; ch < 3; ++ch) {
+                    uint32_t sum = 0;
+                    for (int k = 0; k < n; ++k) {
+                        uint32_t e = (children[k] >> (8 * ch)) & 0xFF;
+                        sum += e * e;
+                    }
+                    t |= (uint32_t)(sqrtf((float)sum / (float)n) + 0.5f) << (8 * ch);
+                }
+                dst[j] = t;
+            }
+        });
+    }
+
+    TextureLayout order = TEXTURE_LINEAR;
+    int levelCount = 0;
+    Level levels[TEXTURE_MAX_LEVELS];
+    AlignedArray<uint32_t> texels;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that execute indexed jobs.
+// run() hands out job indices [0, numJobs) through an atomic counter and
+// returns once every job has finished; the calling thread works too.
+// Concurrent run() calls from different threads are serialized; a job must
+// not call run() on the pool executing it.
+class ThreadPool {
+public:
+    typedef std::function<void(int job, int worker)> JobFunc;
+
+    explicit ThreadPool(int numThreads = 0) {
+        if (numThreads <= 0) numThreads = (int)std::thread::hardware_concurrency();
+        if (numThreads <= 0) numThreads = 1;
+        // Worker 0 is the thread calling run().
+        for (int i = 1; i < numThreads; ++i)
+            workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)workers.size() + 1; }
+
+    void run(int numJobs, const JobFunc& func) {
+        if (numJobs <= 0) return;
+        if (workers.empty() || numJobs == 1) {
+            for (int i = 0; i < numJobs; ++i) func(i, 0);
+            return;
+        }
+        std::lock_guard<std::mutex> serialize(runMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &func;
+            jobCount = numJobs;
+            nextJob.store(0);
+            busyWorkers = (int)workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+
+        drain(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    void drain(int worker) {
+        for (;;) {
+            int i = nextJob.fetch_add(1);
+            if (i >= jobCount) break;
+            (*job)(i, worker);
+        }
+    }
+
+    void worker_loop(int worker) {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            drain(worker);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busyWorkers == 0) done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const JobFunc* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextJob{ 0 };
+    int busyWorkers = 0;
+    unsigned generation = 0;
+    bool quit = false;
+};
+
+#endif
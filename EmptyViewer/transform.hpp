@@ -0,0 +1,292 @@
+#ifndef TRANSFORM_HPP
+#define TRANSFORM_HPP
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "raster_simd.hpp"
+
+// 4x4 matrix, m[row][col], applied to column vectors: p' = M * p.
+typedef struct {
+    float m[4][4];
+} Mat4;
+
+inline Mat4 mat4_identity() {
+    Mat4 r = {};
+    for (int i = 0; i < 4; ++i) r.m[i][i] = 1.0f;
+    return r;
+}
+
+inline Mat4 mat4_multiply(const Mat4& a, const Mat4& b) {
+    Mat4 r;
+    for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 4; ++j)
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+    return r;
+}
+
+// Translation by (x, y, z), rotation by `angle` radians about +y, and
+// uniform scale.
+inline Mat4 mat4_translate(float x, float y, float z) {
+    Mat4 r = mat4_identity();
+    r.m[0][3] = x;
+    r.m[1][3] = y;
+    r.m[2][3] = z;
+    return r;
+}
+
+inline Mat4 mat4_rotate_y(float angle) {
+    Mat4 r = mat4_identity();
+    float c = cosf(angle), s = sinf(angle);
+    r.m[0][0] = c;  r.m[0][2] = s;
+    r.m[2][0] = -s; r.m[2][2] = c;
+    return r;
+}
+
+inline Mat4 mat4_scale(float s) {
+    Mat4 r = mat4_identity();
+    r.m[0][0] = r.m[1][1] = r.m[2][2] = s;
+    return r;
+}
+
+// Affine transform of point p (w = 1).
+inline void mat4_transform_point(const Mat4& a, const float p[3], float out[3]) {
+    for (int i = 0; i < 3; ++i) out[i] = a.m[i][0] * p[0] + a.m[i][1] * p[1] + a.m[i][2] * p[2] + a.m[i][3];
+}
+
+// Bound on the factor by which the upper 3x3 M stretches any direction:
+// the square root of the largest absolute row sum of M^T M, which is exact
+// for rotations with uniform scale. A sphere of radius r maps into one of
+// radius r * mat4_max_scale() around the transformed center.
+inline float mat4_max_scale(const Mat4& a) {
+    float s = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        float row = 0.0f;
+        for (int j = 0; j < 3; ++j)
+            row += fabsf(a.m[0][i] * a.m[0][j] + a.m[1][i] * a.m[1][j] + a.m[2][i] * a.m[2][j]);
+        s = fmaxf(s, row);
+    }
+    return sqrtf(s);
+}
+
+// Cofactor matrix of the upper 3x3 (its inverse transpose times the
+// determinant), which maps normals up to scale; returns the determinant.
+inline float mat4_normal_matrix(const Mat4& a, float out[3][3]) {
+    const float (*m)[4] = a.m;
+    for (int i = 0; i < 3; ++i) {
+        int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+        for (int j = 0; j < 3; ++j) {
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            out[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+        }
+    }
+    return m[0][0] * out[0][0] + m[0][1] * out[0][1] + m[0][2] * out[0][2];
+}
+
+// World to view transform of a camera at `eye` looking at `target`; the view
+// looks down -z with +y up.
+inline Mat4 mat4_look_at(const float eye[3], const float target[3], const float up[3]) {
+    float f[3] = { target[0] - eye[0], target[1] - eye[1], target[2] - eye[2] };
+    float len = sqrtf(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    f[0] /= len; f[1] /= len; f[2] /= len;
+
+    float s[3] = { f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2], f[0] * up[1] - f[1] * up[0] };
+    len = sqrtf(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+    s[0] /= len; s[1] /= len; s[2] /= len;
+
+    float u[3] = { s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0] };
+
+    Mat4 r = {};
+    for (int i = 0; i < 3; ++i) {
+        r.m[0][i] = s[i];
+        r.m[1][i] = u[i];
+        r.m[2][i] = -f[i];
+    }
+    r.m[0][3] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+    r.m[1][3] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+    r.m[2][3] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+    r.m[3][3] = 1.0f;
+    return r;
+}
+
+// Everything the vertex stage needs besides the positions: the full
+// model-view-projection matrix, the viewport size and the guard band, as
+// clip-space factors: the clip planes are |x| <= guardBandX * w and
+// |y| <= guardBandY * w, plus -w <= z <= w.
+typedef struct {
+    Mat4 mvp;
+    float width, height;
+    float guardBandX, guardBandY;
+} VertexTransform;
+
+// Clip planes as (x, y, z, w) dot products that are >= 0 inside; bit p of an
+// outcode is set when plane p fails (NaN fails every plane).
+#define CLIP_PLANES 6
+
+inline float clip_plane_distance(const VertexTransform& t, float x, float y, float z, float w, int plane) {
+    switch (plane) {
+    case 0: return x + t.guardBandX * w;
+    case 1: return t.guardBandX * w - x;
+    case 2: return y + t.guardBandY * w;
+    case 3: return t.guardBandY * w - y;
+    case 4: return z + w;
+    default: return w - z;
+    }
+}
+
+// Destination streams of the vertex stage, one entry per vertex. Screen
+// positions are only meaningful where cw > 0.
+typedef struct {
+    float* cx;
+    float* cy;
+    float* cz;
+    float* cw;
+    float* sx;
+    float* sy;
+    float* sz;
+    unsigned char* outcode;
+} VertexStreams;
+
+// Screen mapping shared by every kernel: the viewport mirrors x and raster
+// y points up; depth goes to [0, 1].
+//   sx = (1 - x / w) * 0.5 * width,  sy = (y / w + 1) * 0.5 * height
+// Each kernel evaluates the same float operations in the same order, so all
+// of them produce bit-identical streams.
+inline void transform_vertices_scalar(const VertexTransform& t,
+    const float* x, const float* y, const float* z, size_t begin, size_t end, const VertexStreams& out) {
+    const float (*M)[4] = t.mvp.m;
+    for (size_t i = begin; i < end; ++i) {
+        float c[4];
+        for (int r = 0; r < 4; ++r) c[r] = M[r][0] * x[i] + M[r][1] * y[i] + M[r][2] * z[i] + M[r][3];
+        out.cx[i] = c[0];
+        out.cy[i] = c[1];
+        out.cz[i] = c[2];
+        out.cw[i] = c[3];
+        out.sx[i] = (1.0f - c[0] / c[3]) * 0.5f * t.width;
+        out.sy[i] = (c[1] / c[3] + 1.0f) * 0.5f * t.height;
+        out.sz[i] = (c[2] / c[3] + 1.0f) * 0.5f;
+
+        unsigned code = 0;
+        for (int p = 0; p < CLIP_PLANES; ++p)
+            if (!(clip_plane_distance(t, c[0], c[1], c[2], c[3], p) >= 0.0f)) code |= 1u << p;
+        out.outcode[i] = (unsigned char)code;
+    }
+}
+
+// Outcodes of four vertices as one 32-bit lane each; the planes match
+// clip_plane_distance().
+inline __m128i clip_outcodes_sse2(const __m128 c[4], __m128 gx, __m128 gy) {
+    __m128 gxw = _mm_mul_ps(gx, c[3]), gyw = _mm_mul_ps(gy, c[3]);
+    __m128 d[CLIP_PLANES] = {
+        _mm_add_ps(c[0], gxw), _mm_sub_ps(gxw, c[0]),
+        _mm_add_ps(c[1], gyw), _mm_sub_ps(gyw, c[1]),
+        _mm_add_ps(c[2], c[3]), _mm_sub_ps(c[3], c[2])
+    };
+    const __m128 zero = _mm_setzero_ps();
+    __m128i code = _mm_setzero_si128();
+    for (int p = 0; p < CLIP_PLANES; ++p) {
+        __m128i fail = _mm_castps_si128(_mm_cmpnge_ps(d[p], zero));
+        code = _mm_or_si128(code, _mm_and_si128(fail, _mm_set1_epi32(1 << p)));
+    }
+    return code;
+}
+
+// Narrows four 32-bit outcodes to bytes and stores them.
+inline void store_outcodes_sse2(unsigned char* dst, __m128i code) {
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(code, code), _mm_setzero_si128());
+    int packed = _mm_cvtsi128_si32(bytes);
+    memcpy(dst, &packed, 4);
+}
+
+// Four vertices per iteration.
+inline void transform_vertices_sse2(const VertexTransform& t,
+    const float* x, const float* y, const float* z, size_t count, const VertexStreams& out) {
+    __m128 m[4][4];
+    for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c) m[r][c] = _mm_set1_ps(t.mvp.m[r][c]);
+    const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    const __m128 w4 = _mm_set1_ps(t.width), h4 = _mm_set1_ps(t.height);
+    const __m128 gx = _mm_set1_ps(t.guardBandX), gy = _mm_set1_ps(t.guardBandY);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+        __m128 c[4];
+        for (int r = 0; r < 4; ++r)
+            c[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], px), _mm_mul_ps(m[r][1], py)),
+                _mm_mul_ps(m[r][2], pz)), m[r][3]);
+        _mm_storeu_ps(out.cx + i, c[0]);
+        _mm_storeu_ps(out.cy + i, c[1]);
+        _mm_storeu_ps(out.cz + i, c[2]);
+        _mm_storeu_ps(out.cw + i, c[3]);
+        _mm_storeu_ps(out.sx + i, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, _mm_div_ps(c[0], c[3])), half), w4));
+        _mm_storeu_ps(out.sy + i, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_div_ps(c[1], c[3]), one), half), h4));
+        _mm_storeu_ps(out.sz + i, _mm_mul_ps(_mm_add_ps(_mm_div_ps(c[2], c[3]), one), half));
+        store_outcodes_sse2(out.outcode + i, clip_outcodes_sse2(c, gx, gy));
+    }
+    transform_vertices_scalar(t, x, y, z, i, count, out);
+}
+
+// Eight vertices per iteration; needs AVX, which every AVX2 CPU has.
+RASTER_TARGET_AVX2
+inline void transform_vertices_avx(const VertexTransform& t,
+    const float* x, const float* y, const float* z, size_t count, const VertexStreams& out) {
+    __m256 m[4][4];
+    for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c) m[r][c] = _mm256_set1_ps(t.mvp.m[r][c]);
+    const __m256 one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f);
+    const __m256 w8 = _mm256_set1_ps(t.width), h8 = _mm256_set1_ps(t.height);
+    const __m256 gx = _mm256_set1_ps(t.guardBandX), gy = _mm256_set1_ps(t.guardBandY);
+    const __m256 zero = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+        __m256 c[4];
+        for (int r = 0; r < 4; ++r)
+            c[r] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[r][0], px), _mm256_mul_ps(m[r][1], py)),
+                _mm256_mul_ps(m[r][2], pz)), m[r][3]);
+        _mm256_storeu_ps(out.cx + i, c[0]);
+        _mm256_storeu_ps(out.cy + i, c[1]);
+        _mm256_storeu_ps(out.cz + i, c[2]);
+        _mm256_storeu_ps(out.cw + i, c[3]);
+        _mm256_storeu_ps(out.sx + i, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, _mm256_div_ps(c[0], c[3])), half), w8));
+        _mm256_storeu_ps(out.sy + i, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(c[1], c[3]), one), half), h8));
+        _mm256_storeu_ps(out.sz + i, _mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(c[2], c[3]), one), half));
+
+        __m256 gxw = _mm256_mul_ps(gx, c[3]), gyw = _mm256_mul_ps(gy, c[3]);
+        __m256 d[CLIP_PLANES] = {
+            _mm256_add_ps(c[0], gxw), _mm256_sub_ps(gxw, c[0]),
+            _mm256_add_ps(c[1], gyw), _mm256_sub_ps(gyw, c[1]),
+            _mm256_add_ps(c[2], c[3]), _mm256_sub_ps(c[3], c[2])
+        };
+        __m256 code = _mm256_setzero_ps();
+        for (int p = 0; p < CLIP_PLANES; ++p) {
+            __m256 fail = _mm256_cmp_ps(d[p], zero, _CMP_NGE_UQ);
+            code = _mm256_or_ps(code, _mm256_and_ps(fail, _mm256_castsi256_ps(_mm256_set1_epi32(1 << p))));
+        }
+        __m256i codes = _mm256_castps_si256(code);
+        store_outcodes_sse2(out.outcode + i, _mm256_castsi256_si128(codes));
+        store_outcodes_sse2(out.outcode + i + 4, _mm256_extractf128_si256(codes, 1));
+    }
+    transform_vertices_scalar(t, x, y, z, i, count, out);
+}
+
+inline void transform_vertices_reference(const VertexTransform& t,
+    const float* x, const float* y, const float* z, size_t count, const VertexStreams& out) {
+    transform_vertices_scalar(t, x, y, z, 0, count, out);
+}
+
+typedef void (*TransformFunc)(const VertexTransform& t,
+    const float* x, const float* y, const float* z, size_t count, const VertexStreams& out);
+
+inline TransformFunc transform_func(RasterPath path) {
+    switch (path) {
+    case RASTER_AVX2: return transform_vertices_avx;
+    case RASTER_SSE2: return transform_vertices_sse2;
+    default: return transform_vertices_reference;
+    }
+}
+
+#endif